@@ -39,6 +39,8 @@
 #include <apr_time.h>
 #include <ap_mpm.h>
 #include <http_log.h>
+#include <util_filter.h>
+#include <apr_buckets.h>
 #include "mapcache.h"
 
 #ifndef _WIN32
@@ -221,12 +223,22 @@ static int write_http_response(mapcache_context_apache_request *ctx, mapcache_ht
          }
       }
    }
+   r->status = response->code;
    if(response->data) {
       ap_set_content_length(r,response->data->size);
       ap_rwrite((void*)response->data->buf, response->data->size, r);
+   } else if(response->file) {
+      /* let the core output filter send the file, with sendfile() if enabled */
+      apr_bucket_brigade *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+      ap_set_content_length(r,response->file->length);
+      apr_brigade_insert_file(bb, response->file->file, response->file->offset,
+            response->file->length, r->pool);
+      APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(r->connection->bucket_alloc));
+      if(ap_pass_brigade(r->output_filters, bb) != APR_SUCCESS) {
+         return AP_FILTER_ERROR;
+      }
    }
 
-   r->status = response->code;
    return OK;
 
 }
@@ -287,6 +299,7 @@ static int mod_mapcache_request_handler(request_rec *r) {
             url,original->path_info,global_ctx->config);
    } else if( request->type == MAPCACHE_REQUEST_GET_TILE) {
       mapcache_request_get_tile *req_tile = (mapcache_request_get_tile*)request;
+      req_tile->accept_file = 1;
       http_response = mapcache_core_get_tile(global_ctx,req_tile);
    } else if( request->type == MAPCACHE_REQUEST_PROXY ) {
       mapcache_request_proxy *req_proxy = (mapcache_request_proxy*)request;
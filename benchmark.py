@@ -3,6 +3,7 @@
 import commands
 import os
 import re
+import sys
 
 def do_ab_call(url,nthreads,reqs):
     cmd="ab -k -c %d -n %d '%s'" % (nthreads,reqs,url)
@@ -20,19 +21,35 @@ def do_ab_call(url,nthreads,reqs):
     return summary
 
 base="http://localhost:8081"
-params="LAYERS=test,test3&FORMAT=image%2Fpng&SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&STYLES=&EXCEPTIONS=application%2Fvnd.ogc.se_inimage&SRS=EPSG%3A4326&BBOX=-2.8125,47.8125,0,50.625&WIDTH=256&HEIGHT=256"
-urls={}
 nreqs=400
 
-title="tile merging"
-filebase=title
+# usage: benchmark.py [scenario], defaults to the first one
+scenarios=[]
 
+params="LAYERS=test,test3&FORMAT=image%2Fpng&SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&STYLES=&EXCEPTIONS=application%2Fvnd.ogc.se_inimage&SRS=EPSG%3A4326&BBOX=-2.8125,47.8125,0,50.625&WIDTH=256&HEIGHT=256"
+urls={}
 urls['tilecache']="%s/%s?%s" % (base,'tilecache',params)
 urls['mapcache best compression']="%s/%s?%s" % (base,'mapcache-best',params)
 urls['mapcache default compression']="%s/%s?%s" % (base,'mapcache-default',params)
 urls['mapcache fast compression']="%s/%s?%s" % (base,'mapcache-fast',params)
 urls['mapcache png quantization']="%s/%s?%s" % (base,'mapcache-pngq',params)
 #urls['mapproxy']="http://localhost:8080/service?%s" % (params)
+scenarios.append(("tile merging",urls))
+
+# the same already seeded tile read from the tilesets "test-disk" (disk cache),
+# "test-tc" (tokyocabinet cache) and "test-tc-keepopen" (tokyocabinet cache with
+# <keep_open>true</keep_open>), all served under /mapcache
+tile="/mapcache/tms/1.0.0/%s@WGS84/5/40/20.png"
+urls={}
+urls['disk']=base+tile%('test-disk')
+urls['tokyocabinet']=base+tile%('test-tc')
+urls['tokyocabinet keep_open']=base+tile%('test-tc-keepopen')
+scenarios.append(("tokyocabinet",urls))
+
+title,urls = scenarios[0]
+if len(sys.argv) > 1:
+    title,urls = [sc for sc in scenarios if sc[0] == sys.argv[1]][0]
+filebase=title
 
 plotfile = open("%s.plot"%(filebase),"w")
 datafile = open("%s.dat"%(filebase),"w")
@@ -0,0 +1,201 @@
+/*
+ * microbenchmark of the disk cache read strategies (<read_strategy> in mapcache.xml)
+ *
+ * reads every tile of a set of files the way lib/cache_disk.c does, and reports the
+ * time per tile of each strategy:
+ *  - mmap: open, fstat, mmap, munmap, close
+ *  - pread: open, fstat, malloc, pread, free, close
+ *  - pread-reuse: same as pread, with a buffer reused from one tile to the next, as the
+ *    disk cache's read buffers do
+ * each byte of the tile is summed, as sending it to the client would touch it.
+ *
+ * it only needs a POSIX system, not mapcache or apr:
+ *    cc -O2 -o benchmark_diskread benchmark_diskread.c -lpthread
+ *    ./benchmark_diskread [-t threads] [-n passes] /path/to/a/seeded/cache
+ *    ./benchmark_diskread [-t threads] [-n passes] -g count minsize maxsize
+ * the first form reads the tiles found under a seeded disk cache, i.e. your tile size
+ * distribution. the second generates count files of uniformly distributed sizes in a
+ * temporary directory. the tiles are read once before timing, so that they are served
+ * from the page cache.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static char **files;
+static int nfiles, afiles;
+static long long totalsize;
+static int npasses = 5;
+
+enum { READ_MMAP, READ_PREAD, READ_PREAD_REUSE };
+static const char *strategies[] = {"mmap","pread","pread-reuse"};
+
+static int add_file(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+   if(type != FTW_F || !sb->st_size) return 0;
+   if(nfiles == afiles) {
+      afiles = afiles ? afiles*2 : 1024;
+      files = realloc(files, afiles*sizeof(char*));
+   }
+   files[nfiles++] = strdup(path);
+   totalsize += sb->st_size;
+   return 0;
+}
+
+static int generate(const char *dir, int count, int minsize, int maxsize) {
+   int i;
+   char *data = malloc(maxsize);
+   memset(data, 0x55, maxsize);
+   for(i=0;i<count;i++) {
+      char path[4096];
+      int fd, size = minsize + rand() % (maxsize - minsize + 1);
+      snprintf(path, sizeof(path), "%s/%d.png", dir, i);
+      fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+      if(fd < 0 || write(fd, data, size) != size) {
+         perror(path);
+         return -1;
+      }
+      close(fd);
+   }
+   free(data);
+   return 0;
+}
+
+struct job {
+   int strategy;
+   int first, step;
+   unsigned long sum;
+};
+
+static void *run(void *arg) {
+   struct job *job = arg;
+   char *reused = NULL;
+   size_t reusedsize = 0;
+   int pass, i;
+   for(pass=0; pass<npasses; pass++) {
+      for(i=job->first; i<nfiles; i+=job->step) {
+         struct stat st;
+         unsigned char *buf;
+         size_t j;
+         int fd = open(files[i], O_RDONLY);
+         if(fd < 0 || fstat(fd, &st)) {
+            perror(files[i]);
+            exit(1);
+         }
+         if(job->strategy == READ_MMAP) {
+            buf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(buf == MAP_FAILED) {
+               perror("mmap");
+               exit(1);
+            }
+         } else {
+            if(job->strategy == READ_PREAD_REUSE) {
+               if(reusedsize < (size_t)st.st_size) {
+                  reused = realloc(reused, st.st_size);
+                  reusedsize = st.st_size;
+               }
+               buf = (unsigned char*)reused;
+            } else {
+               buf = malloc(st.st_size);
+            }
+            if(pread(fd, buf, st.st_size, 0) != st.st_size) {
+               perror("pread");
+               exit(1);
+            }
+         }
+         for(j=0; j<(size_t)st.st_size; j++) {
+            job->sum += buf[j];
+         }
+         if(job->strategy == READ_MMAP) {
+            munmap(buf, st.st_size);
+         } else if(job->strategy == READ_PREAD) {
+            free(buf);
+         }
+         close(fd);
+      }
+   }
+   free(reused);
+   return NULL;
+}
+
+static double now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int main(int argc, char **argv) {
+   int nthreads = 1, strategy, i, opt;
+   char tmpdir[] = "/tmp/mapcache-diskread-XXXXXX";
+   int generated = 0;
+   while((opt = getopt(argc, argv, "t:n:g")) != -1) {
+      switch(opt) {
+         case 't': nthreads = atoi(optarg); break;
+         case 'n': npasses = atoi(optarg); break;
+         case 'g': generated = 1; break;
+         default: goto usage;
+      }
+   }
+   if(generated) {
+      if(argc - optind != 3 || !mkdtemp(tmpdir)) goto usage;
+      if(generate(tmpdir, atoi(argv[optind]), atoi(argv[optind+1]), atoi(argv[optind+2]))) return 1;
+      nftw(tmpdir, add_file, 16, FTW_PHYS);
+   } else {
+      if(argc - optind != 1) goto usage;
+      nftw(argv[optind], add_file, 16, FTW_PHYS);
+   }
+   if(!nfiles) {
+      fprintf(stderr, "no tiles found\n");
+      return 1;
+   }
+   printf("%d tiles, average size %lld bytes, %d threads, %d passes\n",
+         nfiles, totalsize/nfiles, nthreads, npasses);
+
+   /* a first read brings the tiles into the page cache */
+   {
+      struct job warmup = {READ_PREAD_REUSE, 0, 1, 0};
+      int passes = npasses;
+      npasses = 1;
+      run(&warmup);
+      npasses = passes;
+   }
+
+   for(strategy=READ_MMAP; strategy<=READ_PREAD_REUSE; strategy++) {
+      pthread_t *threads = malloc(nthreads*sizeof(pthread_t));
+      struct job *jobs = calloc(nthreads, sizeof(struct job));
+      double start = now(), elapsed;
+      for(i=0;i<nthreads;i++) {
+         jobs[i].strategy = strategy;
+         jobs[i].first = i;
+         jobs[i].step = nthreads;
+         pthread_create(&threads[i], NULL, run, &jobs[i]);
+      }
+      for(i=0;i<nthreads;i++) {
+         pthread_join(threads[i], NULL);
+      }
+      elapsed = now() - start;
+      printf("%-12s %8.2f us/tile %10.0f tiles/s\n", strategies[strategy],
+            elapsed*1e6/((double)nfiles*npasses/nthreads), (double)nfiles*npasses/elapsed);
+      free(threads);
+      free(jobs);
+   }
+
+   if(generated) {
+      for(i=0;i<nfiles;i++) unlink(files[i]);
+      rmdir(tmpdir);
+   }
+   return 0;
+
+usage:
+   fprintf(stderr, "usage: %s [-t threads] [-n passes] cachedir\n"
+         "       %s [-t threads] [-n passes] -g count minsize maxsize\n", argv[0], argv[0]);
+   return 1;
+}
@@ -50,6 +50,7 @@
 
 #include <assert.h>
 #include <apr_time.h>
+#include <apr_file_io.h>
 
 #ifdef USE_PCRE
 #include <pcre.h>
@@ -88,6 +89,7 @@ typedef struct mapcache_tileset mapcache_tileset;
 typedef struct mapcache_cache mapcache_cache;
 typedef struct mapcache_source mapcache_source;
 typedef struct mapcache_buffer mapcache_buffer;
+typedef struct mapcache_file_ref mapcache_file_ref;
 typedef struct mapcache_tile mapcache_tile;
 typedef struct mapcache_metatile mapcache_metatile;
 typedef struct mapcache_feature_info mapcache_feature_info;
@@ -134,6 +136,15 @@ typedef struct mapcache_dimension_time mapcache_dimension_time;
 typedef struct mapcache_dimension_intervals mapcache_dimension_intervals;
 typedef struct mapcache_dimension_values mapcache_dimension_values;
 typedef struct mapcache_dimension_regex mapcache_dimension_regex;
+typedef struct mapcache_worker_pool mapcache_worker_pool;
+typedef struct mapcache_worker_batch mapcache_worker_batch;
+typedef struct mapcache_singleflight mapcache_singleflight;
+typedef struct mapcache_locker mapcache_locker;
+typedef struct mapcache_locker_disk mapcache_locker_disk;
+typedef struct mapcache_locker_shm mapcache_locker_shm;
+typedef struct mapcache_locker_memcache mapcache_locker_memcache;
+typedef struct mapcache_flight mapcache_flight;
+typedef struct mapcache_template mapcache_template;
 
 /** \defgroup utility Utility */
 /** @{ */
@@ -375,6 +386,14 @@ struct mapcache_cache {
 
     int (*tile_exists)(mapcache_context *ctx, mapcache_tile * tile);
 
+    /**
+     * check the existence of several tiles in a single call (optional)
+     *
+     * results[i] receives the value mapcache_cache::tile_exists() would have returned for tiles[i]
+     * \memberof mapcache_cache
+     */
+    void (*tile_multi_exists)(mapcache_context *ctx, mapcache_tile **tiles, int ntiles, int *results);
+
     /**
      * set tile content to cache
      * \memberof mapcache_cache
@@ -382,6 +401,14 @@ struct mapcache_cache {
     void (*tile_set)(mapcache_context *ctx, mapcache_tile * tile);
     void (*tile_multi_set)(mapcache_context *ctx, mapcache_tile *tiles, int ntiles);
 
+    /**
+     * get the content of several tiles in a single call (optional)
+     *
+     * results[i] receives the value mapcache_cache::tile_get() would have returned for tiles[i]
+     * \memberof mapcache_cache
+     */
+    void (*tile_multi_get)(mapcache_context *ctx, mapcache_tile **tiles, int ntiles, int *results);
+
     void (*configuration_parse_xml)(mapcache_context *ctx, ezxml_t xml, mapcache_cache * cache, mapcache_cfg *config);
     void (*configuration_post_config)(mapcache_context *ctx, mapcache_cache * cache, mapcache_cfg *config);
 };
@@ -390,12 +417,38 @@ struct mapcache_cache {
  * \brief a mapcache_cache on a filesytem
  * \implements mapcache_cache
  */
+typedef enum {
+    MAPCACHE_DISK_SYNC_NONE, /**< let the OS flush tiles to disk when it wants to */
+    MAPCACHE_DISK_SYNC_FILE, /**< flush the tile data before renaming it into place */
+    MAPCACHE_DISK_SYNC_FULL  /**< also flush the directory after the rename */
+} mapcache_disk_sync_policy;
+
+typedef enum {
+    MAPCACHE_DISK_READ_AUTO, /**< mmap tiles larger than mmap_threshold, pread the others */
+    MAPCACHE_DISK_READ_MMAP, /**< always mmap tiles */
+    MAPCACHE_DISK_READ_PREAD /**< always pread tiles into a reused buffer */
+} mapcache_disk_read_strategy;
+
+typedef enum {
+    MAPCACHE_DISK_DEDUP_NONE,
+    MAPCACHE_DISK_DEDUP_HARDLINK, /**< tiles are hard links to a shared copy of their content */
+    MAPCACHE_DISK_DEDUP_SYMLINK /**< tiles are symbolic links to a shared copy of their content */
+} mapcache_disk_dedup_mode;
+
 struct mapcache_cache_disk {
     mapcache_cache cache;
     char *base_directory;
     char *filename_template;
+    mapcache_template *filename_tpl; /**< filename_template, parsed */
     int symlink_blank;
+    mapcache_disk_dedup_mode dedup;
     int creation_retry;
+    mapcache_disk_sync_policy sync_policy;
+    mapcache_disk_read_strategy read_strategy;
+    apr_size_t mmap_threshold; /**< size in bytes from which tiles are mmapped in auto mode */
+    int bundle_size; /**< number of tiles along each side of a bundle, for the bundle layout */
+    void *dir_memo; /**< per-process memo of the directories known to exist */
+    void *read_buffers; /**< per-process list of the buffers tiles are read into */
 
     /**
      * Set filename for a given tile
@@ -408,9 +461,13 @@ struct mapcache_cache_disk {
 struct mapcache_cache_tiff {
     mapcache_cache cache;
     char *filename_template;
+    mapcache_template *filename_tpl; /**< filename_template, parsed */
     int count_x;
     int count_y;
     mapcache_image_format_jpeg *format;
+    int header_cache_size; /**< maximum number of parsed tiff headers (and open files) kept by each process */
+    int overviews; /**< number of lower zoom levels read from the internal overviews of each file */
+    void *headers; /**< the per-process cache of parsed tiff headers */
 };
 #endif
 
@@ -429,13 +486,26 @@ struct mapcache_cache_sqlite_stmt {
 struct mapcache_cache_sqlite {
    mapcache_cache cache;
    char *dbname_template;
+   mapcache_template *dbname_tpl; /**< dbname_template, parsed */
+   int count_x, count_y; /**< number of tiles per database file for {div_x} and {div_y} */
    int hitstats;
+   int hitstats_batch; /**< number of hits accumulated before being written */
+   apr_interval_time_t hitstats_interval; /**< maximum delay before accumulated hits are written */
+   void *hits; /**< hits waiting to be written, private to cache_sqlite.c */
+   int empty_markers; /**< store empty tiles as zero-length blobs */
+   int pool_size; /**< maximum number of connections kept open to each database file */
+   int max_open_files; /**< maximum number of database files with idle connections kept open */
+   apr_table_t *pragmas; /**< pragmas applied to every new connection */
+   int wal; /**< use the write-ahead log journal mode, with synchronous=NORMAL */
+   int wal_checkpoint; /**< wal size in pages triggering a checkpoint, -1 for the sqlite default */
+   void *connections; /**< per database file connection pools, private to cache_sqlite.c */
    mapcache_cache_sqlite_stmt create_stmt;
    mapcache_cache_sqlite_stmt exists_stmt;
    mapcache_cache_sqlite_stmt get_stmt;
    mapcache_cache_sqlite_stmt hitstat_stmt;
    mapcache_cache_sqlite_stmt set_stmt;
    mapcache_cache_sqlite_stmt delete_stmt;
+   mapcache_cache_sqlite_stmt set_image_stmt; /**< deduplicated mbtiles only: stores the image of a tile */
 };
 
 /**
@@ -451,7 +521,7 @@ struct mapcache_cache_bdb {
    mapcache_cache cache;
    apr_reslist_t *connection_pool;
    char *basedir;
-   char *key_template;
+   mapcache_template *key_template;
    mapcache_context *ctx;
 };
 mapcache_cache *mapcache_cache_bdb_create(mapcache_context *ctx);
@@ -461,10 +531,12 @@ mapcache_cache *mapcache_cache_bdb_create(mapcache_context *ctx);
 typedef struct mapcache_cache_tc mapcache_cache_tc;
 struct mapcache_cache_tc {
    mapcache_cache cache;
-   apr_reslist_t *connection_pool;
    char *basedir;
-   char *key_template;
+   mapcache_template *key_template;
    mapcache_context *ctx;
+   int keep_open; /**< keep the database open in each process instead of opening it for every operation */
+   apr_interval_time_t sync_interval; /**< delay between syncs of a database kept open */
+   void *handle; /**< the database handle shared by the threads of the process */
 };
 mapcache_cache *mapcache_cache_tc_create(mapcache_context *ctx);
 #endif
@@ -534,11 +606,27 @@ struct mapcache_request_get_tile {
     */
    int ntiles;
    mapcache_image_format *format;
-   
+
+   /**
+    * set by front-ends that can send a response body straight from a file,
+    * i.e. that handle mapcache_http_response::file
+    */
+   int accept_file;
+};
+
+/**
+ * \brief a region of a file, that can be sent to the client without reading it
+ */
+struct mapcache_file_ref {
+   apr_file_t *file; /**< open handle, valid until the request pool is destroyed */
+   const char *path;
+   apr_off_t offset;
+   apr_size_t length;
 };
 
 struct mapcache_http_response {
    mapcache_buffer *data;
+   mapcache_file_ref *file; /**< the response body, if data is NULL */
    apr_table_t *headers;
    long code;
    apr_time_t mtime;
@@ -898,6 +986,95 @@ struct mapcache_server_cfg {
 
 
 
+/** \defgroup lock Locking */
+
+/** @{ */
+typedef enum {
+    MAPCACHE_LOCKER_DISK,
+    MAPCACHE_LOCKER_FLOCK,
+    MAPCACHE_LOCKER_SHM,
+    MAPCACHE_LOCKER_MEMCACHE
+} mapcache_lock_type;
+
+/** \interface mapcache_locker
+ * \brief a mechanism to make sure a resource (i.e. a metatile) is only
+ * created by a single thread or process at a time
+ */
+struct mapcache_locker {
+    mapcache_lock_type type;
+
+    /**
+     * try to aquire the lock on the given resource, without blocking
+     * \param lock set to an opaque handle that must be passed to unlock()
+     * \returns MAPCACHE_TRUE if the lock was aquired
+     * \returns MAPCACHE_FALSE if the resource is locked by someone else
+     * \memberof mapcache_locker
+     */
+    int (*lock)(mapcache_context *ctx, mapcache_locker *self, char *resource, void **lock);
+
+    /**
+     * block until the lock on the given resource has been released
+     * \returns MAPCACHE_FALSE once the lock has been released by its owner
+     * \returns MAPCACHE_TRUE if the lock was found to be stale and was broken, in which
+     *          case the caller should try to aquire it again
+     * \memberof mapcache_locker
+     */
+    int (*wait)(mapcache_context *ctx, mapcache_locker *self, char *resource);
+
+    /**
+     * release a lock aquired with lock()
+     * \memberof mapcache_locker
+     */
+    void (*unlock)(mapcache_context *ctx, mapcache_locker *self, char *resource, void *lock);
+
+    void (*parse_xml)(mapcache_context *ctx, mapcache_locker *self, ezxml_t node);
+    void (*post_config)(mapcache_context *ctx, mapcache_locker *self, mapcache_cfg *cfg);
+};
+
+/**\class mapcache_locker_disk
+ * \brief lockfiles placed in a directory
+ *
+ * used both for the "disk" locker, that creates lockfiles exclusively and
+ * polls them until they disappear (and that works on network filesystems),
+ * and for the "flock" locker, where waiters sleep in a blocking flock() call
+ * \implements mapcache_locker
+ */
+struct mapcache_locker_disk {
+    mapcache_locker locker;
+    const char *dir; /**< defaults to the global <lock_dir> */
+    apr_interval_time_t retry_interval; /**< polling interval in microseconds, defaults to the global <lock_retry> */
+};
+
+/**\class mapcache_locker_shm
+ * \brief lock table placed in a shared memory segment, for processes of
+ * a single host forked from a common parent
+ * \implements mapcache_locker
+ */
+struct mapcache_locker_shm {
+    mapcache_locker locker;
+    int nslots; /**< maximum number of resources that can be locked concurrently */
+    void *table;
+};
+
+#ifdef USE_MEMCACHE
+/**\class mapcache_locker_memcache
+ * \brief locks stored as expiring keys on a set of memcache servers, to be
+ * shared by mapcache instances running on different nodes
+ * \implements mapcache_locker
+ */
+struct mapcache_locker_memcache {
+    mapcache_locker locker;
+    apr_memcache_t *memcache;
+    apr_interval_time_t retry_interval; /**< initial polling interval in microseconds, doubled after each poll */
+};
+#endif
+
+mapcache_locker* mapcache_locker_disk_create(mapcache_context *ctx);
+mapcache_locker* mapcache_locker_flock_create(mapcache_context *ctx);
+mapcache_locker* mapcache_locker_shm_create(mapcache_context *ctx);
+mapcache_locker* mapcache_locker_memcache_create(mapcache_context *ctx);
+/** @} */
+
 typedef enum {
    MAPCACHE_MODE_NORMAL,
    MAPCACHE_MODE_MIRROR_COMBINED,
@@ -974,7 +1151,38 @@ struct mapcache_cfg {
      */
     apr_interval_time_t lock_retry_interval; /* time in nanoseconds to wait before rechecking for lockfile presence */
 
+    /**
+     * the locker used to serialize metatile renderings. defaults to a disk locker
+     * in lockdir
+     */
+    mapcache_locker *locker;
+
+    /**
+     * time after which a lock is considered stale, and can be taken over by a waiting
+     * client. should be longer than the time it takes to render a metatile
+     */
+    apr_interval_time_t lock_timeout;
+
     int threaded_fetching;
+
+    /**
+     * maximum number of worker threads used to fetch tiles in parallel when
+     * threaded_fetching is enabled
+     */
+    int fetch_threads;
+
+    /**
+     * the persistent worker pool tile fetches are submitted to. created at
+     * post-config time, its threads are spawned on demand
+     */
+    mapcache_worker_pool *fetch_pool;
+
+    /**
+     * metatiles currently being rendered by a thread of this process, so that
+     * concurrent requests for the same metatile wait for its result instead of
+     * polling the lock
+     */
+    mapcache_singleflight *flights;
     
     /**
      * the uri where the base of the service is mapped
@@ -1072,6 +1280,23 @@ struct mapcache_tile {
      */
     mapcache_buffer *encoded_data;
     mapcache_image *raw_image;
+
+    /**
+     * set by the caller if the tile data can be returned in mapcache_tile::file
+     * instead of mapcache_tile::encoded_data. caches are free to ignore it
+     */
+    int accept_file;
+    mapcache_file_ref *file;
+
+    /**
+     * the tile is known to contain no data (i.e. it is fully transparent).
+     * set when splitting a metatile if the tileset has mapcache_tileset::empty_markers
+     * enabled, in which case caches may store a compact marker instead of the image data.
+     * set by caches returning such a marker from mapcache_cache::tile_get(), in which case
+     * mapcache_tile::encoded_data may be left NULL.
+     */
+    int nodata;
+
     apr_time_t mtime; /**< last modification time */
     int expires; /**< time in seconds after which the tile should be rechecked for validity */
     
@@ -1192,6 +1417,16 @@ struct mapcache_tileset {
      */
     mapcache_image *watermark;
 
+    /**
+     * store fully transparent tiles as "known empty" markers in caches that support them
+     */
+    int empty_markers;
+
+    /**
+     * pre-encoded empty tiles returned for tiles stored as empty markers, keyed by grid name
+     */
+    apr_hash_t *empty_tiles;
+
     /**
      * handle to the configuration this tileset belongs to
      */
@@ -1232,6 +1467,13 @@ int mapcache_grid_get_cell(mapcache_context *ctx, mapcache_grid *grid, double *b
  */
 void mapcache_tileset_tile_validate(mapcache_context *ctx, mapcache_tile *tile);
 
+/**
+ * \brief return the encoded image used for tiles stored as empty markers
+ *
+ * the returned buffer is a copy allocated from ctx->pool, that the caller may modify
+ */
+mapcache_buffer* mapcache_tileset_empty_tile(mapcache_context *ctx, mapcache_tileset *tileset, mapcache_grid_link *grid_link);
+
 /**
  * compute level for a given resolution
  * 
@@ -1247,6 +1489,14 @@ void mapcache_tileset_get_level(mapcache_context *ctx, mapcache_tileset *tileset
 void mapcache_grid_get_closest_level(mapcache_context *ctx, mapcache_grid *grid, double resolution, int *level);
 void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile);
 
+/**
+ * \brief finish fetching a tile once its cache has been queried
+ * @param ret the value returned by mapcache_cache::tile_get() or mapcache_cache::tile_multi_get()
+ *
+ * checks the tile for expiration, and renders it if it was not found in the cache
+ */
+void mapcache_tileset_tile_resolve(mapcache_context *ctx, mapcache_tile *tile, int ret);
+
 /**
  * \brief delete tile from cache
  * @param whole_metatile delete all the other tiles from the metatile to
@@ -1291,8 +1541,72 @@ void mapcache_tileset_configuration_check(mapcache_context *ctx, mapcache_tilese
 void mapcache_tileset_add_watermark(mapcache_context *ctx, mapcache_tileset *tileset, const char *filename);
 
 
-int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource);
-void mapcache_unlock_resource(mapcache_context *ctx, char *resource);
+/**
+ * \brief aquire the lock on a resource, or wait for it to be released by its current owner
+ * \param lock set to the handle to pass to mapcache_unlock_resource() if the lock was aquired
+ * \returns MAPCACHE_TRUE if the lock was aquired, MAPCACHE_FALSE if we waited for another
+ *          thread or process to release it
+ */
+int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource, void **lock);
+void mapcache_unlock_resource(mapcache_context *ctx, char *resource, void *lock);
+
+/* in workers.c */
+typedef void (*mapcache_worker_func)(mapcache_context *ctx, void *data);
+
+/**
+ * \brief create a bounded pool of worker threads
+ * \param max_threads the maximum number of threads the pool will grow to
+ *
+ * the pool is destroyed along with ctx->pool. threads are only spawned when
+ * jobs are submitted, so that the pool can be created before forking
+ */
+mapcache_worker_pool* mapcache_worker_pool_create(mapcache_context *ctx, int max_threads);
+
+/**
+ * \brief create a set of jobs whose completion can be waited for
+ */
+mapcache_worker_batch* mapcache_worker_batch_create(mapcache_context *ctx, mapcache_worker_pool *wp);
+
+/**
+ * \brief queue a job in the pool. func will be called with a context cloned from ctx
+ */
+void mapcache_worker_batch_push(mapcache_context *ctx, mapcache_worker_batch *batch,
+      mapcache_worker_func func, void *data);
+
+/**
+ * \brief wait for all the jobs of the batch to finish
+ *
+ * jobs of the batch that haven't been picked up by a worker yet are run by the
+ * calling thread. errors raised by the jobs are transferred to ctx
+ */
+void mapcache_worker_batch_wait(mapcache_context *ctx, mapcache_worker_batch *batch);
+
+/* in singleflight.c */
+mapcache_singleflight* mapcache_singleflight_create(mapcache_context *ctx);
+
+/**
+ * \brief register interest in the rendering of a resource
+ * \param leader set to MAPCACHE_TRUE if no other thread of this process is rendering
+ *        the resource: the caller must then render it and call mapcache_singleflight_land(),
+ *        otherwise the caller should call mapcache_singleflight_wait()
+ */
+mapcache_flight* mapcache_singleflight_join(mapcache_context *ctx, mapcache_singleflight *sf,
+      const char *key, int *leader);
+
+/**
+ * \brief hand over the rendered metatile to the waiting threads
+ * \param mt the rendered metatile, or NULL if the tiles were not rendered by the caller
+ */
+void mapcache_singleflight_land(mapcache_context *ctx, mapcache_singleflight *sf,
+      mapcache_flight *flight, mapcache_metatile *mt);
+
+/**
+ * \brief wait for the leader of the flight to finish rendering
+ * \return MAPCACHE_SUCCESS if the encoded tile data was handed over by the leader,
+ *         MAPCACHE_CACHE_MISS if the tile should be read back from the cache
+ */
+int mapcache_singleflight_wait(mapcache_context *ctx, mapcache_singleflight *sf,
+      mapcache_flight *flight, mapcache_tile *tile);
 
 mapcache_metatile* mapcache_tileset_metatile_get(mapcache_context *ctx, mapcache_tile *tile);
 void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *mt);
@@ -1374,9 +1688,66 @@ char* mapcache_util_str_sanitize(apr_pool_t *pool, const char *str, const char*
 
 char* mapcache_util_get_tile_dimkey(mapcache_context *ctx, mapcache_tile *tile, char* sanitized_chars, char *sanitize_to);
 
-char* mapcache_util_get_tile_key(mapcache_context *ctx, mapcache_tile *tile, char *template,
+char* mapcache_util_get_tile_key(mapcache_context *ctx, mapcache_tile *tile, mapcache_template *template,
         char* sanitized_chars, char *sanitize_to);
 
+/**
+ * \brief the elements a tile key template can be made of
+ */
+typedef enum {
+   MAPCACHE_TEMPLATE_LITERAL,
+   MAPCACHE_TEMPLATE_TILESET, /**< {tileset} */
+   MAPCACHE_TEMPLATE_GRID, /**< {grid} */
+   MAPCACHE_TEMPLATE_EXT, /**< {ext} */
+   MAPCACHE_TEMPLATE_DIM, /**< {dim} */
+   MAPCACHE_TEMPLATE_X, /**< {x} */
+   MAPCACHE_TEMPLATE_Y, /**< {y} */
+   MAPCACHE_TEMPLATE_Z, /**< {z} */
+   MAPCACHE_TEMPLATE_INV_X, /**< {inv_x} */
+   MAPCACHE_TEMPLATE_INV_Y, /**< {inv_y} */
+   MAPCACHE_TEMPLATE_INV_Z, /**< {inv_z} */
+   MAPCACHE_TEMPLATE_DIV_X, /**< {div_x} */
+   MAPCACHE_TEMPLATE_DIV_Y, /**< {div_y} */
+   MAPCACHE_TEMPLATE_INV_DIV_X, /**< {inv_div_x} */
+   MAPCACHE_TEMPLATE_INV_DIV_Y /**< {inv_div_y} */
+} mapcache_template_token_type;
+
+typedef struct {
+   mapcache_template_token_type type;
+   const char *literal; /**< for MAPCACHE_TEMPLATE_LITERAL tokens */
+   int len;
+} mapcache_template_token;
+
+/**
+ * \brief a tile key template, parsed once at configuration time into a list of
+ * literals and placeholders
+ */
+struct mapcache_template {
+   const char *template; /**< the original template string */
+   mapcache_template_token *tokens;
+   int ntokens;
+   int literal_len; /**< total length of the literal tokens */
+   int has_dim; /**< the template contains a {dim} placeholder */
+};
+
+/**
+ * \brief parse a tile key template
+ *
+ * unknown placeholders are kept as literals
+ */
+mapcache_template* mapcache_template_compile(mapcache_context *ctx, const char *template);
+
+/**
+ * \brief render a template for the given tile into a single string
+ * \param dimkey the string that replaces {dim}. only needed if template->has_dim. NULL keeps
+ *        the literal {dim} in the rendered key
+ * \param count_x {x} is rounded down to a multiple of count_x, and {div_x} is x/count_x. 1 for
+ *        templates that map a single tile per key
+ * \param count_y same as count_x, for y
+ */
+char* mapcache_template_render(mapcache_context *ctx, mapcache_template *template, mapcache_tile *tile,
+      const char *dimkey, int count_x, int count_y);
+
 /**\defgroup imageio Image IO */
 /** @{ */
 
@@ -165,6 +165,24 @@ static void _mapcache_cache_bdb_delete(mapcache_context *ctx, mapcache_tile *til
 }
 
 
+/*
+ * fill the tile from the data returned by the database: the encoded tile followed
+ * by its modification time. the data buffer, malloc'ed by bdb, is handed over to the tile
+ */
+static int _bdb_tile_from_data(mapcache_context *ctx, mapcache_tile *tile, DBT *data) {
+   apr_pool_cleanup_register(ctx->pool, data->data,(void*)free, apr_pool_cleanup_null);
+   if(data->size < sizeof(apr_time_t)) {
+      ctx->set_error(ctx,500,"bdb backend returned invalid data for tile %d %d %d",tile->x,tile->y,tile->z);
+      return MAPCACHE_FAILURE;
+   }
+   tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
+   tile->encoded_data->buf = data->data;
+   tile->encoded_data->size = data->size-sizeof(apr_time_t);
+   tile->encoded_data->avail = data->size;
+   tile->mtime = *((apr_time_t*)(&tile->encoded_data->buf[tile->encoded_data->size]));
+   return MAPCACHE_SUCCESS;
+}
+
 static int _mapcache_cache_bdb_get(mapcache_context *ctx, mapcache_tile *tile) {
    DBT key,data;
    struct bdb_env *benv = _bdb_get_conn(ctx,tile,1);
@@ -181,13 +199,7 @@ static int _mapcache_cache_bdb_get(mapcache_context *ctx, mapcache_tile *tile) {
 
 
    if(ret == 0) {
-      tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
-      tile->encoded_data->buf = data.data;
-      tile->encoded_data->size = data.size-sizeof(apr_time_t);
-      tile->encoded_data->avail = data.size;
-      apr_pool_cleanup_register(ctx->pool, tile->encoded_data->buf,(void*)free, apr_pool_cleanup_null);
-      tile->mtime = *((apr_time_t*)(&tile->encoded_data->buf[tile->encoded_data->size]));
-      ret = MAPCACHE_SUCCESS;
+      ret = _bdb_tile_from_data(ctx,tile,&data);
    } else if(ret == DB_NOTFOUND) {
       ret = MAPCACHE_CACHE_MISS;
    } else {
@@ -198,6 +210,90 @@ static int _mapcache_cache_bdb_get(mapcache_context *ctx, mapcache_tile *tile) {
    return ret;
 }
 
+struct bdb_lookup {
+   char *key;
+   int idx; /* index of the tile in the request */
+};
+
+static int _bdb_lookup_cmp(const void *a, const void *b) {
+   return strcmp(((const struct bdb_lookup*)a)->key, ((const struct bdb_lookup*)b)->key);
+}
+
+/*
+ * look several tiles up with a single connection and cursor. the keys are looked
+ * up in b-tree order, so that tiles whose keys share a prefix (e.g. a row of tiles
+ * with the default key template) are read from pages the cursor has just visited.
+ * if fetch is not set only the keys are looked up, and results receive
+ * MAPCACHE_TRUE or MAPCACHE_FALSE
+ */
+static void _bdb_multi_lookup(mapcache_context *ctx, mapcache_tile **tiles, int ntiles, int *results, int fetch) {
+   DBT key,data;
+   DBC *cursor;
+   int i,ret;
+   mapcache_cache_bdb *cache = (mapcache_cache_bdb*)tiles[0]->tileset->cache;
+   struct bdb_lookup *lookups = apr_palloc(ctx->pool, ntiles*sizeof(struct bdb_lookup));
+   struct bdb_env *benv;
+   for(i=0;i<ntiles;i++) {
+      lookups[i].key = mapcache_util_get_tile_key(ctx,tiles[i],cache->key_template,NULL,NULL);
+      GC_CHECK_ERROR(ctx);
+      lookups[i].idx = i;
+      results[i] = fetch?MAPCACHE_CACHE_MISS:MAPCACHE_FALSE;
+   }
+   qsort(lookups, ntiles, sizeof(struct bdb_lookup), _bdb_lookup_cmp);
+
+   benv = _bdb_get_conn(ctx,tiles[0],1);
+   GC_CHECK_ERROR(ctx);
+   ret = benv->db->cursor(benv->db, NULL, &cursor, 0);
+   if(ret) {
+      ctx->set_error(ctx,500,"bdb backend failure on cursor creation: %s",db_strerror(ret));
+      _bdb_release_conn(ctx,tiles[0],benv);
+      return;
+   }
+   for(i=0;i<ntiles;i++) {
+      mapcache_tile *tile = tiles[lookups[i].idx];
+      memset(&key, 0, sizeof(DBT));
+      memset(&data, 0, sizeof(DBT));
+      if(fetch) {
+         data.flags = DB_DBT_MALLOC;
+      } else {
+         /* a zero length partial read positions the cursor without copying the tile */
+         data.flags = DB_DBT_PARTIAL;
+      }
+      key.data = lookups[i].key;
+      key.size = strlen(lookups[i].key)+1;
+      ret = cursor->get(cursor, &key, &data, DB_SET);
+      if(ret == 0) {
+         if(fetch) {
+            results[lookups[i].idx] = _bdb_tile_from_data(ctx,tile,&data);
+            if(GC_HAS_ERROR(ctx)) break;
+         } else {
+            results[lookups[i].idx] = MAPCACHE_TRUE;
+         }
+      } else if(ret != DB_NOTFOUND) {
+         ctx->set_error(ctx,500,"bdb backend failure on tile lookup: %s",db_strerror(ret));
+         break;
+      }
+   }
+   cursor->close(cursor);
+   _bdb_release_conn(ctx,tiles[0],benv);
+}
+
+/**
+ * \brief get several tiles with a single connection and cursor
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_bdb_multi_get(mapcache_context *ctx, mapcache_tile **tiles, int ntiles, int *results) {
+   _bdb_multi_lookup(ctx,tiles,ntiles,results,1);
+}
+
+/**
+ * \brief check the existence of several tiles with a single connection and cursor
+ * \sa mapcache_cache::tile_multi_exists()
+ */
+static void _mapcache_cache_bdb_multi_exists(mapcache_context *ctx, mapcache_tile **tiles, int ntiles, int *results) {
+   _bdb_multi_lookup(ctx,tiles,ntiles,results,0);
+}
+
 static void _mapcache_cache_bdb_set(mapcache_context *ctx, mapcache_tile *tile) {
    DBT key,data;
    int ret;
@@ -287,9 +383,9 @@ static void _mapcache_cache_bdb_configuration_parse_xml(mapcache_context *ctx, e
       dcache->basedir = apr_pstrdup(ctx->pool,cur_node->txt);
    }
    if ((cur_node = ezxml_child(node,"key_template")) != NULL) {
-      dcache->key_template = apr_pstrdup(ctx->pool,cur_node->txt);
+      dcache->key_template = mapcache_template_compile(ctx,cur_node->txt);
    } else {
-      dcache->key_template = apr_pstrdup(ctx->pool,"{tileset}-{grid}-{dim}-{z}-{y}-{x}.{ext}");
+      dcache->key_template = mapcache_template_compile(ctx,"{tileset}-{grid}-{dim}-{z}-{y}-{x}.{ext}");
    }
    if(!dcache->basedir) {
       ctx->set_error(ctx,500,"dbd cache \"%s\" is missing <base> entry",cache->name);
@@ -338,7 +434,9 @@ mapcache_cache* mapcache_cache_bdb_create(mapcache_context *ctx) {
    cache->cache.type = MAPCACHE_CACHE_BDB;
    cache->cache.tile_delete = _mapcache_cache_bdb_delete;
    cache->cache.tile_get = _mapcache_cache_bdb_get;
+   cache->cache.tile_multi_get = _mapcache_cache_bdb_multi_get;
    cache->cache.tile_exists = _mapcache_cache_bdb_has_tile;
+   cache->cache.tile_multi_exists = _mapcache_cache_bdb_multi_exists;
    cache->cache.tile_set = _mapcache_cache_bdb_set;
    //cache->cache.tile_multi_set = _mapcache_cache_bdb_multiset;
    cache->cache.configuration_post_config = _mapcache_cache_bdb_configuration_post_config;
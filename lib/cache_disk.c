@@ -34,9 +34,16 @@
 #include <string.h>
 #include <errno.h>
 #include <apr_mmap.h>
+#include <apr_sha1.h>
 
-#ifdef HAVE_SYMLINK
+#ifndef _WIN32
 #include <unistd.h>
+#else
+#include <process.h>
+#endif
+#include <apr_portable.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
 #endif
 
 /**
@@ -79,6 +86,28 @@ static void _mapcache_cache_disk_blank_tile_key(mapcache_context *ctx, mapcache_
    }
 }
 
+/**
+ * \brief returns the string replacing {dim} in filename templates
+ * \private \memberof mapcache_cache_disk
+ */
+static const char* _mapcache_cache_disk_template_dimkey(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile) {
+   char *dimstring="";
+   const apr_array_header_t *elts;
+   int i;
+   if(!tile->dimensions || !dcache->filename_tpl->has_dim) {
+      return NULL;
+   }
+   elts = apr_table_elts(tile->dimensions);
+   i = elts->nelts;
+   while(i--) {
+      apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
+      /* replace dangerous characters by '#' */
+      const char *dimval = mapcache_util_str_sanitize(ctx->pool,entry->val,"/.",'#');
+      dimstring = apr_pstrcat(ctx->pool,dimstring,"#",entry->key,"#",dimval,NULL);
+   }
+   return dimstring;
+}
+
 /**
  * \brief return filename for given tile
  * 
@@ -89,7 +118,21 @@ static void _mapcache_cache_disk_blank_tile_key(mapcache_context *ctx, mapcache_
  */
 static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path) {
    mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
-   if(dcache->base_directory) {
+   if(dcache->base_directory && !tile->dimensions) {
+      /* most common case, build the whole path in a single allocation */
+      *path = apr_psprintf(ctx->pool,"%s/%s/%s/%02d/%03d/%03d/%03d/%03d/%03d/%03d.%s",
+            dcache->base_directory,
+            tile->tileset->name,
+            tile->grid_link->grid->name,
+            tile->z,
+            tile->x / 1000000,
+            (tile->x / 1000) % 1000,
+            tile->x % 1000,
+            tile->y / 1000000,
+            (tile->y / 1000) % 1000,
+            tile->y % 1000,
+            tile->tileset->format?tile->tileset->format->extension:"png");
+   } else if(dcache->base_directory) {
       char *start;
       _mapcache_cache_disk_base_tile_key(ctx, tile, &start);
       *path = apr_psprintf(ctx->pool,"%s/%02d/%03d/%03d/%03d/%03d/%03d/%03d.%s",
@@ -103,51 +146,8 @@ static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapca
             tile->y % 1000,
             tile->tileset->format?tile->tileset->format->extension:"png");
    } else {
-      *path = dcache->filename_template;
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{tileset}", tile->tileset->name);
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{grid}", tile->grid_link->grid->name);
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{ext}",
-            tile->tileset->format?tile->tileset->format->extension:"png");
-      if(strstr(*path,"{x}"))
-         *path = mapcache_util_str_replace(ctx->pool,*path, "{x}",
-               apr_psprintf(ctx->pool,"%d",tile->x));
-      else
-         *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_x}",
-               apr_psprintf(ctx->pool,"%d",
-                  tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1));
-      if(strstr(*path,"{y}"))
-         *path = mapcache_util_str_replace(ctx->pool,*path, "{y}",
-               apr_psprintf(ctx->pool,"%d",tile->y));
-      else
-         *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_y}",
-               apr_psprintf(ctx->pool,"%d",
-                  tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1));
-      if(strstr(*path,"{z}"))
-         *path = mapcache_util_str_replace(ctx->pool,*path, "{z}",
-               apr_psprintf(ctx->pool,"%d",tile->z));
-      else
-         *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_z}",
-               apr_psprintf(ctx->pool,"%d",
-                  tile->grid_link->grid->nlevels - tile->z - 1));
-      if(tile->dimensions) {
-         char *dimstring="";
-         const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
-         int i = elts->nelts;
-         while(i--) {
-            apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
-            char *dimval = apr_pstrdup(ctx->pool,entry->val);
-            char *iter = dimval;
-            while(*iter) {
-               /* replace dangerous characters by '#' */
-               if(*iter == '.' || *iter == '/') {
-                  *iter = '#';
-               }
-               iter++;
-            }
-            dimstring = apr_pstrcat(ctx->pool,dimstring,"#",entry->key,"#",dimval,NULL);
-         }
-         *path = mapcache_util_str_replace(ctx->pool,*path, "{dim}", dimstring);
-      }
+      *path = mapcache_template_render(ctx, dcache->filename_tpl, tile,
+            _mapcache_cache_disk_template_dimkey(ctx, dcache, tile), 1, 1);
    }
    if(!*path) {
       ctx->set_error(ctx,500, "failed to allocate tile key");
@@ -157,52 +157,8 @@ static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapca
 static void _mapcache_cache_disk_template_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path) {
    mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
 
-   *path = dcache->filename_template;
-   *path = mapcache_util_str_replace(ctx->pool,*path, "{tileset}", tile->tileset->name);
-   *path = mapcache_util_str_replace(ctx->pool,*path, "{grid}", tile->grid_link->grid->name);
-   *path = mapcache_util_str_replace(ctx->pool,*path, "{ext}",
-         tile->tileset->format?tile->tileset->format->extension:"png");
-
-   if(strstr(*path,"{x}"))
-     *path = mapcache_util_str_replace(ctx->pool,*path, "{x}",
-           apr_psprintf(ctx->pool,"%d",tile->x));
-   else
-     *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_x}",
-           apr_psprintf(ctx->pool,"%d",
-              tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1));
-   if(strstr(*path,"{y}"))
-     *path = mapcache_util_str_replace(ctx->pool,*path, "{y}",
-           apr_psprintf(ctx->pool,"%d",tile->y));
-   else
-     *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_y}",
-           apr_psprintf(ctx->pool,"%d",
-              tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1));
-   if(strstr(*path,"{z}"))
-     *path = mapcache_util_str_replace(ctx->pool,*path, "{z}",
-           apr_psprintf(ctx->pool,"%d",tile->z));
-   else
-     *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_z}",
-           apr_psprintf(ctx->pool,"%d",
-              tile->grid_link->grid->nlevels - tile->z - 1));
-   if(tile->dimensions) {
-     char *dimstring="";
-     const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
-     int i = elts->nelts;
-     while(i--) {
-       apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
-       char *dimval = apr_pstrdup(ctx->pool,entry->val);
-       char *iter = dimval;
-       while(*iter) {
-         /* replace dangerous characters by '#' */
-         if(*iter == '.' || *iter == '/') {
-           *iter = '#';
-         }
-         iter++;
-       }
-       dimstring = apr_pstrcat(ctx->pool,dimstring,"#",entry->key,"#",dimval,NULL);
-     }
-     *path = mapcache_util_str_replace(ctx->pool,*path, "{dim}", dimstring);
-   }
+   *path = mapcache_template_render(ctx, dcache->filename_tpl, tile,
+         _mapcache_cache_disk_template_dimkey(ctx, dcache, tile), 1, 1);
    
    if(!*path) {
       ctx->set_error(ctx,500, "failed to allocate tile key");
@@ -258,6 +214,142 @@ static void _mapcache_cache_disk_delete(mapcache_context *ctx, mapcache_tile *ti
 }
 
 
+/* number of read buffers kept for later requests */
+#define MAPCACHE_DISK_READ_BUFFERS 64
+/* larger read buffers are freed once used rather than kept */
+#define MAPCACHE_DISK_READ_BUFFER_MAX (256*1024)
+
+typedef struct _mapcache_disk_read_buffer _mapcache_disk_read_buffer;
+struct _mapcache_disk_read_buffer {
+   char *buf;
+   apr_size_t size;
+   mapcache_cache_disk *dcache;
+   _mapcache_disk_read_buffer *next;
+};
+
+/**
+ * per-process list of the buffers tiles are read into, so that reading a tile doesn't
+ * need a fresh allocation. a buffer is handed back when the pool it was acquired for
+ * is cleaned up, whichever thread does it: the fetch workers' pools are destroyed by
+ * the request thread
+ */
+typedef struct {
+   _mapcache_disk_read_buffer *head;
+   int count;
+#if APR_HAS_THREADS
+   apr_thread_mutex_t *mutex;
+#endif
+} _mapcache_disk_read_buffers;
+
+static apr_status_t _mapcache_disk_read_buffers_cleanup(void *data) {
+   _mapcache_disk_read_buffers *list = (_mapcache_disk_read_buffers*)data;
+   while(list->head) {
+      _mapcache_disk_read_buffer *b = list->head;
+      list->head = b->next;
+      free(b->buf);
+      free(b);
+   }
+   list->count = 0;
+   return APR_SUCCESS;
+}
+
+static void _mapcache_disk_read_buffers_create(mapcache_context *ctx, mapcache_cache_disk *dcache) {
+   _mapcache_disk_read_buffers *list = apr_pcalloc(ctx->pool, sizeof(_mapcache_disk_read_buffers));
+#if APR_HAS_THREADS
+   if(apr_thread_mutex_create(&list->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create disk cache read buffers mutex");
+      return;
+   }
+#endif
+   /* the buffers are malloc'ed, free the ones still in the list along with the configuration */
+   apr_pool_cleanup_register(ctx->pool, list, _mapcache_disk_read_buffers_cleanup, apr_pool_cleanup_null);
+   dcache->read_buffers = list;
+}
+
+static apr_status_t _mapcache_disk_read_buffer_release(void *data) {
+   _mapcache_disk_read_buffer *b = (_mapcache_disk_read_buffer*)data;
+   _mapcache_disk_read_buffers *list = (_mapcache_disk_read_buffers*)b->dcache->read_buffers;
+   if(b->size <= MAPCACHE_DISK_READ_BUFFER_MAX) {
+#if APR_HAS_THREADS
+      apr_thread_mutex_lock(list->mutex);
+#endif
+      if(list->count < MAPCACHE_DISK_READ_BUFFERS) {
+         b->next = list->head;
+         list->head = b;
+         list->count++;
+         b = NULL;
+      }
+#if APR_HAS_THREADS
+      apr_thread_mutex_unlock(list->mutex);
+#endif
+   }
+   if(b) {
+      free(b->buf);
+      free(b);
+   }
+   return APR_SUCCESS;
+}
+
+/*
+ * get a buffer of at least size bytes, valid until the request pool is cleaned up
+ */
+static char* _mapcache_disk_read_buffer_acquire(mapcache_context *ctx, mapcache_cache_disk *dcache, apr_size_t size) {
+   _mapcache_disk_read_buffers *list = (_mapcache_disk_read_buffers*)dcache->read_buffers;
+   _mapcache_disk_read_buffer *b;
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(list->mutex);
+#endif
+   b = list->head;
+   if(b) {
+      list->head = b->next;
+      list->count--;
+   }
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(list->mutex);
+#endif
+   if(!b) {
+      b = calloc(1, sizeof(_mapcache_disk_read_buffer));
+      if(!b) return apr_palloc(ctx->pool, size);
+      b->dcache = dcache;
+   }
+   if(b->size < size) {
+      char *buf = realloc(b->buf, size);
+      if(!buf) {
+         free(b->buf);
+         free(b);
+         return apr_palloc(ctx->pool, size);
+      }
+      b->buf = buf;
+      b->size = size;
+   }
+   apr_pool_cleanup_register(ctx->pool, b, _mapcache_disk_read_buffer_release, apr_pool_cleanup_null);
+   return b->buf;
+}
+
+/*
+ * read the len first bytes of the file, with pread() on its descriptor where available
+ */
+static apr_size_t _mapcache_cache_disk_read(apr_file_t *f, char *buf, apr_size_t len) {
+#ifndef _WIN32
+   apr_os_file_t fd;
+   apr_size_t total = 0;
+   if(apr_os_file_get(&fd, f) != APR_SUCCESS) {
+      return 0;
+   }
+   while(total < len) {
+      ssize_t bytes = pread(fd, buf + total, len - total, total);
+      if(bytes < 0 && errno == EINTR) continue;
+      if(bytes <= 0) break;
+      total += bytes;
+   }
+   return total;
+#else
+   apr_size_t bytes = 0;
+   apr_file_read_full(f, buf, len, &bytes);
+   return bytes;
+#endif
+}
+
 /**
  * \brief get file content of given tile
  * 
@@ -271,53 +363,73 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
    apr_finfo_t finfo;
    apr_status_t rv;
    apr_size_t size;
+   mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
+#ifndef NOMMAP
    apr_mmap_t *tilemmap;
+#endif
      
    ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
    if(GC_HAS_ERROR(ctx)) {
       return MAPCACHE_FAILURE;
    }
-   if((rv=apr_file_open(&f, filename, 
-#ifndef NOMMAP
-               APR_FOPEN_READ, APR_UREAD | APR_GREAD,
-#else
-               APR_FOPEN_READ|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,APR_OS_DEFAULT,
-#endif
-               ctx->pool)) == APR_SUCCESS) {
+   if(tile->accept_file) {
+      /* the front-end will send the file itself (i.e. with sendfile), we don't need to read it */
+      rv = apr_file_open(&f, filename, APR_FOPEN_READ|APR_FOPEN_BINARY|APR_FOPEN_SENDFILE_ENABLED,
+            APR_OS_DEFAULT, ctx->pool);
+   } else {
+      rv = apr_file_open(&f, filename, APR_FOPEN_READ|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool);
+   }
+   if(rv == APR_SUCCESS) {
       rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_MTIME, f);
+      tile->mtime = finfo.mtime;
       if(!finfo.size) {
-         ctx->set_error(ctx, 500, "tile %s has no data",filename);
-         return MAPCACHE_FAILURE;
+         /* a zero-byte file is an empty marker */
+         apr_file_close(f);
+         tile->nodata = 1;
+         return MAPCACHE_SUCCESS;
+      }
+
+      if(tile->accept_file) {
+         /* the handle is left open, it will be closed along with the request pool */
+         tile->file = apr_pcalloc(ctx->pool, sizeof(mapcache_file_ref));
+         tile->file->file = f;
+         tile->file->path = filename;
+         tile->file->offset = 0;
+         tile->file->length = finfo.size;
+         return MAPCACHE_SUCCESS;
       }
 
       size = finfo.size;
       /*
        * at this stage, we have a handle to an open file that contains data.
-       * idealy, we should aquire a read lock, in case the data contained inside the file
-       * is incomplete (i.e. if another process is currently writing to the tile).
-       * currently such a lock is not set, as we don't want to loose performance on tile accesses.
-       * any error that might happen at this stage should only occur if the tile isn't already cached,
-       * i.e. normally only once.
+       * no read lock is needed: tiles are written to a temporary file that is renamed
+       * into place once complete, so the file we opened can't be partially written.
        */
-      tile->mtime = finfo.mtime;
-      tile->encoded_data = mapcache_buffer_create(size,ctx->pool);
+      tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
 
 #ifndef NOMMAP
-
-      rv = apr_mmap_create(&tilemmap,f,0,finfo.size,APR_MMAP_READ,ctx->pool);
-      if(rv != APR_SUCCESS) {
-         char errmsg[120];
-         ctx->set_error(ctx, 500,  "mmap error: %s",apr_strerror(rv,errmsg,120));
-         return MAPCACHE_FAILURE;
-      }
-      tile->encoded_data->buf = tilemmap->mm;
-      tile->encoded_data->size = tile->encoded_data->avail = finfo.size;
-#else
-      //manually add the data to our buffer
-      apr_file_read(f,(void*)tile->encoded_data->buf,&size);
-      tile->encoded_data->size = size;
-      tile->encoded_data->avail = size;
+      if(dcache->read_strategy == MAPCACHE_DISK_READ_MMAP ||
+            (dcache->read_strategy == MAPCACHE_DISK_READ_AUTO && size >= dcache->mmap_threshold)) {
+         rv = apr_mmap_create(&tilemmap,f,0,finfo.size,APR_MMAP_READ,ctx->pool);
+         if(rv != APR_SUCCESS) {
+            char errmsg[120];
+            ctx->set_error(ctx, 500,  "mmap error: %s",apr_strerror(rv,errmsg,120));
+            return MAPCACHE_FAILURE;
+         }
+         tile->encoded_data->buf = tilemmap->mm;
+         tile->encoded_data->size = tile->encoded_data->avail = finfo.size;
+      } else
 #endif
+      {
+         /*
+          * for small tiles, setting up and tearing down a mapping costs more than
+          * copying the data into one of the cache's read buffers
+          */
+         tile->encoded_data->buf = _mapcache_disk_read_buffer_acquire(ctx, dcache, finfo.size);
+         tile->encoded_data->avail = finfo.size;
+         size = _mapcache_cache_disk_read(f, (char*)tile->encoded_data->buf, finfo.size);
+         tile->encoded_data->size = size;
+      }
       apr_file_close(f);
       if(tile->encoded_data->size != finfo.size) {
          ctx->set_error(ctx, 500,  "failed to copy image data, got %d of %d bytes",(int)size, (int)finfo.size);
@@ -336,6 +448,339 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
    }
 }
 
+/**
+ * \brief returns a unique name for a temporary file placed next to the given filename
+ * \private \memberof mapcache_cache_disk
+ */
+static char* _mapcache_cache_disk_tmp_filename(mapcache_context *ctx, const char *filename) {
+   return apr_psprintf(ctx->pool,"%s.%d.%lx.%"APR_TIME_T_FMT".tmp",filename,(int)getpid(),
+#if APR_HAS_THREADS
+         (unsigned long)apr_os_thread_current(),
+#else
+         0UL,
+#endif
+         apr_time_now());
+}
+
+/* maximum number of directories remembered by a disk cache before the memo is reset */
+#define MAPCACHE_DISK_DIR_MEMO_SIZE 4096
+
+/**
+ * per-process memo of the directories known to exist, so tile writes don't have
+ * to stat (and possibly create) every component of their path
+ */
+typedef struct {
+   apr_pool_t *pool;
+   apr_hash_t *dirs;
+#if APR_HAS_THREADS
+   apr_thread_mutex_t *mutex;
+#endif
+} _mapcache_disk_dir_memo;
+
+static apr_status_t _mapcache_disk_dir_memo_cleanup(void *data) {
+   _mapcache_disk_dir_memo *memo = (_mapcache_disk_dir_memo*)data;
+   apr_pool_destroy(memo->pool);
+   return APR_SUCCESS;
+}
+
+static void _mapcache_disk_dir_memo_create(mapcache_context *ctx, mapcache_cache_disk *dcache) {
+   _mapcache_disk_dir_memo *memo = apr_pcalloc(ctx->pool, sizeof(_mapcache_disk_dir_memo));
+   apr_status_t rv;
+   char errmsg[120];
+   /* the memo is cleared and filled by request threads, so it can't live in the shared configuration pool */
+   if((rv = apr_pool_create(&memo->pool, NULL)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create disk cache directory memo: %s", apr_strerror(rv,errmsg,120));
+      return;
+   }
+   apr_pool_cleanup_register(ctx->pool, memo, _mapcache_disk_dir_memo_cleanup, apr_pool_cleanup_null);
+   memo->dirs = apr_hash_make(memo->pool);
+#if APR_HAS_THREADS
+   if(apr_thread_mutex_create(&memo->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create disk cache directory memo mutex");
+      return;
+   }
+#endif
+   dcache->dir_memo = memo;
+}
+
+static int _mapcache_disk_dir_memo_has(_mapcache_disk_dir_memo *memo, const char *dirname) {
+   int found;
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(memo->mutex);
+#endif
+   found = (apr_hash_get(memo->dirs, dirname, APR_HASH_KEY_STRING) != NULL);
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(memo->mutex);
+#endif
+   return found;
+}
+
+static void _mapcache_disk_dir_memo_set(_mapcache_disk_dir_memo *memo, const char *dirname, int exists) {
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(memo->mutex);
+#endif
+   if(!exists) {
+      apr_hash_set(memo->dirs, dirname, APR_HASH_KEY_STRING, NULL);
+   } else if(!apr_hash_get(memo->dirs, dirname, APR_HASH_KEY_STRING)) {
+      char *key;
+      if(apr_hash_count(memo->dirs) >= MAPCACHE_DISK_DIR_MEMO_SIZE) {
+         /* start over rather than tracking usage, directories are cheap to re-check */
+         apr_pool_clear(memo->pool);
+         memo->dirs = apr_hash_make(memo->pool);
+      }
+      key = apr_pstrdup(memo->pool, dirname);
+      apr_hash_set(memo->dirs, key, APR_HASH_KEY_STRING, key);
+   }
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(memo->mutex);
+#endif
+}
+
+/**
+ * \brief creates the directory containing the given file
+ *
+ * directories that were already created or found by this process are skipped, unless
+ * \p force is set (i.e. after a write failed with ENOENT because the directory was
+ * removed behind our back)
+ * \private \memberof mapcache_cache_disk
+ */
+static void _mapcache_cache_disk_make_parent_dir(mapcache_context *ctx, mapcache_cache_disk *dcache,
+      const char *filename, int force) {
+   apr_status_t ret;
+   char errmsg[120];
+   _mapcache_disk_dir_memo *memo = (_mapcache_disk_dir_memo*)dcache->dir_memo;
+   char *dirname = apr_pstrdup(ctx->pool,filename);
+   char *lastslash = strrchr(dirname,'/');
+   if(!lastslash) return;
+   *lastslash = '\0';
+   if(force) {
+      _mapcache_disk_dir_memo_set(memo, dirname, MAPCACHE_FALSE);
+   } else if(_mapcache_disk_dir_memo_has(memo, dirname)) {
+      return;
+   }
+   if(APR_SUCCESS != (ret = apr_dir_make_recursive(dirname,APR_OS_DEFAULT,ctx->pool))) {
+       /* 
+        * apr_dir_make_recursive sometimes sends back this error, although it should not.
+        * ignore this one
+        */
+       if(!APR_STATUS_IS_EEXIST(ret)) {
+          ctx->set_error(ctx, 500, "failed to create directory %s: %s",dirname, apr_strerror(ret,errmsg,120));
+          return;
+       }
+   }
+   _mapcache_disk_dir_memo_set(memo, dirname, MAPCACHE_TRUE);
+}
+
+/**
+ * \brief flushes the directory entries containing the given file
+ * \private \memberof mapcache_cache_disk
+ */
+static void _mapcache_cache_disk_sync_parent_dir(mapcache_context *ctx, const char *filename) {
+#ifndef _WIN32
+   apr_file_t *d;
+   char *dirname = apr_pstrdup(ctx->pool,filename);
+   char *lastslash = strrchr(dirname,'/');
+   if(!lastslash) return;
+   *lastslash = '\0';
+   if(apr_file_open(&d,dirname,APR_FOPEN_READ,APR_OS_DEFAULT,ctx->pool) == APR_SUCCESS) {
+      apr_file_sync(d);
+      apr_file_close(d);
+   }
+#endif
+}
+
+/**
+ * \brief moves a fully written temporary file to its final location
+ *
+ * rename() atomically replaces any existing file or symlink, so readers see either
+ * the previous tile or the new one, never a partially written one
+ * \private \memberof mapcache_cache_disk
+ */
+static void _mapcache_cache_disk_commit(mapcache_context *ctx, mapcache_cache_disk *dcache,
+      const char *tmpname, const char *filename) {
+   apr_status_t ret;
+   char errmsg[120];
+   if((ret = apr_file_rename(tmpname,filename,ctx->pool)) != APR_SUCCESS) {
+      apr_file_remove(tmpname,ctx->pool);
+      ctx->set_error(ctx, 500, "failed to rename %s to %s: %s",tmpname,filename, apr_strerror(ret,errmsg,120));
+      return;
+   }
+   if(dcache->sync_policy == MAPCACHE_DISK_SYNC_FULL) {
+      _mapcache_cache_disk_sync_parent_dir(ctx,filename);
+   }
+}
+
+/**
+ * \brief writes a buffer to the given file, going through a temporary file
+ * \private \memberof mapcache_cache_disk
+ */
+static void _mapcache_cache_disk_write(mapcache_context *ctx, mapcache_cache_disk *dcache,
+      const char *filename, mapcache_buffer *data) {
+   apr_file_t *f;
+   apr_status_t ret;
+   apr_size_t bytes;
+   char errmsg[120];
+   char *tmpname = _mapcache_cache_disk_tmp_filename(ctx,filename);
+   int retry_count_create_file = 0;
+   int dir_refreshed = 0;
+
+   /*
+    * depending on configuration file creation will retry if it fails.
+    * this can happen on nfs mounted network storage.
+    * the solution is to create the containing directory again and retry the file creation.
+    */
+   while((ret = apr_file_open(&f, tmpname,
+         APR_FOPEN_CREATE|APR_FOPEN_EXCL|APR_FOPEN_WRITE|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,
+         APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
+
+      if(APR_STATUS_IS_ENOENT(ret) && !dir_refreshed) {
+         /* the directory is missing, our memo of existing directories is out of date */
+         dir_refreshed = 1;
+         _mapcache_cache_disk_make_parent_dir(ctx,dcache,filename,MAPCACHE_TRUE);
+         GC_CHECK_ERROR(ctx);
+         continue;
+      }
+
+      retry_count_create_file++;
+
+      if(retry_count_create_file > dcache->creation_retry) {
+         ctx->set_error(ctx, 500, "failed to create file %s: %s",tmpname, apr_strerror(ret,errmsg,120));
+         return; /* we could not create the file */
+      }
+      if(APR_STATUS_IS_EEXIST(ret)) {
+         tmpname = _mapcache_cache_disk_tmp_filename(ctx,filename);
+      } else {
+         _mapcache_cache_disk_make_parent_dir(ctx,dcache,filename,MAPCACHE_TRUE);
+         GC_CHECK_ERROR(ctx);
+      }
+   }
+
+   bytes = (apr_size_t)data->size;
+   ret = apr_file_write(f,(void*)data->buf,&bytes);
+   if(ret != APR_SUCCESS) {
+      ctx->set_error(ctx, 500,  "failed to write data to file %s (wrote %d of %d bytes): %s",tmpname, (int)bytes, (int)data->size, apr_strerror(ret,errmsg,120));
+   } else if(bytes != data->size) {
+      ctx->set_error(ctx, 500, "failed to write image data to %s, wrote %d of %d bytes", tmpname, (int)bytes, (int)data->size);
+   } else if(dcache->sync_policy != MAPCACHE_DISK_SYNC_NONE) {
+      /* apr_file_sync() flushes the apr buffers before calling fsync() */
+      if((ret = apr_file_sync(f)) != APR_SUCCESS) {
+         ctx->set_error(ctx, 500, "failed to sync file %s: %s",tmpname, apr_strerror(ret,errmsg,120));
+      }
+   }
+   if(GC_HAS_ERROR(ctx)) {
+      apr_file_close(f);
+      apr_file_remove(tmpname,ctx->pool);
+      return;
+   }
+   ret = apr_file_close(f);
+   if(ret != APR_SUCCESS) {
+      ctx->set_error(ctx, 500,  "failed to close file %s:%s",tmpname, apr_strerror(ret,errmsg,120));
+      apr_file_remove(tmpname,ctx->pool);
+      return; /* we could not create the file */
+   }
+
+   _mapcache_cache_disk_commit(ctx,dcache,tmpname,filename);
+}
+
+#ifdef HAVE_SYMLINK
+/**
+ * \brief atomically replace filename by a link to target
+ *
+ * the link is created under a temporary name and renamed over the tile, so an
+ * existing tile is replaced atomically.
+ * depending on configuration link creation will retry if it fails.
+ * this can happen on nfs mounted network storage.
+ * the solution is to create the containing directory again and retry the link creation.
+ * \returns 0 on success, or the errno of the failed link creation
+ * \private \memberof mapcache_cache_disk
+ */
+static int _mapcache_cache_disk_link(mapcache_context *ctx, mapcache_cache_disk *dcache,
+      const char *target, const char *filename, int symbolic) {
+   char *tmpname = _mapcache_cache_disk_tmp_filename(ctx,filename);
+   int retry_count_create_link = 0;
+   int dir_refreshed = 0;
+   while((symbolic ? symlink(target,tmpname) : link(target,tmpname)) != 0) {
+      int err = errno;
+      if(err == ENOENT && !dir_refreshed) {
+         dir_refreshed = 1;
+         _mapcache_cache_disk_make_parent_dir(ctx,dcache,filename,MAPCACHE_TRUE);
+         if(GC_HAS_ERROR(ctx)) return 0;
+         continue;
+      }
+      retry_count_create_link++;
+
+      if(retry_count_create_link > dcache->creation_retry) {
+         return err;
+      }
+      if(err == EEXIST) {
+         tmpname = _mapcache_cache_disk_tmp_filename(ctx,filename);
+      } else {
+         _mapcache_cache_disk_make_parent_dir(ctx,dcache,filename,MAPCACHE_TRUE);
+         if(GC_HAS_ERROR(ctx)) return 0;
+      }
+   }
+   _mapcache_cache_disk_commit(ctx,dcache,tmpname,filename);
+   return 0;
+}
+
+/**
+ * \brief store a tile as a link to a shared copy of its content
+ *
+ * the encoded data is stored once under blobs/, named after its sha1 sum. identical
+ * tiles are then linked to it, which saves disk space and, with hard links, page cache.
+ * \private \memberof mapcache_cache_disk
+ */
+static void _mapcache_cache_disk_dedup_set(mapcache_context *ctx, mapcache_cache_disk *dcache,
+      mapcache_tile *tile, const char *filename) {
+   unsigned char digest[APR_SHA1_DIGESTSIZE];
+   char hex[2*APR_SHA1_DIGESTSIZE+1];
+   apr_sha1_ctx_t sha;
+   apr_finfo_t finfo;
+   char *blobname;
+   int i, err;
+
+   apr_sha1_init(&sha);
+   apr_sha1_update_binary(&sha, (const unsigned char*)tile->encoded_data->buf, tile->encoded_data->size);
+   apr_sha1_final(digest, &sha);
+   for(i=0;i<APR_SHA1_DIGESTSIZE;i++) {
+      sprintf(&hex[2*i],"%02x",digest[i]);
+   }
+   blobname = apr_psprintf(ctx->pool,"%s/%s/%s/blobs/%.2s/%s.%s",
+         dcache->base_directory,
+         tile->tileset->name,
+         tile->grid_link->grid->name,
+         hex, hex+2,
+         tile->tileset->format?tile->tileset->format->extension:"png");
+
+   if(apr_stat(&finfo, blobname, APR_FINFO_SIZE, ctx->pool) != APR_SUCCESS ||
+         finfo.size != tile->encoded_data->size) {
+      /*
+       * no locking needed: concurrent writers would write the same content, and
+       * _mapcache_cache_disk_write replaces the blob atomically
+       */
+      _mapcache_cache_disk_make_parent_dir(ctx,dcache,blobname,MAPCACHE_FALSE);
+      GC_CHECK_ERROR(ctx);
+      _mapcache_cache_disk_write(ctx,dcache,blobname,tile->encoded_data);
+      GC_CHECK_ERROR(ctx);
+   }
+
+   err = _mapcache_cache_disk_link(ctx,dcache,blobname,filename,
+         dcache->dedup == MAPCACHE_DISK_DEDUP_SYMLINK);
+   GC_CHECK_ERROR(ctx);
+   if(err == EMLINK || err == EXDEV || err == EPERM) {
+      /* too many links to the blob, or links not supported here: store a plain copy */
+      _mapcache_cache_disk_write(ctx,dcache,filename,tile->encoded_data);
+   } else if(err) {
+      ctx->set_error(ctx, 500, "failed to link tile %s to %s: %s",filename, blobname, strerror(err));
+   }
+#ifdef DEBUG
+   else {
+      ctx->log(ctx, MAPCACHE_DEBUG, "linked tile %s to %s",filename,blobname);
+   }
+#endif
+}
+#endif /*HAVE_SYMLINK*/
+
 /**
  * \brief write tile data to disk
  * 
@@ -346,16 +791,12 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
  * \sa mapcache_cache::tile_set()
  */
 static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile) {
-   apr_size_t bytes;
-   apr_file_t *f;
-   apr_status_t ret;
-   char errmsg[120];
-   char *filename, *hackptr1, *hackptr2=NULL;
-   const int creation_retry = ((mapcache_cache_disk*)tile->tileset->cache)->creation_retry;
+   char *filename;
+   mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
 
 #ifdef DEBUG
    /* all this should be checked at a higher level */
-   if(!tile->encoded_data && !tile->raw_image) {
+   if(!tile->encoded_data && !tile->raw_image && !tile->nodata) {
       ctx->set_error(ctx,500,"attempting to write empty tile to disk");
       return;
    }
@@ -365,125 +806,63 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
    }
 #endif
 
-   ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
+   dcache->tile_key(ctx, tile, &filename);
    GC_CHECK_ERROR(ctx);
 
-   /* find the location of the last '/' in the string */
-   hackptr1 = filename;
-   while(*hackptr1) {
-      if(*hackptr1 == '/')
-         hackptr2 = hackptr1;
-      hackptr1++;
-   }
-   *hackptr2 = '\0';
-   
-   if(APR_SUCCESS != (ret = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
-       /* 
-        * apr_dir_make_recursive sometimes sends back this error, although it should not.
-        * ignore this one
-        */
-       if(!APR_STATUS_IS_EEXIST(ret)) {
-          ctx->set_error(ctx, 500, "failed to create directory %s: %s",filename, apr_strerror(ret,errmsg,120));
-          return;
-       }
-   }
-   *hackptr2 = '/';
+   _mapcache_cache_disk_make_parent_dir(ctx,dcache,filename,MAPCACHE_FALSE);
+   GC_CHECK_ERROR(ctx);
 
-   ret = apr_file_remove(filename,ctx->pool);
-   if(ret != APR_SUCCESS && !APR_STATUS_IS_ENOENT(ret)) {
-      ctx->set_error(ctx, 500,  "failed to remove file %s: %s",filename, apr_strerror(ret,errmsg,120));
+   if(tile->nodata) {
+      /* store the empty marker as a zero-byte file */
+      mapcache_buffer marker;
+      memset(&marker,0,sizeof(mapcache_buffer));
+      _mapcache_cache_disk_write(ctx,dcache,filename,&marker);
+      return;
    }
 
-  
 #ifdef HAVE_SYMLINK
-   if(((mapcache_cache_disk*)tile->tileset->cache)->symlink_blank) {
+   if(dcache->symlink_blank) {
       if(!tile->raw_image) {
          tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
          GC_CHECK_ERROR(ctx);
       }
       if(mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
          char *blankname;
+         apr_finfo_t finfo;
+         int err;
          _mapcache_cache_disk_blank_tile_key(ctx,tile,tile->raw_image->data,&blankname);
-         if(apr_file_open(&f, blankname, APR_FOPEN_READ, APR_OS_DEFAULT, ctx->pool) != APR_SUCCESS) {
+         GC_CHECK_ERROR(ctx);
+         if(apr_stat(&finfo, blankname, 0, ctx->pool) != APR_SUCCESS) {
+            void *lock;
+            int isLocked;
             if(!tile->encoded_data) {
                tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
                GC_CHECK_ERROR(ctx);
             }
-            /* create the blank file */
-            char *blankdirname = apr_psprintf(ctx->pool, "%s/%s/%s/blanks",
-                        ((mapcache_cache_disk*)tile->tileset->cache)->base_directory,
-                        tile->tileset->name,
-                        tile->grid_link->grid->name);
-            if(APR_SUCCESS != (ret = apr_dir_make_recursive(
-                        blankdirname, APR_OS_DEFAULT,ctx->pool))) {
-               if(!APR_STATUS_IS_EEXIST(ret)) {
-                  ctx->set_error(ctx, 500,  "failed to create directory %s for blank tiles",blankdirname, apr_strerror(ret,errmsg,120));
-                  return;
-               }
-            }
 
-            /* aquire a lock on the blank file */
-            int isLocked = mapcache_lock_or_wait_for_resource(ctx,blankname);
+            /* create the blanks/ directory */
+            _mapcache_cache_disk_make_parent_dir(ctx,dcache,blankname,MAPCACHE_FALSE);
+            GC_CHECK_ERROR(ctx);
 
-            if(isLocked == MAPCACHE_TRUE) {
+            /* aquire a lock on the blank file, so it only gets encoded and written once */
+            isLocked = mapcache_lock_or_wait_for_resource(ctx,blankname,&lock);
+            GC_CHECK_ERROR(ctx);
 
-               if((ret = apr_file_open(&f, blankname,
-                           APR_FOPEN_CREATE|APR_FOPEN_WRITE|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,
-                           APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
-                  ctx->set_error(ctx, 500,  "failed to create file %s: %s",blankname, apr_strerror(ret,errmsg,120));
-                  mapcache_unlock_resource(ctx,blankname);
-                  return; /* we could not create the file */
-               }
-
-               bytes = (apr_size_t)tile->encoded_data->size;
-               ret = apr_file_write(f,(void*)tile->encoded_data->buf,&bytes);
-               if(ret != APR_SUCCESS) {
-                  ctx->set_error(ctx, 500,  "failed to write data to file %s (wrote %d of %d bytes): %s",blankname, (int)bytes, (int)tile->encoded_data->size, apr_strerror(ret,errmsg,120));
-                  mapcache_unlock_resource(ctx,blankname);
-                  return; /* we could not create the file */
-               }
-
-               if(bytes != tile->encoded_data->size) {
-                  ctx->set_error(ctx, 500,  "failed to write image data to %s, wrote %d of %d bytes", blankname, (int)bytes, (int)tile->encoded_data->size);
-                  mapcache_unlock_resource(ctx,blankname);
-                  return;
-               }
-               apr_file_close(f);
-               mapcache_unlock_resource(ctx,blankname);
+            if(isLocked == MAPCACHE_TRUE) {
+               _mapcache_cache_disk_write(ctx,dcache,blankname,tile->encoded_data);
+               mapcache_unlock_resource(ctx,blankname,lock);
+               GC_CHECK_ERROR(ctx);
 #ifdef DEBUG
                ctx->log(ctx,MAPCACHE_DEBUG,"created blank tile %s",blankname);
 #endif
             }
-         } else {
-            apr_file_close(f);
          }
 
-         int retry_count_create_symlink = 0;
-         /*
-          * depending on configuration symlink creation will retry if it fails.
-          * this can happen on nfs mounted network storage.
-          * the solution is to create the containing directory again and retry the symlink creation.
-          */
-         while(symlink(blankname,filename) != 0) {
-            retry_count_create_symlink++;
-
-            if(retry_count_create_symlink > creation_retry) {
-               char *error = strerror(errno);
-               ctx->set_error(ctx, 500, "failed to link tile %s to %s: %s",filename, blankname, error);
-               return; /* we could not create the file */
-            }
-
-            *hackptr2 = '\0';
-
-            if(APR_SUCCESS != (ret = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
-               if(!APR_STATUS_IS_EEXIST(ret)) {
-                  ctx->set_error(ctx, 500, "failed to create symlink, can not create directory %s: %s",filename, apr_strerror(ret,errmsg,120));
-                  return; /* we could not create the file */
-               }
-            }
-
-            *hackptr2 = '/';
+         if((err = _mapcache_cache_disk_link(ctx,dcache,blankname,filename,MAPCACHE_TRUE)) != 0) {
+            ctx->set_error(ctx, 500, "failed to link tile %s to %s: %s",filename, blankname, strerror(err));
+            return; /* we could not create the file */
          }
+         GC_CHECK_ERROR(ctx);
 #ifdef DEBUG        
          ctx->log(ctx, MAPCACHE_DEBUG, "linked blank tile %s to %s",filename,blankname);
 #endif
@@ -499,51 +878,403 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
       GC_CHECK_ERROR(ctx);
    }
 
-   int retry_count_create_file = 0;
-   /*
-    * depending on configuration file creation will retry if it fails.
-    * this can happen on nfs mounted network storage.
-    * the solution is to create the containing directory again and retry the file creation.
-    */
-   while((ret = apr_file_open(&f, filename,
-         APR_FOPEN_CREATE|APR_FOPEN_WRITE|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,
-         APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
+#ifdef HAVE_SYMLINK
+   if(dcache->dedup != MAPCACHE_DISK_DEDUP_NONE) {
+      _mapcache_cache_disk_dedup_set(ctx,dcache,tile,filename);
+      return;
+   }
+#endif
 
-      retry_count_create_file++;
+   _mapcache_cache_disk_write(ctx,dcache,filename,tile->encoded_data);
+}
 
-      if(retry_count_create_file > creation_retry) {
-         ctx->set_error(ctx, 500, "failed to create file %s: %s",filename, apr_strerror(ret,errmsg,120));
-         return; /* we could not create the file */
+/*
+ * bundle layout: blocks of bundle_size x bundle_size tiles are stored in a single file
+ *
+ * the file starts with a 16 byte header (the "MCBUNDLE" magic, a version number and the
+ * bundle size as little-endian 32 bit integers), followed by an index of 16 byte entries,
+ * one per tile in row-major order (64 bit offset and 32 bit length of the tile data, and
+ * 32 bits of flags). tile data is appended after the index. empty markers are stored as an
+ * entry with no data and the MAPCACHE_BUNDLE_FLAG_NODATA flag.
+ *
+ * writers append the data of the tiles and then update their index entries while holding
+ * a lock on the bundle. index entries are 16 byte aligned and written with a single write,
+ * so readers never see a partially updated entry and don't need any locking. data of
+ * replaced or deleted tiles is not reclaimed.
+ */
+#define MAPCACHE_BUNDLE_MAGIC "MCBUNDLE"
+#define MAPCACHE_BUNDLE_VERSION 1
+#define MAPCACHE_BUNDLE_HEADER_SIZE 16
+#define MAPCACHE_BUNDLE_ENTRY_SIZE 16
+#define MAPCACHE_BUNDLE_FLAG_NODATA 1
+
+static void _mapcache_bundle_put_uint32(unsigned char *p, apr_uint32_t v) {
+   p[0] = v & 0xff; p[1] = (v>>8) & 0xff; p[2] = (v>>16) & 0xff; p[3] = (v>>24) & 0xff;
+}
+
+static apr_uint32_t _mapcache_bundle_get_uint32(const unsigned char *p) {
+   return (apr_uint32_t)p[0] | ((apr_uint32_t)p[1]<<8) | ((apr_uint32_t)p[2]<<16) | ((apr_uint32_t)p[3]<<24);
+}
+
+static void _mapcache_bundle_put_uint64(unsigned char *p, apr_uint64_t v) {
+   _mapcache_bundle_put_uint32(p, (apr_uint32_t)(v & 0xffffffff));
+   _mapcache_bundle_put_uint32(p+4, (apr_uint32_t)(v >> 32));
+}
+
+static apr_uint64_t _mapcache_bundle_get_uint64(const unsigned char *p) {
+   return (apr_uint64_t)_mapcache_bundle_get_uint32(p) | ((apr_uint64_t)_mapcache_bundle_get_uint32(p+4) << 32);
+}
+
+/**
+ * \brief return the filename of the bundle containing the given tile
+ * \private \memberof mapcache_cache_disk
+ */
+static void _mapcache_cache_disk_bundle_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path) {
+   mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
+   char *start;
+   _mapcache_cache_disk_base_tile_key(ctx, tile, &start);
+   *path = apr_psprintf(ctx->pool,"%s/%02d/R%04xC%04x.bundle",
+         start,
+         tile->z,
+         tile->y / dcache->bundle_size,
+         tile->x / dcache->bundle_size);
+   if(!*path) {
+      ctx->set_error(ctx,500, "failed to allocate tile key");
+   }
+}
+
+/* position of the index entry of the given tile inside its bundle */
+static apr_off_t _mapcache_cache_disk_bundle_entry_offset(mapcache_cache_disk *dcache, mapcache_tile *tile) {
+   int row = tile->y % dcache->bundle_size;
+   int col = tile->x % dcache->bundle_size;
+   return MAPCACHE_BUNDLE_HEADER_SIZE + (apr_off_t)(row * dcache->bundle_size + col) * MAPCACHE_BUNDLE_ENTRY_SIZE;
+}
+
+/**
+ * \brief read the index entry of a tile
+ * \returns MAPCACHE_CACHE_MISS if the bundle or the tile does not exist
+ * \private \memberof mapcache_cache_disk
+ */
+static int _mapcache_cache_disk_bundle_read_entry(mapcache_context *ctx, mapcache_tile *tile, const char *filename,
+      apr_file_t *f, apr_off_t *offset, apr_size_t *size) {
+   mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
+   unsigned char entry[MAPCACHE_BUNDLE_ENTRY_SIZE];
+   apr_off_t pos = _mapcache_cache_disk_bundle_entry_offset(dcache,tile);
+   apr_size_t nread;
+   apr_status_t rv;
+   if((rv = apr_file_seek(f, APR_SET, &pos)) != APR_SUCCESS) {
+      char errmsg[120];
+      ctx->set_error(ctx, 500, "failed to seek in bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+      return MAPCACHE_FAILURE;
+   }
+   if(apr_file_read_full(f, entry, MAPCACHE_BUNDLE_ENTRY_SIZE, &nread) != APR_SUCCESS ||
+         nread != MAPCACHE_BUNDLE_ENTRY_SIZE) {
+      /* the bundle is still being initialized */
+      return MAPCACHE_CACHE_MISS;
+   }
+   *offset = (apr_off_t)_mapcache_bundle_get_uint64(entry);
+   *size = _mapcache_bundle_get_uint32(entry+8);
+   if(!*size) {
+      if(_mapcache_bundle_get_uint32(entry+12) & MAPCACHE_BUNDLE_FLAG_NODATA) {
+         tile->nodata = 1;
+         return MAPCACHE_SUCCESS;
+      }
+      return MAPCACHE_CACHE_MISS;
+   }
+   return MAPCACHE_SUCCESS;
+}
+
+static int _mapcache_cache_disk_bundle_open(mapcache_context *ctx, mapcache_tile *tile, apr_int32_t flags,
+      char **filename, apr_file_t **f) {
+   apr_status_t rv;
+   _mapcache_cache_disk_bundle_tile_key(ctx, tile, filename);
+   if(GC_HAS_ERROR(ctx)) {
+      return MAPCACHE_FAILURE;
+   }
+   if((rv = apr_file_open(f, *filename, flags, APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
+      if(APR_STATUS_IS_ENOENT(rv)) {
+         return MAPCACHE_CACHE_MISS;
+      } else {
+         char errmsg[120];
+         ctx->set_error(ctx, 500, "failed to open bundle %s: %s", *filename, apr_strerror(rv,errmsg,120));
+         return MAPCACHE_FAILURE;
       }
+   }
+   return MAPCACHE_SUCCESS;
+}
 
-      *hackptr2 = '\0';
+static int _mapcache_cache_disk_bundle_has_tile(mapcache_context *ctx, mapcache_tile *tile) {
+   char *filename;
+   apr_file_t *f;
+   apr_off_t offset;
+   apr_size_t size;
+   int ret = _mapcache_cache_disk_bundle_open(ctx, tile, APR_FOPEN_READ|APR_FOPEN_BINARY, &filename, &f);
+   if(ret != MAPCACHE_SUCCESS) {
+      return MAPCACHE_FALSE;
+   }
+   ret = _mapcache_cache_disk_bundle_read_entry(ctx, tile, filename, f, &offset, &size);
+   apr_file_close(f);
+   return (ret == MAPCACHE_SUCCESS) ? MAPCACHE_TRUE : MAPCACHE_FALSE;
+}
 
-      if(APR_SUCCESS != (ret = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
-         if(!APR_STATUS_IS_EEXIST(ret)) {
-            ctx->set_error(ctx, 500, "failed to create file, can not create directory %s: %s",filename, apr_strerror(ret,errmsg,120));
-            return; /* we could not create the file */
-         }
+static int _mapcache_cache_disk_bundle_get(mapcache_context *ctx, mapcache_tile *tile) {
+   char *filename;
+   apr_file_t *f;
+   apr_off_t offset;
+   apr_size_t size, nread;
+   apr_finfo_t finfo;
+   apr_status_t rv;
+   apr_int32_t flags = APR_FOPEN_READ|APR_FOPEN_BINARY;
+   int ret;
+   if(tile->accept_file) {
+      flags |= APR_FOPEN_SENDFILE_ENABLED;
+   }
+   ret = _mapcache_cache_disk_bundle_open(ctx, tile, flags, &filename, &f);
+   if(ret != MAPCACHE_SUCCESS) {
+      return ret;
+   }
+   ret = _mapcache_cache_disk_bundle_read_entry(ctx, tile, filename, f, &offset, &size);
+   if(ret != MAPCACHE_SUCCESS) {
+      apr_file_close(f);
+      return ret;
+   }
+   /* tiles are never modified in place, the bundle modification time is the best we have */
+   if(apr_file_info_get(&finfo, APR_FINFO_MTIME, f) == APR_SUCCESS) {
+      tile->mtime = finfo.mtime;
+   }
+   if(tile->nodata) {
+      apr_file_close(f);
+      return MAPCACHE_SUCCESS;
+   }
+
+   if(tile->accept_file) {
+      /* the handle is left open, it will be closed along with the request pool */
+      tile->file = apr_pcalloc(ctx->pool, sizeof(mapcache_file_ref));
+      tile->file->file = f;
+      tile->file->path = filename;
+      tile->file->offset = offset;
+      tile->file->length = size;
+      return MAPCACHE_SUCCESS;
+   }
+
+   tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
+   tile->encoded_data->buf = apr_palloc(ctx->pool, size);
+   tile->encoded_data->avail = size;
+   if((rv = apr_file_seek(f, APR_SET, &offset)) == APR_SUCCESS) {
+      rv = apr_file_read_full(f, tile->encoded_data->buf, size, &nread);
+   }
+   apr_file_close(f);
+   if(rv != APR_SUCCESS || nread != size) {
+      char errmsg[120];
+      ctx->set_error(ctx, 500, "failed to read tile data from bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+      return MAPCACHE_FAILURE;
+   }
+   tile->encoded_data->size = size;
+   return MAPCACHE_SUCCESS;
+}
+
+/**
+ * \brief open a bundle for writing, creating it if needed
+ *
+ * must be called with the bundle lock held
+ * \private \memberof mapcache_cache_disk
+ */
+static apr_file_t* _mapcache_cache_disk_bundle_open_write(mapcache_context *ctx, mapcache_cache_disk *dcache,
+      const char *filename) {
+   apr_file_t *f;
+   apr_finfo_t finfo;
+   apr_status_t rv;
+   char errmsg[120];
+   unsigned char header[MAPCACHE_BUNDLE_HEADER_SIZE];
+   apr_off_t index_end = MAPCACHE_BUNDLE_HEADER_SIZE +
+      (apr_off_t)dcache->bundle_size * dcache->bundle_size * MAPCACHE_BUNDLE_ENTRY_SIZE;
+   int dir_refreshed = 0;
+
+   while((rv = apr_file_open(&f, filename, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_BINARY,
+               APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
+      if(APR_STATUS_IS_ENOENT(rv) && !dir_refreshed) {
+         dir_refreshed = 1;
+         _mapcache_cache_disk_make_parent_dir(ctx,dcache,filename,MAPCACHE_TRUE);
+         if(GC_HAS_ERROR(ctx)) return NULL;
+         continue;
       }
+      ctx->set_error(ctx, 500, "failed to open bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+      return NULL;
+   }
+   if((rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to stat bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+      apr_file_close(f);
+      return NULL;
+   }
+   if(finfo.size < index_end) {
+      /* new bundle, or a bundle whose creation was interrupted: it contains no tiles */
+      apr_size_t nwritten;
+      apr_off_t pos = 0;
+      memcpy(header, MAPCACHE_BUNDLE_MAGIC, 8);
+      _mapcache_bundle_put_uint32(header+8, MAPCACHE_BUNDLE_VERSION);
+      _mapcache_bundle_put_uint32(header+12, dcache->bundle_size);
+      if((rv = apr_file_trunc(f, 0)) != APR_SUCCESS ||
+            (rv = apr_file_trunc(f, index_end)) != APR_SUCCESS ||
+            (rv = apr_file_seek(f, APR_SET, &pos)) != APR_SUCCESS ||
+            (rv = apr_file_write_full(f, header, MAPCACHE_BUNDLE_HEADER_SIZE, &nwritten)) != APR_SUCCESS) {
+         ctx->set_error(ctx, 500, "failed to initialize bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+         apr_file_close(f);
+         return NULL;
+      }
+   } else {
+      apr_size_t nread;
+      if((rv = apr_file_read_full(f, header, MAPCACHE_BUNDLE_HEADER_SIZE, &nread)) != APR_SUCCESS ||
+            memcmp(header, MAPCACHE_BUNDLE_MAGIC, 8) ||
+            _mapcache_bundle_get_uint32(header+8) != MAPCACHE_BUNDLE_VERSION ||
+            _mapcache_bundle_get_uint32(header+12) != dcache->bundle_size) {
+         ctx->set_error(ctx, 500, "%s is not a bundle of %dx%d tiles", filename, dcache->bundle_size, dcache->bundle_size);
+         apr_file_close(f);
+         return NULL;
+      }
+   }
+   return f;
+}
 
-      *hackptr2 = '/';
+/**
+ * \brief append the data of tiles belonging to the same bundle, and update their index entries
+ * \private \memberof mapcache_cache_disk
+ */
+static void _mapcache_cache_disk_bundle_write(mapcache_context *ctx, mapcache_cache_disk *dcache,
+      const char *filename, mapcache_tile **tiles, int ntiles) {
+   apr_file_t *f;
+   apr_status_t rv;
+   apr_off_t offset = 0;
+   apr_size_t nwritten;
+   struct iovec *vec;
+   char errmsg[120];
+   void *lock;
+   int i;
+
+   _mapcache_cache_disk_make_parent_dir(ctx,dcache,filename,MAPCACHE_FALSE);
+   GC_CHECK_ERROR(ctx);
+
+   while(mapcache_lock_or_wait_for_resource(ctx,(char*)filename,&lock) == MAPCACHE_FALSE) {
+      GC_CHECK_ERROR(ctx);
    }
+   GC_CHECK_ERROR(ctx);
 
-   bytes = (apr_size_t)tile->encoded_data->size;
-   ret = apr_file_write(f,(void*)tile->encoded_data->buf,&bytes);
-   if(ret != APR_SUCCESS) {
-      ctx->set_error(ctx, 500,  "failed to write data to file %s (wrote %d of %d bytes): %s",filename, (int)bytes, (int)tile->encoded_data->size, apr_strerror(ret,errmsg,120));
-      return; /* we could not create the file */
+   f = _mapcache_cache_disk_bundle_open_write(ctx, dcache, filename);
+   if(!f) {
+      mapcache_unlock_resource(ctx,(char*)filename,lock);
+      return;
+   }
+
+   /* append the data of all the tiles with a single write */
+   vec = apr_palloc(ctx->pool, ntiles * sizeof(struct iovec));
+   for(i=0;i<ntiles;i++) {
+      if(tiles[i]->nodata) {
+         vec[i].iov_base = NULL;
+         vec[i].iov_len = 0;
+      } else {
+         vec[i].iov_base = tiles[i]->encoded_data->buf;
+         vec[i].iov_len = tiles[i]->encoded_data->size;
+      }
+   }
+   if((rv = apr_file_seek(f, APR_END, &offset)) != APR_SUCCESS ||
+         (rv = apr_file_writev_full(f, vec, ntiles, &nwritten)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to write tile data to bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+      goto cleanup;
+   }
+   /* the data must hit the disk before the index entries referencing it */
+   if(dcache->sync_policy != MAPCACHE_DISK_SYNC_NONE && (rv = apr_file_sync(f)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to sync bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+      goto cleanup;
    }
 
-   if(bytes != tile->encoded_data->size) {
-      ctx->set_error(ctx, 500, "failed to write image data to %s, wrote %d of %d bytes", filename, (int)bytes, (int)tile->encoded_data->size);
+   for(i=0;i<ntiles;i++) {
+      unsigned char entry[MAPCACHE_BUNDLE_ENTRY_SIZE];
+      apr_off_t pos = _mapcache_cache_disk_bundle_entry_offset(dcache,tiles[i]);
+      _mapcache_bundle_put_uint64(entry, (apr_uint64_t)offset);
+      _mapcache_bundle_put_uint32(entry+8, (apr_uint32_t)vec[i].iov_len);
+      _mapcache_bundle_put_uint32(entry+12, tiles[i]->nodata ? MAPCACHE_BUNDLE_FLAG_NODATA : 0);
+      if((rv = apr_file_seek(f, APR_SET, &pos)) != APR_SUCCESS ||
+            (rv = apr_file_write_full(f, entry, MAPCACHE_BUNDLE_ENTRY_SIZE, &nwritten)) != APR_SUCCESS) {
+         ctx->set_error(ctx, 500, "failed to update index of bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+         goto cleanup;
+      }
+      offset += vec[i].iov_len;
    }
-   ret = apr_file_close(f);
-   if(ret != APR_SUCCESS) {
-      ctx->set_error(ctx, 500,  "failed to close file %s:%s",filename, apr_strerror(ret,errmsg,120));
-      return; /* we could not create the file */
+   if(dcache->sync_policy != MAPCACHE_DISK_SYNC_NONE && (rv = apr_file_sync(f)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to sync bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
    }
 
+cleanup:
+   apr_file_close(f);
+   mapcache_unlock_resource(ctx,(char*)filename,lock);
+}
+
+static void _mapcache_cache_disk_bundle_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles) {
+   mapcache_cache_disk *dcache = (mapcache_cache_disk*)tiles[0].tileset->cache;
+   mapcache_tile **group = apr_palloc(ctx->pool, ntiles * sizeof(mapcache_tile*));
+   char **filenames = apr_palloc(ctx->pool, ntiles * sizeof(char*));
+   char *done = apr_pcalloc(ctx->pool, ntiles);
+   int i,j;
+
+   for(i=0;i<ntiles;i++) {
+      mapcache_tile *tile = &tiles[i];
+      if(!tile->encoded_data && !tile->nodata) {
+         tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+         GC_CHECK_ERROR(ctx);
+      }
+      _mapcache_cache_disk_bundle_tile_key(ctx, tile, &filenames[i]);
+      GC_CHECK_ERROR(ctx);
+   }
+
+   /* a metatile usually falls in a single bundle, but may straddle a few of them */
+   for(i=0;i<ntiles;i++) {
+      int ngroup = 0;
+      if(done[i]) continue;
+      for(j=i;j<ntiles;j++) {
+         if(!done[j] && !strcmp(filenames[i],filenames[j])) {
+            group[ngroup++] = &tiles[j];
+            done[j] = 1;
+         }
+      }
+      _mapcache_cache_disk_bundle_write(ctx, dcache, filenames[i], group, ngroup);
+      GC_CHECK_ERROR(ctx);
+   }
+}
+
+static void _mapcache_cache_disk_bundle_set(mapcache_context *ctx, mapcache_tile *tile) {
+   _mapcache_cache_disk_bundle_multi_set(ctx, tile, 1);
+}
+
+static void _mapcache_cache_disk_bundle_delete(mapcache_context *ctx, mapcache_tile *tile) {
+   mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
+   unsigned char entry[MAPCACHE_BUNDLE_ENTRY_SIZE];
+   apr_off_t pos = _mapcache_cache_disk_bundle_entry_offset(dcache,tile);
+   apr_size_t nwritten;
+   apr_finfo_t finfo;
+   apr_file_t *f;
+   apr_status_t rv;
+   char *filename;
+   void *lock;
+
+   _mapcache_cache_disk_bundle_tile_key(ctx, tile, &filename);
+   GC_CHECK_ERROR(ctx);
+   if(apr_stat(&finfo, filename, 0, ctx->pool) != APR_SUCCESS) {
+      return; /* no bundle, no tile */
+   }
+   while(mapcache_lock_or_wait_for_resource(ctx,filename,&lock) == MAPCACHE_FALSE) {
+      GC_CHECK_ERROR(ctx);
+   }
+   GC_CHECK_ERROR(ctx);
+   f = _mapcache_cache_disk_bundle_open_write(ctx, dcache, filename);
+   if(f) {
+      memset(entry, 0, MAPCACHE_BUNDLE_ENTRY_SIZE);
+      if((rv = apr_file_seek(f, APR_SET, &pos)) != APR_SUCCESS ||
+            (rv = apr_file_write_full(f, entry, MAPCACHE_BUNDLE_ENTRY_SIZE, &nwritten)) != APR_SUCCESS) {
+         char errmsg[120];
+         ctx->set_error(ctx, 500, "failed to update index of bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+      }
+      apr_file_close(f);
+   }
+   mapcache_unlock_resource(ctx,filename,lock);
 }
 
 /**
@@ -554,17 +1285,36 @@ static void _mapcache_cache_disk_configuration_parse_xml(mapcache_context *ctx,
    mapcache_cache_disk *dcache = (mapcache_cache_disk*)cache;
    char *layout = NULL;
    int template_layout = MAPCACHE_FALSE;
+   int bundle_layout = MAPCACHE_FALSE;
    
    layout = (char*)ezxml_attr(node,"layout");
    if (!layout || !strlen(layout) || !strcmp(layout,"tilecache")) {
      dcache->tile_key = _mapcache_cache_disk_tilecache_tile_key;
    } else if(!strcmp(layout,"arcgis")) {
        dcache->tile_key = _mapcache_cache_disk_arcgis_tile_key;
+   } else if(!strcmp(layout,"bundle")) {
+       dcache->tile_key = _mapcache_cache_disk_bundle_tile_key;
+       cache->tile_get = _mapcache_cache_disk_bundle_get;
+       cache->tile_exists = _mapcache_cache_disk_bundle_has_tile;
+       cache->tile_delete = _mapcache_cache_disk_bundle_delete;
+       cache->tile_set = _mapcache_cache_disk_bundle_set;
+       cache->tile_multi_set = _mapcache_cache_disk_bundle_multi_set;
+       bundle_layout = MAPCACHE_TRUE;
+       if ((cur_node = ezxml_child(node,"bundle_size")) != NULL) {
+          char *endptr;
+          dcache->bundle_size = (int)strtol(cur_node->txt,&endptr,10);
+          if(*endptr != 0 || dcache->bundle_size <= 0) {
+             ctx->set_error(ctx, 400, "failed to parse bundle_size \"%s\" for cache \"%s\". Expecting a positive integer",
+                   cur_node->txt, cache->name);
+             return;
+          }
+       }
    } else if (!strcmp(layout,"template")) {
        dcache->tile_key = _mapcache_cache_disk_template_tile_key;
        template_layout = MAPCACHE_TRUE;
        if ((cur_node = ezxml_child(node,"template")) != NULL) {
          dcache->filename_template = apr_pstrdup(ctx->pool,cur_node->txt);
+         dcache->filename_tpl = mapcache_template_compile(ctx,dcache->filename_template);
        } else {
          ctx->set_error(ctx, 400, "no template specified for cache \"%s\"", cache->name);
          return;
@@ -581,6 +1331,10 @@ static void _mapcache_cache_disk_configuration_parse_xml(mapcache_context *ctx,
 
    if (!template_layout && (cur_node = ezxml_child(node,"symlink_blank")) != NULL) {
      if(strcasecmp(cur_node->txt,"false")){
+       if(bundle_layout) {
+          ctx->set_error(ctx,400,"cache %s: symlink_blank is not supported by the bundle layout",cache->name);
+          return;
+       }
 #ifdef HAVE_SYMLINK
        dcache->symlink_blank = 1;
 #else
@@ -590,9 +1344,70 @@ static void _mapcache_cache_disk_configuration_parse_xml(mapcache_context *ctx,
      }
    }
 
+   if ((cur_node = ezxml_child(node,"dedup")) != NULL) {
+      if(!cur_node->txt || !*cur_node->txt || !strcasecmp(cur_node->txt,"hardlink") || !strcasecmp(cur_node->txt,"true")) {
+         dcache->dedup = MAPCACHE_DISK_DEDUP_HARDLINK;
+      } else if(!strcasecmp(cur_node->txt,"symlink")) {
+         dcache->dedup = MAPCACHE_DISK_DEDUP_SYMLINK;
+      } else if(strcasecmp(cur_node->txt,"false") && strcasecmp(cur_node->txt,"none")) {
+         ctx->set_error(ctx, 400, "unknown dedup mode \"%s\" for cache \"%s\" (allowed are hardlink, symlink and none)",
+               cur_node->txt, cache->name);
+         return;
+      }
+      if(dcache->dedup != MAPCACHE_DISK_DEDUP_NONE) {
+         if(template_layout || bundle_layout) {
+            ctx->set_error(ctx,400,"cache %s: dedup is not supported by the %s layout",cache->name,layout);
+            return;
+         }
+#ifndef HAVE_SYMLINK
+         ctx->set_error(ctx,400,"cache %s: host system does not support file linking",cache->name);
+         return;
+#endif
+      }
+   }
+
    if ((cur_node = ezxml_child(node,"creation_retry")) != NULL) {
       dcache->creation_retry = atoi(cur_node->txt);
    }
+
+   if ((cur_node = ezxml_child(node,"read_strategy")) != NULL) {
+      const char *threshold = ezxml_attr(cur_node,"threshold");
+      if(!strcasecmp(cur_node->txt,"auto")) {
+         dcache->read_strategy = MAPCACHE_DISK_READ_AUTO;
+      } else if(!strcasecmp(cur_node->txt,"mmap")) {
+         dcache->read_strategy = MAPCACHE_DISK_READ_MMAP;
+      } else if(!strcasecmp(cur_node->txt,"pread")) {
+         dcache->read_strategy = MAPCACHE_DISK_READ_PREAD;
+      } else {
+         ctx->set_error(ctx, 400, "unknown read_strategy \"%s\" for cache \"%s\" (allowed are auto, mmap and pread)",
+               cur_node->txt, cache->name);
+         return;
+      }
+      if(threshold) {
+         char *endptr;
+         long val = strtol(threshold,&endptr,10);
+         if(*endptr != 0 || val < 0) {
+            ctx->set_error(ctx, 400, "failed to parse read_strategy threshold \"%s\" for cache \"%s\". Expecting a positive integer",
+                  threshold, cache->name);
+            return;
+         }
+         dcache->mmap_threshold = (apr_size_t)val;
+      }
+   }
+
+   if ((cur_node = ezxml_child(node,"fsync")) != NULL) {
+      if(!strcasecmp(cur_node->txt,"none") || !strcasecmp(cur_node->txt,"false")) {
+         dcache->sync_policy = MAPCACHE_DISK_SYNC_NONE;
+      } else if(!strcasecmp(cur_node->txt,"file") || !strcasecmp(cur_node->txt,"true")) {
+         dcache->sync_policy = MAPCACHE_DISK_SYNC_FILE;
+      } else if(!strcasecmp(cur_node->txt,"full")) {
+         dcache->sync_policy = MAPCACHE_DISK_SYNC_FULL;
+      } else {
+         ctx->set_error(ctx, 400, "unknown fsync policy \"%s\" for cache \"%s\" (allowed are none, file and full)",
+               cur_node->txt, cache->name);
+         return;
+      }
+   }
 }
 
 /**
@@ -607,6 +1422,22 @@ static void _mapcache_cache_disk_configuration_post_config(mapcache_context *ctx
       ctx->set_error(ctx, 400, "disk cache %s has no base directory or template",dcache->cache.name);
       return;
    }
+   if(dcache->dedup != MAPCACHE_DISK_DEDUP_NONE) {
+      /*
+       * deduplicated tiles share the modification time of their blob, that can't tell
+       * when each of them was rendered
+       */
+      apr_hash_index_t *tileseti;
+      for(tileseti = apr_hash_first(ctx->pool,cfg->tilesets); tileseti; tileseti = apr_hash_next(tileseti)) {
+         mapcache_tileset *tileset;
+         apr_hash_this(tileseti,NULL,NULL,(void**)&tileset);
+         if(tileset->cache == cache && tileset->auto_expire) {
+            ctx->set_error(ctx, 400, "disk cache %s: dedup can't be used by tileset %s, as it has auto_expire",
+                  cache->name, tileset->name);
+            return;
+         }
+      }
+   }
 }
 
 /**
@@ -619,7 +1450,20 @@ mapcache_cache* mapcache_cache_disk_create(mapcache_context *ctx) {
       return NULL;
    }
    cache->symlink_blank = 0;
+   cache->dedup = MAPCACHE_DISK_DEDUP_NONE;
    cache->creation_retry = 0;
+   cache->sync_policy = MAPCACHE_DISK_SYNC_NONE;
+   cache->read_strategy = MAPCACHE_DISK_READ_AUTO;
+   cache->mmap_threshold = 65536;
+   cache->bundle_size = 128;
+   _mapcache_disk_dir_memo_create(ctx,cache);
+   if(GC_HAS_ERROR(ctx)) {
+      return NULL;
+   }
+   _mapcache_disk_read_buffers_create(ctx,cache);
+   if(GC_HAS_ERROR(ctx)) {
+      return NULL;
+   }
    cache->cache.metadata = apr_table_make(ctx->pool,3);
    cache->cache.type = MAPCACHE_CACHE_DISK;
    cache->cache.tile_delete = _mapcache_cache_disk_delete;
@@ -36,16 +36,27 @@ static int _mapcache_cache_memcache_has_tile(mapcache_context *ctx, mapcache_til
    char *tmpdata;
    int rv;
    size_t tmpdatasize;
+   apr_pool_t *tmppool;
    mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
    key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
    if(GC_HAS_ERROR(ctx)) {
       return MAPCACHE_FALSE;
    }
-   rv = apr_memcache_getp(cache->memcache,ctx->pool,key,&tmpdata,&tmpdatasize,NULL);
+   /*
+    * the memcache protocol spoken by apr has no way of testing a key without retrieving its value.
+    * the value is fetched into a short-lived pool so that existence checks done while seeding
+    * don't accumulate the tile data in the context pool
+    */
+   if(apr_pool_create(&tmppool,ctx->pool) != APR_SUCCESS) {
+      return MAPCACHE_FALSE;
+   }
+   rv = apr_memcache_getp(cache->memcache,tmppool,key,&tmpdata,&tmpdatasize,NULL);
+   apr_pool_destroy(tmppool);
    if(rv != APR_SUCCESS) {
       return MAPCACHE_FALSE;
    }
-   if(tmpdatasize == 0) {
+   /* empty markers are stored as the modification time alone, they are existing tiles */
+   if(tmpdatasize < sizeof(apr_time_t)) {
       return MAPCACHE_FALSE;
    }
    return MAPCACHE_TRUE;
@@ -65,6 +76,34 @@ static void _mapcache_cache_memcache_delete(mapcache_context *ctx, mapcache_tile
    }
 }
 
+/**
+ * \brief fill the tile with a value returned by memcached
+ *
+ * the data stored on the server is the encoded tile followed by its modification time
+ */
+static int _mapcache_cache_memcache_tile_from_value(mapcache_context *ctx, mapcache_tile *tile, char *data, apr_size_t size) {
+   if(size < sizeof(apr_time_t)) {
+      ctx->set_error(ctx,500,"memcache cache returned 0-length data for tile %d %d %d\n",tile->x,tile->y,tile->z);
+      return MAPCACHE_FAILURE;
+   }
+   /* extract the tile modification time from the end of the data returned */
+   size -= sizeof(apr_time_t);
+   memcpy(&tile->mtime, &data[size], sizeof(apr_time_t));
+   if(size == 0) {
+      /* only the modification time was stored: this is an empty marker */
+      tile->encoded_data = NULL;
+      tile->nodata = 1;
+      return MAPCACHE_SUCCESS;
+   }
+   tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
+   tile->encoded_data->buf = data;
+   tile->encoded_data->size = size;
+   tile->encoded_data->avail = size + sizeof(apr_time_t);
+   /* the timestamp has been extracted, its space can be reused */
+   data[size] = '\0';
+   return MAPCACHE_SUCCESS;
+}
+
 /**
  * \brief get content of given tile
  * 
@@ -74,66 +113,100 @@ static void _mapcache_cache_memcache_delete(mapcache_context *ctx, mapcache_tile
  */
 static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_tile *tile) {
    char *key;
+   char *data;
+   apr_size_t size;
    int rv;
    mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
    key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
    if(GC_HAS_ERROR(ctx)) {
       return MAPCACHE_FAILURE;
    }
-   tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
-   rv = apr_memcache_getp(cache->memcache,ctx->pool,key,(char**)&tile->encoded_data->buf,&tile->encoded_data->size,NULL);
+   rv = apr_memcache_getp(cache->memcache,ctx->pool,key,&data,&size,NULL);
    if(rv != APR_SUCCESS) {
       return MAPCACHE_CACHE_MISS;
    }
-   if(tile->encoded_data->size == 0) {
-      ctx->set_error(ctx,500,"memcache cache returned 0-length data for tile %d %d %d\n",tile->x,tile->y,tile->z);
-      return MAPCACHE_FAILURE;
-   }
-   /* extract the tile modification time from the end of the data returned */
-   memcpy(
-         &tile->mtime,
-         &(((char*)tile->encoded_data->buf)[tile->encoded_data->size-sizeof(apr_time_t)]),
-         sizeof(apr_time_t));
-   ((char*)tile->encoded_data->buf)[tile->encoded_data->size+sizeof(apr_time_t)]='\0';
-   tile->encoded_data->avail = tile->encoded_data->size;
-   tile->encoded_data->size -= sizeof(apr_time_t);
-   return MAPCACHE_SUCCESS;
+   return _mapcache_cache_memcache_tile_from_value(ctx,tile,data,size);
 }
 
 /**
- * \brief push tile data to memcached
- * 
- * writes the content of mapcache_tile::data to the configured memcached instance(s)
- * \returns MAPCACHE_FAILURE if there is no data to write, or if the tile isn't locked
- * \returns MAPCACHE_SUCCESS if the tile has been successfully written
+ * \brief get the content of several tiles
+ *
+ * the keys are sent in one batch per memcached server instead of one request per tile
  * \private \memberof mapcache_cache_memcache
- * \sa mapcache_cache::tile_set()
+ * \sa mapcache_cache::tile_multi_get()
  */
-static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_tile *tile) {
+static void _mapcache_cache_memcache_multi_get(mapcache_context *ctx, mapcache_tile **tiles, int ntiles, int *results) {
+   int i;
+   apr_status_t rv;
+   apr_hash_t *values = apr_hash_make(ctx->pool);
+   char **keys = apr_palloc(ctx->pool, ntiles*sizeof(char*));
+   mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tiles[0]->tileset->cache;
+   for(i=0;i<ntiles;i++) {
+      results[i] = MAPCACHE_CACHE_MISS;
+      keys[i] = mapcache_util_get_tile_key(ctx, tiles[i],NULL," \r\n\t\f\e\a\b","#");
+      GC_CHECK_ERROR(ctx);
+      apr_memcache_add_multget_key(ctx->pool, keys[i], &values);
+   }
+   rv = apr_memcache_multgetp(cache->memcache,ctx->pool,ctx->pool,values);
+   if(rv != APR_SUCCESS) {
+      /* leave all the tiles as misses, they will be queried one by one */
+      return;
+   }
+   for(i=0;i<ntiles;i++) {
+      apr_memcache_value_t *value = apr_hash_get(values, keys[i], APR_HASH_KEY_STRING);
+      if(!value || value->status != APR_SUCCESS) continue;
+      results[i] = _mapcache_cache_memcache_tile_from_value(ctx, tiles[i], value->data, value->len);
+      GC_CHECK_ERROR(ctx);
+   }
+}
+
+/**
+ * \brief build the value stored for a tile: its encoded data directly followed by its modification time
+ *
+ * the encoded data is not copied if its buffer has enough spare room to hold the timestamp
+ */
+static char* _mapcache_cache_memcache_value(mapcache_context *ctx, mapcache_tile *tile, apr_time_t now, apr_size_t *len) {
+   char *data;
+   apr_size_t size;
+   if(tile->nodata) {
+      /* empty markers are stored as the modification time alone */
+      size = 0;
+      data = apr_palloc(ctx->pool, sizeof(apr_time_t));
+   } else {
+      if(!tile->encoded_data) {
+         tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+         if(GC_HAS_ERROR(ctx)) return NULL;
+      }
+      size = tile->encoded_data->size;
+      if(tile->encoded_data->avail >= size + sizeof(apr_time_t)) {
+         /* the bytes past the end of the data are unused, the tile content itself is untouched */
+         data = tile->encoded_data->buf;
+      } else {
+         data = apr_palloc(ctx->pool, size + sizeof(apr_time_t));
+         memcpy(data,tile->encoded_data->buf,size);
+      }
+   }
+   memcpy(&(data[size]),&now,sizeof(apr_time_t));
+   *len = size + sizeof(apr_time_t);
+   return data;
+}
+
+static void _mapcache_cache_memcache_set_value(mapcache_context *ctx, mapcache_tile *tile, apr_time_t now) {
    char *key;
    int rv;
+   char *data;
+   apr_size_t len;
    /* set expiration to one day if not configured */
    int expires = 86400;
+   mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
    if(tile->tileset->auto_expire)
       expires = tile->tileset->auto_expire;
-   mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
    key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
    GC_CHECK_ERROR(ctx);
+   data = _mapcache_cache_memcache_value(ctx, tile, now, &len);
+   GC_CHECK_ERROR(ctx);
    
-   if(!tile->encoded_data) {
-      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
-      GC_CHECK_ERROR(ctx);
-   }
-
-   /* concatenate the current time to the end of the memcache data so we can extract it out
-    * when we re-get the tile */
-   char *data = calloc(1,tile->encoded_data->size+sizeof(apr_time_t));
-   apr_time_t now = apr_time_now();
-   apr_pool_cleanup_register(ctx->pool, data, (void*)free, apr_pool_cleanup_null);
-   memcpy(data,tile->encoded_data->buf,tile->encoded_data->size);
-   memcpy(&(data[tile->encoded_data->size]),&now,sizeof(apr_time_t));
-   
-   rv = apr_memcache_set(cache->memcache,key,data,tile->encoded_data->size+sizeof(apr_time_t),expires,0);
+   rv = apr_memcache_set(cache->memcache,key,data,len,expires,0);
    if(rv != APR_SUCCESS) {
       ctx->set_error(ctx,500,"failed to store tile %d %d %d to memcache cache %s",
             tile->x,tile->y,tile->z,cache->cache.name);
@@ -141,6 +214,64 @@ static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_tile *t
    }
 }
 
+/**
+ * \brief push tile data to memcached
+ * 
+ * writes the content of mapcache_tile::data to the configured memcached instance(s)
+ * \returns MAPCACHE_FAILURE if there is no data to write, or if the tile isn't locked
+ * \returns MAPCACHE_SUCCESS if the tile has been successfully written
+ * \private \memberof mapcache_cache_memcache
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_tile *tile) {
+   _mapcache_cache_memcache_set_value(ctx, tile, apr_time_now());
+}
+
+#if APR_HAS_THREADS
+struct memcache_set_job {
+   mapcache_tile *tile;
+   apr_time_t now;
+};
+
+static void _mapcache_cache_memcache_set_job(mapcache_context *ctx, void *data) {
+   struct memcache_set_job *job = (struct memcache_set_job*)data;
+   _mapcache_cache_memcache_set_value(ctx, job->tile, job->now);
+}
+#endif
+
+/**
+ * \brief push all the tiles of a metatile to memcached
+ *
+ * apr_memcache has no pipelined store command: when a fetching thread pool is available,
+ * the tiles are encoded and sent concurrently over the pooled server connections,
+ * instead of waiting for a full round trip per tile
+ * \private \memberof mapcache_cache_memcache
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_memcache_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles) {
+   int i;
+   apr_time_t now = apr_time_now();
+#if APR_HAS_THREADS
+   /* contexts that can't be cloned (e.g. the seeder's) can't hand out jobs to the pool */
+   if(ntiles > 1 && ctx->config->fetch_pool && ctx->clone) {
+      mapcache_worker_batch *batch = mapcache_worker_batch_create(ctx, ctx->config->fetch_pool);
+      GC_CHECK_ERROR(ctx);
+      for(i=0;i<ntiles;i++) {
+         struct memcache_set_job *job = apr_palloc(ctx->pool, sizeof(struct memcache_set_job));
+         job->tile = &tiles[i];
+         job->now = now;
+         mapcache_worker_batch_push(ctx, batch, _mapcache_cache_memcache_set_job, job);
+      }
+      mapcache_worker_batch_wait(ctx, batch);
+      return;
+   }
+#endif
+   for(i=0;i<ntiles;i++) {
+      _mapcache_cache_memcache_set_value(ctx, &tiles[i], now);
+      GC_CHECK_ERROR(ctx);
+   }
+}
+
 /**
  * \private \memberof mapcache_cache_memcache
  */
@@ -223,8 +354,10 @@ mapcache_cache* mapcache_cache_memcache_create(mapcache_context *ctx) {
    cache->cache.metadata = apr_table_make(ctx->pool,3);
    cache->cache.type = MAPCACHE_CACHE_MEMCACHE;
    cache->cache.tile_get = _mapcache_cache_memcache_get;
+   cache->cache.tile_multi_get = _mapcache_cache_memcache_multi_get;
    cache->cache.tile_exists = _mapcache_cache_memcache_has_tile;
    cache->cache.tile_set = _mapcache_cache_memcache_set;
+   cache->cache.tile_multi_set = _mapcache_cache_memcache_multi_set;
    cache->cache.tile_delete = _mapcache_cache_memcache_delete;
    cache->cache.configuration_post_config = _mapcache_cache_memcache_configuration_post_config;
    cache->cache.configuration_parse_xml = _mapcache_cache_memcache_configuration_parse_xml;
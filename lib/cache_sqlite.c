@@ -31,6 +31,9 @@
 
 #include "mapcache.h"
 #include <apr_strings.h>
+#include <apr_reslist.h>
+#include <apr_sha1.h>
+#include <apr_file_io.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
@@ -43,61 +46,559 @@
 
 
 
-static char* _get_dbname(mapcache_context *ctx,  mapcache_tileset *tileset, mapcache_grid *grid) {
-   mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tileset->cache;
-   char *path = cache->dbname_template;
-   path = mapcache_util_str_replace(ctx->pool, path, "{tileset}", tileset->name);
-   path = mapcache_util_str_replace(ctx->pool, path, "{grid}", grid->name);
-   return path;
-}
+/* the statements each connection keeps prepared */
+#define MAPCACHE_SQLITE_STMT_GET 0
+#define MAPCACHE_SQLITE_STMT_SET 1
+#define MAPCACHE_SQLITE_STMT_EXISTS 2
+#define MAPCACHE_SQLITE_STMT_DELETE 3
+#define MAPCACHE_SQLITE_STMT_HITSTAT 4
+#define MAPCACHE_SQLITE_STMT_SET_IMAGE 5
+#define MAPCACHE_SQLITE_NSTMTS 6
+
+/**
+ * an open connection to a database file, along with its prepared statements
+ */
+typedef struct _sqlite_dbpool _sqlite_dbpool;
+
+struct sqlite_conn {
+   sqlite3 *handle;
+   sqlite3_stmt *stmts[MAPCACHE_SQLITE_NSTMTS];
+   _sqlite_dbpool *dbpool; /**< the pool this connection was acquired from */
+};
 
-static sqlite3* _get_conn(mapcache_context *ctx, mapcache_tile* tile, int readonly) {
-   sqlite3* handle;
+/**
+ * the pool of connections to a database file
+ */
+struct _sqlite_dbpool {
+   mapcache_cache_sqlite *cache;
    char *dbfile;
-   int flags, ret;
-   if(readonly) {
-      flags = SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX;
+   apr_pool_t *pool; /**< holds the reslist, destroying it closes the idle connections */
+   apr_reslist_t *conns;
+   int inuse; /**< number of connections acquired and not yet released */
+   _sqlite_dbpool *prev, *next;
+};
+
+/**
+ * per-process pools of connections, one pool per database file.
+ *
+ * the pools are kept in a LRU list. once there are more than
+ * mapcache_cache_sqlite::max_open_files of them, the least recently used pools
+ * that have no connection in use are destroyed, closing their connections.
+ */
+typedef struct {
+   apr_pool_t *pool;
+   apr_hash_t *pools;
+   _sqlite_dbpool *head, *tail; /**< most and least recently used */
+   int count;
+#if APR_HAS_THREADS
+   apr_thread_mutex_t *mutex;
+#endif
+} _sqlite_connections;
+
+/**
+ * \brief return the database file containing the given tile
+ *
+ * the template may spread the tiles of a tileset over many files, using the {z}, {x}, {y},
+ * {div_x} or {div_y} placeholders. each file has its own pool of connections and its own
+ * write lock.
+ */
+static char* _get_dbname(mapcache_context *ctx, mapcache_tile *tile) {
+   mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
+   return mapcache_template_render(ctx, cache->dbname_tpl, tile, NULL, cache->count_x, cache->count_y);
+}
+
+/*
+ * connections are only allocated by the pool, they are opened by _get_conn() so that
+ * failures can be reported on the context of the request
+ */
+static apr_status_t _sqlite_reslist_get_connection(void **conn_, void *params, apr_pool_t *pool) {
+   *conn_ = calloc(1,sizeof(struct sqlite_conn));
+   return (*conn_)?APR_SUCCESS:APR_ENOMEM;
+}
+
+static apr_status_t _sqlite_reslist_free_connection(void *conn_, void *params, apr_pool_t *pool) {
+   struct sqlite_conn *conn = (struct sqlite_conn*)conn_;
+   int i;
+   for(i=0;i<MAPCACHE_SQLITE_NSTMTS;i++) {
+      if(conn->stmts[i]) {
+         sqlite3_finalize(conn->stmts[i]);
+      }
+   }
+   if(conn->handle) {
+      sqlite3_close(conn->handle);
+   }
+   free(conn);
+   return APR_SUCCESS;
+}
+
+static apr_status_t _sqlite_connections_cleanup(void *data) {
+   _sqlite_connections *connections = (_sqlite_connections*)data;
+   apr_pool_destroy(connections->pool);
+   return APR_SUCCESS;
+}
+
+static void _sqlite_connections_create(mapcache_context *ctx, mapcache_cache_sqlite *cache) {
+   _sqlite_connections *connections = apr_pcalloc(ctx->pool, sizeof(_sqlite_connections));
+   apr_status_t rv;
+   char errmsg[120];
+   /* pools are added by request threads, so they can't be allocated from the shared configuration pool */
+   if((rv = apr_pool_create(&connections->pool, NULL)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create sqlite connection pool: %s", apr_strerror(rv,errmsg,120));
+      return;
+   }
+   apr_pool_cleanup_register(ctx->pool, connections, _sqlite_connections_cleanup, apr_pool_cleanup_null);
+   connections->pools = apr_hash_make(connections->pool);
+#if APR_HAS_THREADS
+   if(apr_thread_mutex_create(&connections->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create sqlite connection pool mutex");
+      return;
+   }
+#endif
+   cache->connections = connections;
+}
+
+/* must be called with the mutex held */
+static void _sqlite_dbpool_unlink(_sqlite_connections *connections, _sqlite_dbpool *dbpool) {
+   if(dbpool->prev) dbpool->prev->next = dbpool->next; else connections->head = dbpool->next;
+   if(dbpool->next) dbpool->next->prev = dbpool->prev; else connections->tail = dbpool->prev;
+   dbpool->prev = dbpool->next = NULL;
+}
+
+/* must be called with the mutex held */
+static void _sqlite_dbpool_push_front(_sqlite_connections *connections, _sqlite_dbpool *dbpool) {
+   dbpool->next = connections->head;
+   if(connections->head) connections->head->prev = dbpool; else connections->tail = dbpool;
+   connections->head = dbpool;
+}
+
+/**
+ * \brief destroy the least recently used pools with no connection in use, until there are
+ * no more than max_open_files of them. must be called with the mutex held
+ */
+static void _sqlite_dbpool_evict(mapcache_cache_sqlite *cache, _sqlite_connections *connections) {
+   _sqlite_dbpool *dbpool = connections->tail;
+   while(dbpool && connections->count > cache->max_open_files) {
+      _sqlite_dbpool *prev = dbpool->prev;
+      if(!dbpool->inuse) {
+         _sqlite_dbpool_unlink(connections,dbpool);
+         apr_hash_set(connections->pools, dbpool->dbfile, APR_HASH_KEY_STRING, NULL);
+         connections->count--;
+         /* runs the reslist cleanup, which closes the idle connections */
+         apr_pool_destroy(dbpool->pool);
+      }
+      dbpool = prev;
+   }
+}
+
+/**
+ * \brief return the pool of connections to the given database file, creating it if needed
+ *
+ * the pool is marked as in use until the connection acquired from it is released
+ * with _release_conn()
+ */
+static _sqlite_dbpool* _sqlite_get_pool(mapcache_context *ctx, mapcache_cache_sqlite *cache, const char *dbfile) {
+   _sqlite_connections *connections = (_sqlite_connections*)cache->connections;
+   _sqlite_dbpool *dbpool;
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(connections->mutex);
+#endif
+   dbpool = apr_hash_get(connections->pools, dbfile, APR_HASH_KEY_STRING);
+   if(dbpool) {
+      _sqlite_dbpool_unlink(connections,dbpool);
    } else {
-      flags = SQLITE_OPEN_READWRITE|SQLITE_OPEN_NOMUTEX;
+      apr_pool_t *pool;
+      apr_status_t rv = apr_pool_create(&pool, connections->pool);
+      if(rv == APR_SUCCESS) {
+         dbpool = apr_pcalloc(pool, sizeof(_sqlite_dbpool));
+         dbpool->pool = pool;
+         dbpool->cache = cache;
+         dbpool->dbfile = apr_pstrdup(pool,dbfile);
+         rv = apr_reslist_create(&dbpool->conns,
+               0 /* min */,
+               cache->pool_size /* soft max */,
+               cache->pool_size /* hard max */,
+               60*1000000 /*60 seconds, ttl*/,
+               _sqlite_reslist_get_connection, /* resource constructor */
+               _sqlite_reslist_free_connection, /* resource destructor */
+               NULL, pool);
+         if(rv != APR_SUCCESS) {
+            apr_pool_destroy(pool);
+         }
+      }
+      if(rv != APR_SUCCESS) {
+         ctx->set_error(ctx, 500, "failed to create sqlite connection pool for %s", dbfile);
+#if APR_HAS_THREADS
+         apr_thread_mutex_unlock(connections->mutex);
+#endif
+         return NULL;
+      }
+      apr_hash_set(connections->pools, dbpool->dbfile, APR_HASH_KEY_STRING, dbpool);
+      connections->count++;
+   }
+   _sqlite_dbpool_push_front(connections,dbpool);
+   dbpool->inuse++;
+   _sqlite_dbpool_evict(cache,connections);
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(connections->mutex);
+#endif
+   return dbpool;
+}
+
+/**
+ * \brief hand back a pool obtained with _sqlite_get_pool()
+ */
+static void _sqlite_put_pool(_sqlite_dbpool *dbpool) {
+   mapcache_cache_sqlite *cache = dbpool->cache;
+   _sqlite_connections *connections = (_sqlite_connections*)cache->connections;
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(connections->mutex);
+#endif
+   dbpool->inuse--;
+   _sqlite_dbpool_evict(cache,connections);
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(connections->mutex);
+#endif
+}
+
+/**
+ * \brief create the directory containing the given database file
+ */
+static void _sqlite_make_parent_dir(mapcache_context *ctx, const char *dbfile) {
+   apr_status_t rv;
+   char errmsg[120];
+   char *dirname = apr_pstrdup(ctx->pool,dbfile);
+   char *lastslash = strrchr(dirname,'/');
+   if(!lastslash || lastslash == dirname) return;
+   *lastslash = '\0';
+   rv = apr_dir_make_recursive(dirname,APR_OS_DEFAULT,ctx->pool);
+   if(rv != APR_SUCCESS && !APR_STATUS_IS_EEXIST(rv)) {
+      ctx->set_error(ctx, 500, "failed to create directory %s: %s", dirname, apr_strerror(rv,errmsg,120));
+   }
+}
+
+/**
+ * \brief open a new connection to the given database file
+ *
+ * the file, its directory and its schema are only created if \p create is set
+ * \returns MAPCACHE_CACHE_MISS if the file does not exist and \p create isn't set
+ */
+static int _sqlite_open(mapcache_context *ctx, mapcache_cache_sqlite *cache, struct sqlite_conn *conn,
+      const char *dbfile, int create) {
+   int ret;
+   const apr_array_header_t *elts;
+   int i;
+   int flags = SQLITE_OPEN_READWRITE|SQLITE_OPEN_NOMUTEX;
+   if(create) {
+      /* the databases of a sharded cache are spread over directories that may not exist yet */
+      _sqlite_make_parent_dir(ctx,dbfile);
+      if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
+      flags |= SQLITE_OPEN_CREATE;
+   }
+   /* the database is opened read-only by sqlite if the file isn't writable */
+   ret = sqlite3_open_v2(dbfile, &conn->handle, flags, NULL);
+   if(ret == SQLITE_CANTOPEN && !create) {
+      /* no tile has been stored in this database yet */
+      return MAPCACHE_CACHE_MISS;
    }
-   dbfile = _get_dbname(ctx,tile->tileset, tile->grid_link->grid);
-   ret = sqlite3_open_v2(dbfile,&handle,flags,NULL);
    if(ret != SQLITE_OK) {
-      /* maybe the database file doesn't exist yet. so we create it and setup the schema */
-      mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)tile->tileset->cache;
-      ret = sqlite3_open_v2(dbfile, &handle,SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE,NULL);
-      if (ret != SQLITE_OK) {
-         ctx->set_error(ctx, 500, "sqlite backend failed to open db %s: %s", dbfile, sqlite3_errmsg(handle));
-         sqlite3_close(handle);
+      ctx->set_error(ctx, 500, "sqlite backend failed to open db %s: %s", dbfile, sqlite3_errmsg(conn->handle));
+      return MAPCACHE_FAILURE;
+   }
+   sqlite3_busy_timeout(conn->handle,300000);
+   do {
+      ret = sqlite3_exec(conn->handle, cache->create_stmt.sql, 0, 0, NULL);
+   } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
+   if(ret != SQLITE_OK && ret != SQLITE_READONLY) {
+      ctx->set_error(ctx, 500, "sqlite backend failed to create db schema on %s: %s",dbfile, sqlite3_errmsg(conn->handle));
+      return MAPCACHE_FAILURE;
+   }
+   if(cache->wal && !sqlite3_db_readonly(conn->handle,"main")) {
+      /*
+       * readers don't block the writer and vice-versa, and commits only need to
+       * sync the log when it is checkpointed into the database
+       */
+      if(sqlite3_exec(conn->handle, "PRAGMA journal_mode=WAL", 0, 0, NULL) != SQLITE_OK ||
+            sqlite3_exec(conn->handle, "PRAGMA synchronous=NORMAL", 0, 0, NULL) != SQLITE_OK) {
+         ctx->set_error(ctx, 500, "sqlite backend failed to enable wal mode on %s: %s", dbfile, sqlite3_errmsg(conn->handle));
+         return MAPCACHE_FAILURE;
+      }
+      if(cache->wal_checkpoint >= 0) {
+         sqlite3_wal_autocheckpoint(conn->handle, cache->wal_checkpoint);
+      }
+   }
+   elts = apr_table_elts(cache->pragmas);
+   for(i=0;i<elts->nelts;i++) {
+      apr_table_entry_t entry = APR_ARRAY_IDX(elts,i,apr_table_entry_t);
+      char *pragma = apr_psprintf(ctx->pool,"PRAGMA %s=%s",entry.key,entry.val);
+      ret = sqlite3_exec(conn->handle, pragma, 0, 0, NULL);
+      if(ret != SQLITE_OK && ret != SQLITE_DONE && ret != SQLITE_ROW) {
+         ctx->set_error(ctx, 500, "sqlite backend failed to set \"%s\" on %s: %s", pragma, dbfile, sqlite3_errmsg(conn->handle));
+         return MAPCACHE_FAILURE;
+      }
+   }
+   return MAPCACHE_SUCCESS;
+}
+
+/**
+ * \brief get a connection to the given database file
+ *
+ * \param create create the database if it doesn't exist, i.e. the connection is used for writing
+ * \returns NULL without setting an error if the database doesn't exist and \p create isn't set
+ */
+static struct sqlite_conn* _get_conn_to(mapcache_context *ctx, mapcache_cache_sqlite *cache, const char *dbfile, int create) {
+   struct sqlite_conn *conn;
+   _sqlite_dbpool *dbpool;
+   apr_status_t rv;
+   dbpool = _sqlite_get_pool(ctx,cache,dbfile);
+   if(GC_HAS_ERROR(ctx)) {
+      return NULL;
+   }
+   rv = apr_reslist_acquire(dbpool->conns, (void **)&conn);
+   if(rv != APR_SUCCESS) {
+      char errmsg[120];
+      ctx->set_error(ctx, 500, "failed to aquire connection to sqlite db %s: %s", dbfile, apr_strerror(rv,errmsg,120));
+      _sqlite_put_pool(dbpool);
+      return NULL;
+   }
+   conn->dbpool = dbpool;
+   if(!conn->handle) {
+      if(_sqlite_open(ctx,cache,conn,dbfile,create) != MAPCACHE_SUCCESS) {
+         apr_reslist_invalidate(dbpool->conns,(void*)conn);
+         _sqlite_put_pool(dbpool);
          return NULL;
       }
-      sqlite3_busy_timeout(handle,300000);
-      do {
-         ret = sqlite3_exec(handle, cache->create_stmt.sql, 0, 0, NULL);
-         if(ret != SQLITE_OK && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
-            ctx->set_error(ctx,500,"sqlite backend failed on set: %s (%d)",sqlite3_errmsg(handle),ret);
-            break;
-         }
-      } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
+   }
+   return conn;
+}
+
+static struct sqlite_conn* _get_conn(mapcache_context *ctx, mapcache_tile* tile, int create) {
+   char *dbfile = _get_dbname(ctx,tile);
+   if(GC_HAS_ERROR(ctx)) {
+      return NULL;
+   }
+   return _get_conn_to(ctx,(mapcache_cache_sqlite*)tile->tileset->cache,dbfile,create);
+}
+
+static void _release_conn(mapcache_context *ctx, struct sqlite_conn *conn) {
+   _sqlite_dbpool *dbpool = conn->dbpool;
+   if(GC_HAS_ERROR(ctx)) {
+      apr_reslist_invalidate(dbpool->conns,(void*)conn);
+   } else {
+      apr_reslist_release(dbpool->conns,(void*)conn);
+   }
+   _sqlite_put_pool(dbpool);
+}
+
+/**
+ * \brief return a prepared statement of the connection, ready to be bound
+ */
+static sqlite3_stmt* _get_stmt(mapcache_context *ctx, struct sqlite_conn *conn, int idx, mapcache_cache_sqlite_stmt *stmt) {
+   if(!conn->stmts[idx]) {
+      int ret = sqlite3_prepare_v2(conn->handle, stmt->sql, -1, &conn->stmts[idx], NULL);
       if(ret != SQLITE_OK) {
-         ctx->set_error(ctx, 500, "sqlite backend failed to create db schema on %s: %s",dbfile, sqlite3_errmsg(handle));
-         sqlite3_close(handle);
+         ctx->set_error(ctx, 500, "sqlite backend failed to prepare \"%s\": %s", stmt->sql, sqlite3_errmsg(conn->handle));
+         conn->stmts[idx] = NULL;
          return NULL;
       }
+   }
+   return conn->stmts[idx];
+}
+
+/**
+ * \brief execute a statement that does not return data, retrying while the database is busy
+ */
+static int _sqlite_exec(struct sqlite_conn *conn, const char *sql) {
+   int ret;
+   do {
+      ret = sqlite3_exec(conn->handle, sql, 0, 0, NULL);
+   } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
+   return ret;
+}
+
+/* reset a statement so it can be reused by the next user of the connection */
+static void _reset_stmt(sqlite3_stmt *stmt) {
+   sqlite3_reset(stmt);
+   sqlite3_clear_bindings(stmt);
+}
+
+/**
+ * a tile's hits that have not yet been written to its database
+ */
+struct sqlite_hit {
+   const char *dbfile;
+   int x,y,z;
+   const char *dim;
+   int count;
+   apr_time_t atime;
+};
+
+/**
+ * per-process accumulator of tile hits, written to the databases in batches
+ */
+typedef struct {
+   apr_pool_t *root;
+   apr_pool_t *pool; /**< holds the pending hits, a new one is created at each flush */
+   apr_hash_t *hits;
+   int nhits;
+   apr_time_t last_flush;
+#if APR_HAS_THREADS
+   apr_thread_mutex_t *mutex;
+#endif
+} _sqlite_hitstats;
+
+static apr_status_t _sqlite_hitstats_cleanup(void *data) {
+   _sqlite_hitstats *stats = (_sqlite_hitstats*)data;
+   apr_pool_destroy(stats->root);
+   return APR_SUCCESS;
+}
+
+static void _sqlite_hitstats_create(mapcache_context *ctx, mapcache_cache_sqlite *cache) {
+   _sqlite_hitstats *stats = apr_pcalloc(ctx->pool, sizeof(_sqlite_hitstats));
+   apr_status_t rv;
+   char errmsg[120];
+   /* batch pools are created and destroyed by request threads, away from the shared configuration pool */
+   if((rv = apr_pool_create(&stats->root, NULL)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create sqlite hitstats pool: %s", apr_strerror(rv,errmsg,120));
+      return;
+   }
+   apr_pool_cleanup_register(ctx->pool, stats, _sqlite_hitstats_cleanup, apr_pool_cleanup_null);
+   apr_pool_create(&stats->pool, stats->root);
+   stats->hits = apr_hash_make(stats->pool);
+   stats->last_flush = apr_time_now();
+#if APR_HAS_THREADS
+   if(apr_thread_mutex_create(&stats->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create sqlite hitstats mutex");
+      return;
+   }
+#endif
+   cache->hits = stats;
+}
+
+/**
+ * \brief write a batch of hits, with one transaction per database file
+ */
+static void _sqlite_hitstats_write(mapcache_context *ctx, mapcache_cache_sqlite *cache, apr_hash_t *hits) {
+   apr_hash_t *bydb = apr_hash_make(ctx->pool);
+   apr_hash_index_t *hi;
+   for(hi = apr_hash_first(ctx->pool,hits); hi; hi = apr_hash_next(hi)) {
+      struct sqlite_hit *hit;
+      apr_array_header_t *dbhits;
+      apr_hash_this(hi,NULL,NULL,(void**)&hit);
+      dbhits = apr_hash_get(bydb,hit->dbfile,APR_HASH_KEY_STRING);
+      if(!dbhits) {
+         dbhits = apr_array_make(ctx->pool,64,sizeof(struct sqlite_hit*));
+         apr_hash_set(bydb,hit->dbfile,APR_HASH_KEY_STRING,dbhits);
+      }
+      APR_ARRAY_PUSH(dbhits,struct sqlite_hit*) = hit;
+   }
 
-      /* re-open the db read-only if that's what we were asked for */
-      if(readonly) {
-         sqlite3_close(handle);
-         ret = sqlite3_open_v2(dbfile,&handle,flags,NULL);
-         if (ret != SQLITE_OK) {
-            ctx->set_error(ctx, 500, "sqlite backend failed to re-open freshly created db %s readonly: %s",dbfile, sqlite3_errmsg(handle));
-            sqlite3_close(handle);
-            return NULL;
+   for(hi = apr_hash_first(ctx->pool,bydb); hi; hi = apr_hash_next(hi)) {
+      const char *dbfile;
+      apr_array_header_t *dbhits;
+      struct sqlite_conn *conn;
+      sqlite3_stmt *stmt;
+      int i,ret;
+      apr_hash_this(hi,(const void**)&dbfile,NULL,(void**)&dbhits);
+      conn = _get_conn_to(ctx,cache,dbfile,0);
+      if(GC_HAS_ERROR(ctx)) return;
+      if(!conn) continue; /* the database has been removed since the tiles were read */
+      stmt = _get_stmt(ctx,conn,MAPCACHE_SQLITE_STMT_HITSTAT,&cache->hitstat_stmt);
+      if(!GC_HAS_ERROR(ctx)) {
+         ret = _sqlite_exec(conn, "BEGIN IMMEDIATE TRANSACTION");
+         if(ret != SQLITE_OK) {
+            ctx->set_error(ctx,500,"sqlite backend failed to begin hitstats transaction: %s (%d)",sqlite3_errmsg(conn->handle),ret);
+         }
+      }
+      for(i=0; !GC_HAS_ERROR(ctx) && i<dbhits->nelts; i++) {
+         struct sqlite_hit *hit = APR_ARRAY_IDX(dbhits,i,struct sqlite_hit*);
+         int paramidx;
+         if((paramidx = sqlite3_bind_parameter_index(stmt, ":x"))) sqlite3_bind_int(stmt, paramidx, hit->x);
+         if((paramidx = sqlite3_bind_parameter_index(stmt, ":y"))) sqlite3_bind_int(stmt, paramidx, hit->y);
+         if((paramidx = sqlite3_bind_parameter_index(stmt, ":z"))) sqlite3_bind_int(stmt, paramidx, hit->z);
+         if((paramidx = sqlite3_bind_parameter_index(stmt, ":dim"))) sqlite3_bind_text(stmt, paramidx, hit->dim, -1, SQLITE_STATIC);
+         if((paramidx = sqlite3_bind_parameter_index(stmt, ":hits"))) sqlite3_bind_int(stmt, paramidx, hit->count);
+         if((paramidx = sqlite3_bind_parameter_index(stmt, ":atime"))) sqlite3_bind_int64(stmt, paramidx, apr_time_sec(hit->atime));
+         ret = sqlite3_step(stmt);
+         if(ret != SQLITE_DONE && ret != SQLITE_ROW) {
+            ctx->set_error(ctx,500,"sqlite backend failed on hitstats update: %s (%d)",sqlite3_errmsg(conn->handle),ret);
+         }
+         _reset_stmt(stmt);
+      }
+      if(!GC_HAS_ERROR(ctx)) {
+         ret = _sqlite_exec(conn, "COMMIT TRANSACTION");
+         if(ret != SQLITE_OK) {
+            ctx->set_error(ctx,500,"sqlite backend failed to commit hitstats: %s (%d)",sqlite3_errmsg(conn->handle),ret);
          }
       }
+      if(GC_HAS_ERROR(ctx) && !sqlite3_get_autocommit(conn->handle)) {
+         sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
+      }
+      _release_conn(ctx,conn);
+      GC_CHECK_ERROR(ctx);
+   }
+}
+
+/**
+ * \brief account for a hit on a tile
+ *
+ * hits are accumulated in memory, and written in a single batch by the request that
+ * reaches the configured number of hits or flush interval. hits pending when the
+ * process exits are lost.
+ */
+static void _sqlite_hitstats_record(mapcache_context *ctx, mapcache_cache_sqlite *cache, const char *dbfile,
+      mapcache_tile *tile) {
+   _sqlite_hitstats *stats = (_sqlite_hitstats*)cache->hits;
+   const char *dim = tile->dimensions?mapcache_util_get_tile_dimkey(ctx,tile,NULL,NULL):"";
+   char *key = apr_psprintf(ctx->pool,"%s\n%d\n%d\n%d\n%s",dbfile,tile->x,tile->y,tile->z,dim);
+   struct sqlite_hit *hit;
+   apr_time_t now = apr_time_now();
+   apr_hash_t *pending = NULL;
+   apr_pool_t *pending_pool = NULL;
+
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(stats->mutex);
+#endif
+   hit = apr_hash_get(stats->hits,key,APR_HASH_KEY_STRING);
+   if(!hit) {
+      hit = apr_pcalloc(stats->pool,sizeof(struct sqlite_hit));
+      hit->dbfile = apr_pstrdup(stats->pool,dbfile);
+      hit->x = tile->x;
+      hit->y = tile->y;
+      hit->z = tile->z;
+      hit->dim = apr_pstrdup(stats->pool,dim);
+      apr_hash_set(stats->hits,apr_pstrdup(stats->pool,key),APR_HASH_KEY_STRING,hit);
+   }
+   hit->count++;
+   hit->atime = now;
+   stats->nhits++;
+   if(stats->nhits >= cache->hitstats_batch || now - stats->last_flush >= cache->hitstats_interval) {
+      /* take the pending hits, other threads start filling a new batch */
+      pending = stats->hits;
+      pending_pool = stats->pool;
+      apr_pool_create(&stats->pool, stats->root);
+      stats->hits = apr_hash_make(stats->pool);
+      stats->nhits = 0;
+      stats->last_flush = now;
+   }
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(stats->mutex);
+#endif
+
+   if(pending) {
+      _sqlite_hitstats_write(ctx,cache,pending);
+      if(GC_HAS_ERROR(ctx)) {
+         /* not worth failing the request */
+         ctx->log(ctx,MAPCACHE_WARN,"sqlite cache %s: dropping hitstats: %s",cache->cache.name,ctx->get_error_message(ctx));
+         ctx->clear_errors(ctx);
+      }
+#if APR_HAS_THREADS
+      apr_thread_mutex_lock(stats->mutex);
+#endif
+      apr_pool_destroy(pending_pool);
+#if APR_HAS_THREADS
+      apr_thread_mutex_unlock(stats->mutex);
+#endif
    }
-   sqlite3_busy_timeout(handle,300000);
-   return handle;
 }
 
 /**
@@ -138,6 +639,11 @@ static void _bind_sqlite_params(mapcache_context *ctx, sqlite3_stmt *stmt, mapca
    /* tile blob data */
    paramidx = sqlite3_bind_parameter_index(stmt, ":data");
    if(paramidx) {
+      if(tile->nodata && ((mapcache_cache_sqlite*)tile->tileset->cache)->empty_markers) {
+         /* empty marker */
+         sqlite3_bind_zeroblob(stmt,paramidx,0);
+         return;
+      }
       if(!tile->encoded_data) {
          tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
          GC_CHECK_ERROR(ctx);
@@ -152,157 +658,270 @@ static void _bind_sqlite_params(mapcache_context *ctx, sqlite3_stmt *stmt, mapca
 
 static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_tile *tile) {
    mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)tile->tileset->cache;
-   sqlite3* handle = _get_conn(ctx,tile,1);
+   struct sqlite_conn *conn = _get_conn(ctx,tile,0);
    sqlite3_stmt *stmt;
    int ret;
-   if(GC_HAS_ERROR(ctx)) {
-      sqlite3_close(handle);
+   if(!conn) {
       return MAPCACHE_FALSE;
    }
 
-   sqlite3_prepare(handle,cache->exists_stmt.sql,-1,&stmt,NULL);
+   stmt = _get_stmt(ctx,conn,MAPCACHE_SQLITE_STMT_EXISTS,&cache->exists_stmt);
+   if(GC_HAS_ERROR(ctx)) {
+      _release_conn(ctx,conn);
+      return MAPCACHE_FALSE;
+   }
    _bind_sqlite_params(ctx,stmt,tile);
    ret = sqlite3_step(stmt);
    if(ret != SQLITE_DONE && ret != SQLITE_ROW) {
-      ctx->set_error(ctx,500,"sqlite backend failed on has_tile: %s",sqlite3_errmsg(handle));
+      ctx->set_error(ctx,500,"sqlite backend failed on has_tile: %s",sqlite3_errmsg(conn->handle));
    }
    if(ret == SQLITE_DONE) {
       ret = MAPCACHE_FALSE;
    } else if(ret == SQLITE_ROW){
       ret = MAPCACHE_TRUE;
    }
-   sqlite3_finalize(stmt);
-   sqlite3_close(handle);
+   _reset_stmt(stmt);
+   _release_conn(ctx,conn);
    return ret;
 }
 
 static void _mapcache_cache_sqlite_delete(mapcache_context *ctx, mapcache_tile *tile) {
    mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)tile->tileset->cache;
-   sqlite3* handle = _get_conn(ctx,tile,0);
+   struct sqlite_conn *conn = _get_conn(ctx,tile,0);
    sqlite3_stmt *stmt;
    int ret;
-   GC_CHECK_ERROR(ctx);
-   sqlite3_prepare(handle,cache->delete_stmt.sql,-1,&stmt,NULL);
-   _bind_sqlite_params(ctx,stmt,tile);
-   ret = sqlite3_step(stmt);
-   if(ret != SQLITE_DONE && ret != SQLITE_ROW) {
-      ctx->set_error(ctx,500,"sqlite backend failed on delete: %s",sqlite3_errmsg(handle));
+   if(!conn) {
+      return;
    }
-   sqlite3_finalize(stmt);
-   sqlite3_close(handle);
+   stmt = _get_stmt(ctx,conn,MAPCACHE_SQLITE_STMT_DELETE,&cache->delete_stmt);
+   if(!GC_HAS_ERROR(ctx)) {
+      _bind_sqlite_params(ctx,stmt,tile);
+      ret = sqlite3_step(stmt);
+      if(ret != SQLITE_DONE && ret != SQLITE_ROW) {
+         ctx->set_error(ctx,500,"sqlite backend failed on delete: %s",sqlite3_errmsg(conn->handle));
+      }
+      _reset_stmt(stmt);
+   }
+   _release_conn(ctx,conn);
 }
 
 
 static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_tile *tile) {
    mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)tile->tileset->cache;
-   sqlite3 *handle;
+   struct sqlite_conn *conn;
    sqlite3_stmt *stmt;
    int ret;
-   if(cache->hitstats) {
-      handle = _get_conn(ctx,tile,0);
-   } else {
-      handle = _get_conn(ctx,tile,1);
+   char *dbfile = _get_dbname(ctx,tile);
+   if(GC_HAS_ERROR(ctx)) {
+      return MAPCACHE_FAILURE;
    }
+   conn = _get_conn_to(ctx,cache,dbfile,0);
+   if(!conn) {
+      return GC_HAS_ERROR(ctx)?MAPCACHE_FAILURE:MAPCACHE_CACHE_MISS;
+   }
+   stmt = _get_stmt(ctx,conn,MAPCACHE_SQLITE_STMT_GET,&cache->get_stmt);
    if(GC_HAS_ERROR(ctx)) {
-      sqlite3_close(handle);
+      _release_conn(ctx,conn);
       return MAPCACHE_FAILURE;
    }
-   sqlite3_prepare(handle,cache->get_stmt.sql,-1,&stmt,NULL);
    _bind_sqlite_params(ctx,stmt,tile);
    do {
       ret = sqlite3_step(stmt);
       if(ret!=SQLITE_DONE && ret != SQLITE_ROW && ret!=SQLITE_BUSY && ret !=SQLITE_LOCKED) {
-         ctx->set_error(ctx,500,"sqlite backend failed on get: %s",sqlite3_errmsg(handle));
-         sqlite3_finalize(stmt);
-         sqlite3_close(handle);
+         ctx->set_error(ctx,500,"sqlite backend failed on get: %s",sqlite3_errmsg(conn->handle));
+         _reset_stmt(stmt);
+         _release_conn(ctx,conn);
          return MAPCACHE_FAILURE;
       }
    } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
    if(ret == SQLITE_DONE) {
-      sqlite3_finalize(stmt);
-      sqlite3_close(handle);
+      _reset_stmt(stmt);
+      _release_conn(ctx,conn);
       return MAPCACHE_CACHE_MISS;
    } else {
       const void *blob = sqlite3_column_blob(stmt,0);
       int size = sqlite3_column_bytes(stmt, 0);
-      tile->encoded_data = mapcache_buffer_create(size,ctx->pool);
-      memcpy(tile->encoded_data->buf, blob,size);
-      tile->encoded_data->size = size;
+      if(size) {
+         tile->encoded_data = mapcache_buffer_create(size,ctx->pool);
+         memcpy(tile->encoded_data->buf, blob,size);
+         tile->encoded_data->size = size;
+      } else {
+         /* a zero-length blob is an empty marker */
+         tile->nodata = 1;
+      }
       if(sqlite3_column_count(stmt) > 1) {
          time_t mtime = sqlite3_column_int64(stmt, 1);
          apr_time_ansi_put(&(tile->mtime),mtime);
       }
-      sqlite3_finalize(stmt);
+      _reset_stmt(stmt);
+      _release_conn(ctx,conn);
 
       /* update the hitstats if we're configured for that */
       if(cache->hitstats) {
-         sqlite3_stmt *hitstmt;
-         sqlite3_prepare(handle,cache->hitstat_stmt.sql,-1,&hitstmt,NULL);
-         _bind_sqlite_params(ctx,stmt,tile);
-         sqlite3_step(hitstmt); /* we ignore the return value , TODO?*/
-         sqlite3_finalize(hitstmt);
+         _sqlite_hitstats_record(ctx,cache,dbfile,tile);
       }
-
-      sqlite3_close(handle);
       return MAPCACHE_SUCCESS;
    }
 }
 
-static void _mapcache_cache_sqlite_set(mapcache_context *ctx, mapcache_tile *tile) {
-   mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)tile->tileset->cache;
-   sqlite3* handle = _get_conn(ctx,tile,0);
-   sqlite3_stmt *stmt;
+/**
+ * \brief step a statement writing to the database, retrying while the database is busy
+ */
+static void _sqlite_step_write(mapcache_context *ctx, struct sqlite_conn *conn, sqlite3_stmt *stmt) {
    int ret;
-   GC_CHECK_ERROR(ctx);
-   
-   sqlite3_prepare(handle,cache->set_stmt.sql,-1,&stmt,NULL);
-   _bind_sqlite_params(ctx,stmt,tile);
    do {
       ret = sqlite3_step(stmt);
       if(ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
-         ctx->set_error(ctx,500,"sqlite backend failed on set: %s (%d)",sqlite3_errmsg(handle),ret);
+         ctx->set_error(ctx,500,"sqlite backend failed on set: %s (%d)",sqlite3_errmsg(conn->handle),ret);
          break;
       }
       if(ret == SQLITE_BUSY) {
          sqlite3_reset(stmt);
       }
    } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
-   sqlite3_finalize(stmt);
-   sqlite3_close(handle);
+   _reset_stmt(stmt);
 }
 
-static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles) {
-   mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)tiles[0].tileset->cache;
-   sqlite3* handle = _get_conn(ctx,&tiles[0],0);
+static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles);
+
+static void _mapcache_cache_sqlite_set(mapcache_context *ctx, mapcache_tile *tile) {
+   mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)tile->tileset->cache;
+   struct sqlite_conn *conn;
+   sqlite3_stmt *stmt;
+
+   if(cache->set_image_stmt.sql) {
+      /* the image and its reference must be written in the same transaction */
+      _mapcache_cache_sqlite_multi_set(ctx,tile,1);
+      return;
+   }
+   conn = _get_conn(ctx,tile,1);
+   GC_CHECK_ERROR(ctx);
+   
+   stmt = _get_stmt(ctx,conn,MAPCACHE_SQLITE_STMT_SET,&cache->set_stmt);
+   if(GC_HAS_ERROR(ctx)) {
+      _release_conn(ctx,conn);
+      return;
+   }
+   _bind_sqlite_params(ctx,stmt,tile);
+   _sqlite_step_write(ctx,conn,stmt);
+   _release_conn(ctx,conn);
+}
+
+/**
+ * \brief store a tile in a deduplicated mbtiles database
+ *
+ * the image is stored once in the images table, keyed by the sha1 sum of its data,
+ * and referenced by the tile's entry in the map table. \p seen holds the images
+ * already written by the current transaction.
+ */
+static void _sqlite_store_deduplicated(mapcache_context *ctx, mapcache_cache_sqlite *cache, struct sqlite_conn *conn,
+      sqlite3_stmt *stmt, mapcache_tile *tile, apr_hash_t *seen) {
+   unsigned char digest[APR_SHA1_DIGESTSIZE];
+   char *tile_id = apr_palloc(ctx->pool, 2*APR_SHA1_DIGESTSIZE+1);
+   apr_sha1_ctx_t sha;
+   int i, paramidx;
+
+   if(!tile->encoded_data) {
+      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+      GC_CHECK_ERROR(ctx);
+   }
+   apr_sha1_init(&sha);
+   apr_sha1_update_binary(&sha, (const unsigned char*)tile->encoded_data->buf, tile->encoded_data->size);
+   apr_sha1_final(digest, &sha);
+   for(i=0;i<APR_SHA1_DIGESTSIZE;i++) {
+      sprintf(tile_id+2*i,"%02x",digest[i]);
+   }
+
+   if(!apr_hash_get(seen, tile_id, APR_HASH_KEY_STRING)) {
+      sqlite3_stmt *imgstmt = _get_stmt(ctx,conn,MAPCACHE_SQLITE_STMT_SET_IMAGE,&cache->set_image_stmt);
+      GC_CHECK_ERROR(ctx);
+      _bind_sqlite_params(ctx,imgstmt,tile);
+      paramidx = sqlite3_bind_parameter_index(imgstmt, ":tile_id");
+      if(paramidx) sqlite3_bind_text(imgstmt,paramidx,tile_id,-1,SQLITE_STATIC);
+      _sqlite_step_write(ctx,conn,imgstmt);
+      GC_CHECK_ERROR(ctx);
+      apr_hash_set(seen, tile_id, APR_HASH_KEY_STRING, tile_id);
+   }
+
+   _bind_sqlite_params(ctx,stmt,tile);
+   paramidx = sqlite3_bind_parameter_index(stmt, ":tile_id");
+   if(paramidx) sqlite3_bind_text(stmt,paramidx,tile_id,-1,SQLITE_STATIC);
+   _sqlite_step_write(ctx,conn,stmt);
+}
+
+/**
+ * \brief store all the tiles of a metatile in a single transaction
+ *
+ * the write lock is taken upfront with BEGIN IMMEDIATE: a deferred transaction
+ * upgrading its read lock could fail with SQLITE_BUSY without the busy handler
+ * being invoked, if another connection is waiting for the same upgrade.
+ */
+static void _mapcache_cache_sqlite_multi_set_db(mapcache_context *ctx, mapcache_cache_sqlite *cache,
+      const char *dbfile, mapcache_tile **tiles, int ntiles) {
+   struct sqlite_conn *conn = _get_conn_to(ctx,cache,dbfile,1);
+   apr_hash_t *seen = apr_hash_make(ctx->pool);
    sqlite3_stmt *stmt;
    int ret,i;
    GC_CHECK_ERROR(ctx);
-   sqlite3_prepare(handle,cache->set_stmt.sql,-1,&stmt,NULL);
-   sqlite3_exec(handle, "BEGIN TRANSACTION", 0, 0, 0);
+   stmt = _get_stmt(ctx,conn,MAPCACHE_SQLITE_STMT_SET,&cache->set_stmt);
+   if(GC_HAS_ERROR(ctx)) {
+      _release_conn(ctx,conn);
+      return;
+   }
+   ret = _sqlite_exec(conn, "BEGIN IMMEDIATE TRANSACTION");
+   if(ret != SQLITE_OK) {
+      ctx->set_error(ctx,500,"sqlite backend failed to begin transaction: %s (%d)",sqlite3_errmsg(conn->handle),ret);
+      _release_conn(ctx,conn);
+      return;
+   }
    for(i=0;i<ntiles;i++) {
-      mapcache_tile *tile = &tiles[i];
-      _bind_sqlite_params(ctx,stmt,tile);
-      do {
-         ret = sqlite3_step(stmt);
-         if(ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
-            ctx->set_error(ctx,500,"sqlite backend failed on set: %s (%d)",sqlite3_errmsg(handle),ret);
-            break;
-         }
-         if(ret == SQLITE_BUSY) {
-            sqlite3_reset(stmt);
-         }
-      } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
+      mapcache_tile *tile = tiles[i];
+      if(cache->set_image_stmt.sql) {
+         _sqlite_store_deduplicated(ctx,cache,conn,stmt,tile,seen);
+      } else {
+         _bind_sqlite_params(ctx,stmt,tile);
+         _sqlite_step_write(ctx,conn,stmt);
+      }
       if(GC_HAS_ERROR(ctx)) break;
-      sqlite3_clear_bindings(stmt);
-      sqlite3_reset(stmt);
+   }
+   if(!GC_HAS_ERROR(ctx)) {
+      /* in rollback journal mode, the commit waits for the readers to release their locks */
+      ret = _sqlite_exec(conn, "COMMIT TRANSACTION");
+      if(ret != SQLITE_OK) {
+         ctx->set_error(ctx,500,"sqlite backend failed to commit transaction: %s (%d)",sqlite3_errmsg(conn->handle),ret);
+      }
    }
    if(GC_HAS_ERROR(ctx)) {
-      sqlite3_exec(handle, "ROLLBACK TRANSACTION", 0, 0, 0);
-   } else {
-      sqlite3_exec(handle, "END TRANSACTION", 0, 0, 0);
+      sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
+   }
+   _release_conn(ctx,conn);
+}
+
+static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles) {
+   mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)tiles[0].tileset->cache;
+   mapcache_tile **group = apr_palloc(ctx->pool, ntiles * sizeof(mapcache_tile*));
+   char **dbfiles = apr_palloc(ctx->pool, ntiles * sizeof(char*));
+   char *done = apr_pcalloc(ctx->pool, ntiles);
+   int i,j;
+
+   for(i=0;i<ntiles;i++) {
+      dbfiles[i] = _get_dbname(ctx,&tiles[i]);
+      GC_CHECK_ERROR(ctx);
+   }
+
+   /* a metatile may straddle several database files, each one gets its own transaction */
+   for(i=0;i<ntiles;i++) {
+      int ngroup = 0;
+      if(done[i]) continue;
+      for(j=i;j<ntiles;j++) {
+         if(!done[j] && !strcmp(dbfiles[i],dbfiles[j])) {
+            group[ngroup++] = &tiles[j];
+            done[j] = 1;
+         }
+      }
+      _mapcache_cache_sqlite_multi_set_db(ctx, cache, dbfiles[i], group, ngroup);
+      GC_CHECK_ERROR(ctx);
    }
-   sqlite3_finalize(stmt);
-   sqlite3_close(handle);
 }
 
 static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config) {
@@ -317,15 +936,94 @@ static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx
    if ((cur_node = ezxml_child(node,"dbname_template")) != NULL) {
       dcache->dbname_template = apr_pstrdup(ctx->pool,cur_node->txt);
    }
+   if ((cur_node = ezxml_child(node,"xcount")) != NULL) {
+      char *endptr;
+      dcache->count_x = (int)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || dcache->count_x <= 0) {
+         ctx->set_error(ctx,400,"failed to parse xcount value %s for sqlite cache %s", cur_node->txt,cache->name);
+         return;
+      }
+   }
+   if ((cur_node = ezxml_child(node,"ycount")) != NULL) {
+      char *endptr;
+      dcache->count_y = (int)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || dcache->count_y <= 0) {
+         ctx->set_error(ctx,400,"failed to parse ycount value %s for sqlite cache %s", cur_node->txt,cache->name);
+         return;
+      }
+   }
    if ((cur_node = ezxml_child(node,"hitstats")) != NULL) {
+      const char *attr;
       if(!strcasecmp(cur_node->txt,"true")) {
          dcache->hitstats = 1;
       }
+      if((attr = ezxml_attr(cur_node,"batch")) != NULL) {
+         char *endptr;
+         dcache->hitstats_batch = (int)strtol(attr,&endptr,10);
+         if(*endptr != 0 || dcache->hitstats_batch < 1) {
+            ctx->set_error(ctx,400,"sqlite cache \"%s\": failed to parse hitstats batch %s (expecting a positive integer)",
+                  cache->name, attr);
+            return;
+         }
+      }
+      if((attr = ezxml_attr(cur_node,"interval")) != NULL) {
+         char *endptr;
+         int interval = (int)strtol(attr,&endptr,10);
+         if(*endptr != 0 || interval < 0) {
+            ctx->set_error(ctx,400,"sqlite cache \"%s\": failed to parse hitstats interval %s (expecting a number of seconds)",
+                  cache->name, attr);
+            return;
+         }
+         dcache->hitstats_interval = apr_time_from_sec(interval);
+      }
+   }
+   if ((cur_node = ezxml_child(node,"pool_size")) != NULL) {
+      char *endptr;
+      dcache->pool_size = (int)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || dcache->pool_size < 1) {
+         ctx->set_error(ctx,400,"sqlite cache \"%s\": failed to parse pool_size %s (expecting a positive integer)",
+               cache->name, cur_node->txt);
+         return;
+      }
+   }
+   if ((cur_node = ezxml_child(node,"max_open_files")) != NULL) {
+      char *endptr;
+      dcache->max_open_files = (int)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || dcache->max_open_files < 1) {
+         ctx->set_error(ctx,400,"sqlite cache \"%s\": failed to parse max_open_files %s (expecting a positive integer)",
+               cache->name, cur_node->txt);
+         return;
+      }
+   }
+   if ((cur_node = ezxml_child(node,"wal")) != NULL) {
+      const char *checkpoint = ezxml_attr(cur_node,"checkpoint");
+      if(!strcasecmp(cur_node->txt,"true")) {
+         dcache->wal = 1;
+      }
+      if(checkpoint) {
+         char *endptr;
+         dcache->wal_checkpoint = (int)strtol(checkpoint,&endptr,10);
+         if(*endptr != 0 || dcache->wal_checkpoint < 0) {
+            ctx->set_error(ctx,400,"sqlite cache \"%s\": failed to parse wal checkpoint %s (expecting a number of pages, "
+                  "or 0 to disable automatic checkpoints)", cache->name, checkpoint);
+            return;
+         }
+      }
+   }
+   for(cur_node = ezxml_child(node,"pragma"); cur_node; cur_node = cur_node->next) {
+      const char *name = ezxml_attr(cur_node,"name");
+      if(!name || !*name || !cur_node->txt || !*cur_node->txt) {
+         ctx->set_error(ctx,400,"sqlite cache \"%s\": <pragma> requires a name attribute and a value,"
+               " eg <pragma name=\"cache_size\">-8000</pragma>", cache->name);
+         return;
+      }
+      apr_table_set(dcache->pragmas,name,cur_node->txt);
    }
    if(!dcache->dbname_template) {
       ctx->set_error(ctx,500,"sqlite cache \"%s\" is missing <dbname_template> entry",cache->name);
       return;
    }
+   dcache->dbname_tpl = mapcache_template_compile(ctx,dcache->dbname_template);
 }
    
 /**
@@ -350,9 +1048,25 @@ mapcache_cache* mapcache_cache_sqlite_create(mapcache_context *ctx) {
    cache->cache.tile_get = _mapcache_cache_sqlite_get;
    cache->cache.tile_exists = _mapcache_cache_sqlite_has_tile;
    cache->cache.tile_set = _mapcache_cache_sqlite_set;
-   //cache->cache.tile_multi_set = _mapcache_cache_sqlite_multi_set;
+   cache->cache.tile_multi_set = _mapcache_cache_sqlite_multi_set;
    cache->cache.configuration_post_config = _mapcache_cache_sqlite_configuration_post_config;
    cache->cache.configuration_parse_xml = _mapcache_cache_sqlite_configuration_parse_xml;
+   cache->empty_markers = 1;
+   cache->pool_size = 10;
+   cache->max_open_files = 64;
+   cache->wal_checkpoint = -1;
+   cache->count_x = cache->count_y = 1000;
+   cache->pragmas = apr_table_make(ctx->pool,3);
+   cache->hitstats_batch = 1000;
+   cache->hitstats_interval = apr_time_from_sec(10);
+   _sqlite_connections_create(ctx,cache);
+   if(GC_HAS_ERROR(ctx)) {
+      return NULL;
+   }
+   _sqlite_hitstats_create(ctx,cache);
+   if(GC_HAS_ERROR(ctx)) {
+      return NULL;
+   }
    cache->create_stmt.sql = apr_pstrdup(ctx->pool,
          "create table if not exists tiles(x integer, y integer, z integer, data blob, dim text, ctime datetime, atime datetime, hitcount integer default 0, primary key(x,y,z,dim))");
    cache->exists_stmt.sql = apr_pstrdup(ctx->pool,
@@ -364,10 +1078,43 @@ mapcache_cache* mapcache_cache_sqlite_create(mapcache_context *ctx) {
    cache->delete_stmt.sql = apr_pstrdup(ctx->pool,
          "delete from tiles where x=:x and y=:y and z=:z and dim=:dim");
    cache->hitstat_stmt.sql = apr_pstrdup(ctx->pool,
-         "update tiles set hitcount=hitcount+1, atime=datetime('now') where x=:x and y=:y and z=:z and dim=:dim");
+         "update tiles set hitcount=hitcount+:hits, atime=datetime(:atime,'unixepoch') where x=:x and y=:y and z=:z and dim=:dim");
    return (mapcache_cache*)cache;
 }
 
+/**
+ * \private \memberof mapcache_cache_sqlite
+ */
+static void _mapcache_cache_mbtiles_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config) {
+   ezxml_t cur_node;
+   mapcache_cache_sqlite *dcache = (mapcache_cache_sqlite*)cache;
+   _mapcache_cache_sqlite_configuration_parse_xml(ctx,node,cache,config);
+   GC_CHECK_ERROR(ctx);
+   if ((cur_node = ezxml_child(node,"dedup")) != NULL && !strcasecmp(cur_node->txt,"true")) {
+      /*
+       * the map/images layout of the mbtiles spec: identical images are stored once, and
+       * the tiles view keeps the database readable by any mbtiles client
+       */
+      dcache->create_stmt.sql = apr_pstrdup(ctx->pool,
+            "create table if not exists map (zoom_level integer, tile_column integer, tile_row integer, tile_id text);"
+            "create unique index if not exists map_index on map (zoom_level, tile_column, tile_row);"
+            "create table if not exists images (tile_data blob, tile_id text);"
+            "create unique index if not exists images_id on images (tile_id);"
+            "create view if not exists tiles as select map.zoom_level as zoom_level, map.tile_column as tile_column,"
+            " map.tile_row as tile_row, images.tile_data as tile_data from map join images on images.tile_id = map.tile_id;"
+            "create table if not exists metadata(name text, value text);");
+      dcache->exists_stmt.sql = apr_pstrdup(ctx->pool,
+            "select 1 from map where tile_column=:x and tile_row=:y and zoom_level=:z");
+      dcache->set_image_stmt.sql = apr_pstrdup(ctx->pool,
+            "insert or ignore into images(tile_id,tile_data) values (:tile_id,:data)");
+      dcache->set_stmt.sql = apr_pstrdup(ctx->pool,
+            "insert or replace into map(tile_column,tile_row,zoom_level,tile_id) values (:x,:y,:z,:tile_id)");
+      /* images that are no longer referenced are left in place */
+      dcache->delete_stmt.sql = apr_pstrdup(ctx->pool,
+            "delete from map where tile_column=:x and tile_row=:y and zoom_level=:z");
+   }
+}
+
 /**
  * \brief creates and initializes a mapcache_sqlite_cache
  */
@@ -376,6 +1123,8 @@ mapcache_cache* mapcache_cache_mbtiles_create(mapcache_context *ctx) {
    if(!cache) {
       return NULL;
    }
+   /* other mbtiles readers would not understand zero-length tiles, store the actual empty images */
+   cache->empty_markers = 0;
    cache->create_stmt.sql = apr_pstrdup(ctx->pool,
          "CREATE TABLE  IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob, primary key(tile_row, tile_column, zoom_level)); create table if not exists metadata(name text, value text);");
    cache->exists_stmt.sql = apr_pstrdup(ctx->pool,
@@ -388,6 +1137,7 @@ mapcache_cache* mapcache_cache_mbtiles_create(mapcache_context *ctx) {
          "delete from tiles where tile_column=:x and tile_row=:y and zoom_level=:z");
    cache->hitstat_stmt.sql = apr_pstrdup(ctx->pool,
          "select 1");
+   cache->cache.configuration_parse_xml = _mapcache_cache_mbtiles_configuration_parse_xml;
    return (mapcache_cache*)cache;
 }
 
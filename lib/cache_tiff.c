@@ -37,6 +37,15 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <tiffio.h>
+#include <zlib.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 
 #ifdef USE_GEOTIFF
 #include "xtiffio.h"
@@ -53,6 +62,19 @@
 #endif
 
 
+/*
+ * number of zoom levels between the tile and the full resolution image of the tiff file
+ * containing it, i.e. the overview of the file the tile is read from.
+ * files are stored every overviews+1 levels, counting down from the last level of the grid
+ */
+static int _tiff_tile_overview(mapcache_tile *tile) {
+   mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
+   if(!dcache->overviews) {
+      return 0;
+   }
+   return (tile->grid_link->grid->nlevels - 1 - tile->z) % (dcache->overviews + 1);
+}
+
 /**
  * \brief return filename for given tile
  * 
@@ -63,67 +85,38 @@
  */
 static void _mapcache_cache_tiff_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path) {
    mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
-   *path = dcache->filename_template;
+   char *dimstring = NULL;
+   int overview = _tiff_tile_overview(tile);
+   mapcache_tile base;
+
+   if(overview) {
+      /* the file is the one containing the bottom-left tile covered by this one at full resolution */
+      base = *tile;
+      base.z += overview;
+      base.x <<= overview;
+      base.y <<= overview;
+      tile = &base;
+   }
 
-   /*
-    * generic template substitutions
-    */
-   if(strstr(*path,"{tileset}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{tileset}",
-            tile->tileset->name);
-   if(strstr(*path,"{grid}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{grid}",
-            tile->grid_link->grid->name);
-   if(tile->dimensions && strstr(*path,"{dim}")) {
-      char *dimstring="";
+   if(tile->dimensions && dcache->filename_tpl->has_dim) {
       const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
       int i = elts->nelts;
+      dimstring = "";
       while(i--) {
          apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
          const char *dimval = mapcache_util_str_sanitize(ctx->pool,entry->val,"/.",'#');
          dimstring = apr_pstrcat(ctx->pool,dimstring,"#",dimval,NULL);
       }
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{dim}", dimstring);
    }
-   
-   
-   while(strstr(*path,"{z}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{z}",
-            apr_psprintf(ctx->pool,"%d",tile->z));
-   /*
-    * x and y replacing, when the tiff files are numbered with an increasing
-    * x,y scheme (adjacent tiffs have x-x'=1 or y-y'=1
-    */
-   while(strstr(*path,"{div_x}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{div_x}",
-            apr_psprintf(ctx->pool,"%d",tile->x/dcache->count_x));
-   while(strstr(*path,"{div_y}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{div_y}",
-            apr_psprintf(ctx->pool,"%d",tile->y/dcache->count_y));
-   while(strstr(*path,"{inv_div_y}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_div_y}",
-            apr_psprintf(ctx->pool,"%d",(tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1)/dcache->count_y));
-   while(strstr(*path,"{inv_div_x}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_div_x}",
-            apr_psprintf(ctx->pool,"%d",(tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1)/dcache->count_x));
-   
+
    /*
-    * x and y replacing, when the tiff files are numbered with the index
-    * of their bottom-left tile
-    * adjacent tiffs have x-x'=count_x or y-y'=count_y
+    * {div_x} and {div_y} are replaced by the index of the tiff file when they are
+    * numbered with an increasing x,y scheme (adjacent tiffs have x-x'=1 or y-y'=1).
+    * {x} and {y} are replaced by the index of the bottom-left tile of the tiff file
+    * (adjacent tiffs have x-x'=count_x or y-y'=count_y)
     */
-   while(strstr(*path,"{x}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{x}",
-            apr_psprintf(ctx->pool,"%d",tile->x/dcache->count_x*dcache->count_x));
-   while(strstr(*path,"{y}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{y}",
-            apr_psprintf(ctx->pool,"%d",tile->y/dcache->count_y*dcache->count_y));
-   while(strstr(*path,"{inv_y}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_y}",
-            apr_psprintf(ctx->pool,"%d",(tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1)/dcache->count_y*dcache->count_y));
-   while(strstr(*path,"{inv_x}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_x}",
-            apr_psprintf(ctx->pool,"%d",(tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1)/dcache->count_x*dcache->count_y));
+   *path = mapcache_template_render(ctx, dcache->filename_tpl, tile, dimstring,
+         dcache->count_x, dcache->count_y);
    if(!*path) {
       ctx->set_error(ctx,500, "failed to allocate tile key");
    }
@@ -151,10 +144,11 @@ static void check_tiff_format(mapcache_context *ctx, mapcache_tile *tile, TIFF *
       return;
    }
    
-   /* check we have jpeg compression */
+   /* check we have jpeg or deflate compression */
    rv = TIFFGetField( hTIFF, TIFFTAG_COMPRESSION, &compression );
-   if(rv == 1 && compression != COMPRESSION_JPEG) {
-      ctx->set_error(ctx,500,"TIFF file \"%s\" is not jpeg compressed",
+   if(rv == 1 && compression != COMPRESSION_JPEG &&
+         compression != COMPRESSION_ADOBE_DEFLATE && compression != COMPRESSION_DEFLATE) {
+      ctx->set_error(ctx,500,"TIFF file \"%s\" is neither jpeg nor deflate compressed",
             filename);
       return;
    }
@@ -167,11 +161,11 @@ static void check_tiff_format(mapcache_context *ctx, mapcache_tile *tile, TIFF *
       return;
    }
    
-   /* is this test needed once we now we have JPEG ? */
    rv = TIFFGetField( hTIFF, TIFFTAG_PHOTOMETRIC, &photometric );
-   if(rv == 1 && (photometric != PHOTOMETRIC_RGB && photometric != PHOTOMETRIC_YCBCR)) {
-      ctx->set_error(ctx,500,"TIFF file \"%s\" is not RGB: %d",
-            filename);
+   if(rv == 1 && (photometric != PHOTOMETRIC_RGB && photometric != PHOTOMETRIC_YCBCR &&
+            photometric != PHOTOMETRIC_MINISBLACK)) {
+      ctx->set_error(ctx,500,"TIFF file \"%s\" is not RGB or grayscale: %d",
+            filename, photometric);
       return;
    }
    
@@ -188,7 +182,7 @@ static void check_tiff_format(mapcache_context *ctx, mapcache_tile *tile, TIFF *
     * - the number of tiles in each direction in the tiff must match what has been
     *   configured for the cache
     */
-   level = tile->grid_link->grid->levels[tile->z];
+   level = tile->grid_link->grid->levels[tile->z + _tiff_tile_overview(tile)];
    ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
    ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
    if( tilewidth != tile->grid_link->grid->tile_sx ||
@@ -210,329 +204,805 @@ static void check_tiff_format(mapcache_context *ctx, mapcache_tile *tile, TIFF *
 }
 #endif
 
-static int _mapcache_cache_tiff_has_tile(mapcache_context *ctx, mapcache_tile *tile) {
+/*
+ * an image of a tiff file: the full resolution one, or one of its overviews
+ */
+typedef struct {
+   uint32 width, height;
+   uint32 tilewidth, tileheight;
+   uint32 ntiles;
+   toff_t *offsets; /* offset of the data of each tile, 0 if the tile is missing */
+   toff_t *sizes; /* size of the data of each tile */
+   uint16 compression;
+   uint16 photometric;
+   uint16 predictor;
+   uint16 samples; /* samples per pixel */
+   uint16 bits; /* bits per sample */
+   uint16 alpha; /* type of the extra sample, if any */
+   unsigned char *jpegtables; /* jpeg header common to all tiles */
+   uint32 jpegtables_size;
+} _tiff_directory;
+
+/*
+ * the parsed header of a tiff file: what is needed to locate and read any of its tiles
+ * without going through libtiff again.
+ *
+ * headers are kept in a bounded per-process LRU list, along with an open descriptor on the
+ * file. an entry is valid as long as the file's mtime, size and inode are unchanged. entries
+ * are reference counted, an entry evicted while a request is reading through it is
+ * freed by the last request releasing it.
+ */
+typedef struct _tiff_header _tiff_header;
+struct _tiff_header {
    char *filename;
-   TIFF *hTIFF;
-   mapcache_cache_tiff *dcache;
-   _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-   dcache = (mapcache_cache_tiff*)tile->tileset->cache;
-   if(GC_HAS_ERROR(ctx)) {
-      return MAPCACHE_FALSE;
+   apr_time_t mtime;
+   apr_off_t size;
+   apr_ino_t inode;
+   int ndirs;
+   _tiff_directory *dirs; /* the full resolution image, then the overviews from largest to smallest */
+#ifndef _WIN32
+   int fd;
+#endif
+   int refcount;
+   int cached; /* the entry is referenced by the LRU list */
+   _tiff_header *prev, *next;
+};
+
+typedef struct {
+   apr_pool_t *pool; /* holds the entries hash */
+   apr_hash_t *entries;
+   _tiff_header *head, *tail; /* most and least recently used */
+   int count;
+#if APR_HAS_THREADS
+   apr_thread_mutex_t *mutex;
+#endif
+} _tiff_header_cache;
+
+static void _tiff_directories_free(_tiff_directory *dirs, int ndirs) {
+   int i;
+   for(i=0;i<ndirs;i++) {
+      free(dirs[i].offsets);
+      free(dirs[i].sizes);
+      free(dirs[i].jpegtables);
    }
-   hTIFF = MyTIFFOpen(filename,"r");
-
-   if(hTIFF) {
-      do { 
-         uint32 nSubType = 0;
-         int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-         int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
-         
-         mapcache_grid_level *level;
-         int ntilesx;
-         int ntilesy;
-         toff_t  *offsets=NULL, *sizes=NULL;
-
-         if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
-            nSubType = 0;
-
-         /* skip overviews and masks */
-         if( (nSubType & FILETYPE_REDUCEDIMAGE) ||
-               (nSubType & FILETYPE_MASK) )
-            continue;
+   free(dirs);
+}
+
+static void _tiff_header_free(_tiff_header *hdr) {
+#ifndef _WIN32
+   if(hdr->fd >= 0)
+      close(hdr->fd);
+#endif
+   free(hdr->filename);
+   _tiff_directories_free(hdr->dirs, hdr->ndirs);
+   free(hdr);
+}
+
+/* unlink the entry from the LRU list. must be called with the mutex held */
+static void _tiff_header_unlink(_tiff_header_cache *hc, _tiff_header *hdr) {
+   if(hdr->prev) hdr->prev->next = hdr->next; else hc->head = hdr->next;
+   if(hdr->next) hdr->next->prev = hdr->prev; else hc->tail = hdr->prev;
+   hdr->prev = hdr->next = NULL;
+   apr_hash_set(hc->entries, hdr->filename, APR_HASH_KEY_STRING, NULL);
+   hc->count--;
+   hdr->cached = 0;
+}
+
+static apr_status_t _tiff_header_cache_cleanup(void *data) {
+   _tiff_header_cache *hc = (_tiff_header_cache*)data;
+   while(hc->head) {
+      _tiff_header *hdr = hc->head;
+      _tiff_header_unlink(hc,hdr);
+      if(!hdr->refcount)
+         _tiff_header_free(hdr);
+   }
+   apr_pool_destroy(hc->pool);
+   return APR_SUCCESS;
+}
+
+static void _tiff_header_cache_create(mapcache_context *ctx, mapcache_cache_tiff *cache) {
+   _tiff_header_cache *hc = apr_pcalloc(ctx->pool, sizeof(_tiff_header_cache));
+   apr_status_t rv;
+   char errmsg[120];
+   /* the hash grows as request threads add entries, so it can't live in the shared configuration pool */
+   if((rv = apr_pool_create(&hc->pool, NULL)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create tiff header cache pool: %s", apr_strerror(rv,errmsg,120));
+      return;
+   }
+   apr_pool_cleanup_register(ctx->pool, hc, _tiff_header_cache_cleanup, apr_pool_cleanup_null);
+   hc->entries = apr_hash_make(hc->pool);
+#if APR_HAS_THREADS
+   if(apr_thread_mutex_create(&hc->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create tiff header cache mutex");
+      return;
+   }
+#endif
+   cache->headers = hc;
+}
 
+/**
+ * \brief parse the current directory of a tiff file
+ */
+static int _tiff_directory_read(mapcache_context *ctx, TIFF *hTIFF, const char *filename, _tiff_directory *dir) {
+   toff_t *offsets=NULL, *sizes=NULL;
+   uint32 jpegtable_size = 0;
+   unsigned char* jpegtable_ptr = NULL;
+   uint16 extra_count = 0;
+   uint16 *extra_types = NULL;
 
+   if(!TIFFIsTiled(hTIFF)) {
+      ctx->set_error(ctx,500,"TIFF file \"%s\" is not tiled", filename);
+      return MAPCACHE_FAILURE;
+   }
+   TIFFGetField( hTIFF, TIFFTAG_IMAGEWIDTH, &dir->width );
+   TIFFGetField( hTIFF, TIFFTAG_IMAGELENGTH, &dir->height );
+   TIFFGetField( hTIFF, TIFFTAG_TILEWIDTH, &dir->tilewidth );
+   TIFFGetField( hTIFF, TIFFTAG_TILELENGTH, &dir->tileheight );
+   TIFFGetFieldDefaulted( hTIFF, TIFFTAG_COMPRESSION, &dir->compression );
+   TIFFGetFieldDefaulted( hTIFF, TIFFTAG_SAMPLESPERPIXEL, &dir->samples );
+   TIFFGetFieldDefaulted( hTIFF, TIFFTAG_BITSPERSAMPLE, &dir->bits );
+   /* only defined for the codecs supporting a predictor */
+   dir->predictor = PREDICTOR_NONE;
+   if(dir->compression == COMPRESSION_ADOBE_DEFLATE || dir->compression == COMPRESSION_DEFLATE) {
+      TIFFGetFieldDefaulted( hTIFF, TIFFTAG_PREDICTOR, &dir->predictor );
+   }
+   if(TIFFGetField( hTIFF, TIFFTAG_PHOTOMETRIC, &dir->photometric ) != 1) {
+      dir->photometric = (dir->samples >= 3)?PHOTOMETRIC_RGB:PHOTOMETRIC_MINISBLACK;
+   }
+   if(TIFFGetField( hTIFF, TIFFTAG_EXTRASAMPLES, &extra_count, &extra_types ) == 1 && extra_count > 0) {
+      dir->alpha = extra_types[0];
+   }
+
+   /* get the offset of the compressed data from the start of the file for each tile */
+   if(TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets ) != 1) {
+      ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile offsets", filename);
+      return MAPCACHE_FAILURE;
+   }
+   /* get the size of the compressed data for each tile */
+   if(TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes ) != 1) {
+      ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile sizes", filename);
+      return MAPCACHE_FAILURE;
+   }
+   dir->ntiles = TIFFNumberOfTiles(hTIFF);
+   dir->offsets = malloc(dir->ntiles * sizeof(toff_t));
+   dir->sizes = malloc(dir->ntiles * sizeof(toff_t));
+   memcpy(dir->offsets, offsets, dir->ntiles * sizeof(toff_t));
+   memcpy(dir->sizes, sizes, dir->ntiles * sizeof(toff_t));
+   /* the jpeg header common to all tiles, checked for when a tile is read */
+   if(dir->compression == COMPRESSION_JPEG &&
+         TIFFGetField( hTIFF, TIFFTAG_JPEGTABLES, &jpegtable_size, &jpegtable_ptr ) == 1 &&
+         jpegtable_ptr && jpegtable_size) {
+      dir->jpegtables = malloc(jpegtable_size);
+      memcpy(dir->jpegtables, jpegtable_ptr, jpegtable_size);
+      dir->jpegtables_size = jpegtable_size;
+   }
+   return MAPCACHE_SUCCESS;
+}
+
+/* sort overviews from the largest to the smallest */
+static int _tiff_directory_cmp(const void *a, const void *b) {
+   const _tiff_directory *da = (const _tiff_directory*)a;
+   const _tiff_directory *db = (const _tiff_directory*)b;
+   return (da->width < db->width) - (da->width > db->width);
+}
+
+/**
+ * \brief parse the header of the given tiff file
+ *
+ * the overviews of the file are only read if the cache is configured to use them
+ * \returns NULL if the file could not be opened as a tiff, which is treated as a cache miss
+ */
+static _tiff_header* _tiff_header_read(mapcache_context *ctx, mapcache_tile *tile, const char *filename, apr_finfo_t *finfo) {
+   mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
+   _tiff_header *hdr;
+   _tiff_directory *dirs = NULL;
+   int ndirs = 0, full = -1;
+   TIFF *hTIFF = MyTIFFOpen(filename,"r");
+   /* 
+    * we currrently have no way of knowing if the opening failed because the tif
+    * file does not exist (which is not an error condition, as it only signals
+    * that the requested tile does not exist in the cache), or if an other error
+    * that should be signaled occured (access denied, not a tiff file, etc...)
+    *
+    * we ignore this case here and hope that further parts of the code will be
+    * able to detect what's happening more precisely
+    */
+   if(!hTIFF) {
+      return NULL;
+   }
+   do {
+      uint32 nSubType = 0;
+      if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
+         nSubType = 0;
+
+      /* skip masks */
+      if( nSubType & FILETYPE_MASK )
+         continue;
+
+      if( !(nSubType & FILETYPE_REDUCEDIMAGE) ) {
+         /* only the first full resolution image is used */
+         if(full >= 0)
+            continue;
 #ifdef DEBUG
          check_tiff_format(ctx,tile,hTIFF,filename);
          if(GC_HAS_ERROR(ctx)) {
-            MyTIFFClose(hTIFF);
-            return MAPCACHE_FALSE;
+            goto error;
          }
 #endif
-	 level = tile->grid_link->grid->levels[tile->z];
-         ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
-         ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
-         
-         /* x offset of the tile along a row */
-         tiff_offx = tile->x % ntilesx;
-
-         /* 
-          * y offset of the requested row. we inverse it as the rows are ordered
-          * from top to bottom, whereas the tile y is bottom to top
-          */
-         tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-         tiff_off = tiff_offy * ntilesx + tiff_offx;
-         
-         TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets );
-         TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes );
-         MyTIFFClose(hTIFF);
-         if( offsets[tiff_off] > 0 && sizes[tiff_off] > 0 ) {
-            return MAPCACHE_TRUE;
-         } else {
-            return MAPCACHE_FALSE;
+         full = ndirs;
+      } else if(!dcache->overviews) {
+         continue;
+      }
+      dirs = realloc(dirs, (ndirs+1) * sizeof(_tiff_directory));
+      memset(&dirs[ndirs], 0, sizeof(_tiff_directory));
+      ndirs++;
+      if(_tiff_directory_read(ctx, hTIFF, filename, &dirs[ndirs-1]) != MAPCACHE_SUCCESS) {
+         goto error;
+      }
+   } while( TIFFReadDirectory( hTIFF ) );
+   MyTIFFClose(hTIFF);
+
+   if(full < 0) {
+      /* 
+       * should not happen?
+       * finished looping through directories and didn't find anything suitable.
+       * does the file only contain overviews?
+       */
+      _tiff_directories_free(dirs, ndirs);
+      return NULL;
+   }
+   if(full > 0) {
+      _tiff_directory tmp = dirs[0];
+      dirs[0] = dirs[full];
+      dirs[full] = tmp;
+   }
+   qsort(dirs + 1, ndirs - 1, sizeof(_tiff_directory), _tiff_directory_cmp);
+
+   hdr = calloc(1,sizeof(_tiff_header));
+   hdr->filename = strdup(filename);
+   hdr->dirs = dirs;
+   hdr->ndirs = ndirs;
+   hdr->mtime = finfo->mtime;
+   hdr->size = finfo->size;
+   hdr->inode = finfo->inode;
+#ifndef _WIN32
+   hdr->fd = open(filename, O_RDONLY);
+   if(hdr->fd < 0) {
+      ctx->set_error(ctx,500,"failed to open tiff file \"%s\": %s", filename, strerror(errno));
+      _tiff_header_free(hdr);
+      return NULL;
+   }
+#endif
+   return hdr;
+
+error:
+   MyTIFFClose(hTIFF);
+   _tiff_directories_free(dirs, ndirs);
+   return NULL;
+}
+
+/**
+ * \brief return the header of the tiff file, from the cache if it is still valid
+ *
+ * the returned header must be handed back with _tiff_header_release()
+ * \returns NULL if the file doesn't exist or can't be read as a tiff
+ */
+static _tiff_header* _tiff_header_acquire(mapcache_context *ctx, mapcache_tile *tile, const char *filename) {
+   mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
+   _tiff_header_cache *hc = (_tiff_header_cache*)dcache->headers;
+   _tiff_header *hdr, *cached;
+   apr_finfo_t finfo;
+
+   if(apr_stat(&finfo, filename, APR_FINFO_MTIME|APR_FINFO_SIZE|APR_FINFO_INODE, ctx->pool) != APR_SUCCESS) {
+      return NULL;
+   }
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(hc->mutex);
+#endif
+   hdr = apr_hash_get(hc->entries, filename, APR_HASH_KEY_STRING);
+   if(hdr) {
+      if(hdr->mtime == finfo.mtime && hdr->size == finfo.size && hdr->inode == finfo.inode) {
+         /* move to the front of the list */
+         if(hdr->prev) {
+            hdr->prev->next = hdr->next;
+            if(hdr->next) hdr->next->prev = hdr->prev; else hc->tail = hdr->prev;
+            hdr->prev = NULL;
+            hdr->next = hc->head;
+            hc->head->prev = hdr;
+            hc->head = hdr;
          }
-      } while( TIFFReadDirectory( hTIFF ) );
-      return MAPCACHE_FALSE; /* TIFF only contains overviews ? */
+         hdr->refcount++;
+#if APR_HAS_THREADS
+         apr_thread_mutex_unlock(hc->mutex);
+#endif
+         return hdr;
+      }
+      /* the file has been modified since it was parsed */
+      _tiff_header_unlink(hc,hdr);
+      if(!hdr->refcount)
+         _tiff_header_free(hdr);
    }
-   else
-      return MAPCACHE_FALSE;
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(hc->mutex);
+#endif
+
+   /* parse the file without holding the lock, this is the expensive part */
+   hdr = _tiff_header_read(ctx, tile, filename, &finfo);
+   if(!hdr) {
+      return NULL;
+   }
+   hdr->refcount = 1;
+   if(dcache->header_cache_size <= 0) {
+      return hdr;
+   }
+
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(hc->mutex);
+#endif
+   cached = apr_hash_get(hc->entries, filename, APR_HASH_KEY_STRING);
+   if(cached) {
+      /* another thread parsed the same file in the meantime */
+      _tiff_header_unlink(hc,cached);
+      if(!cached->refcount)
+         _tiff_header_free(cached);
+   }
+   hdr->next = hc->head;
+   if(hc->head) hc->head->prev = hdr; else hc->tail = hdr;
+   hc->head = hdr;
+   apr_hash_set(hc->entries, hdr->filename, APR_HASH_KEY_STRING, hdr);
+   hdr->cached = 1;
+   hc->count++;
+   while(hc->count > dcache->header_cache_size) {
+      _tiff_header *lru = hc->tail;
+      _tiff_header_unlink(hc,lru);
+      if(!lru->refcount)
+         _tiff_header_free(lru);
+   }
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(hc->mutex);
+#endif
+   return hdr;
 }
 
-static void _mapcache_cache_tiff_delete(mapcache_context *ctx, mapcache_tile *tile) {
-   ctx->set_error(ctx,500,"TIFF cache tile deleting not implemented");
+static void _tiff_header_release(mapcache_tile *tile, _tiff_header *hdr) {
+   mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
+   _tiff_header_cache *hc = (_tiff_header_cache*)dcache->headers;
+   int release;
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(hc->mutex);
+#endif
+   release = (--hdr->refcount == 0 && !hdr->cached);
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(hc->mutex);
+#endif
+   if(release)
+      _tiff_header_free(hdr);
 }
 
+/*
+ * index of the tile inside the list of tiles of the given overview of the tiff file
+ * \returns -1 if the overview tiles are not aligned with the grid at this level
+ */
+static int _tiff_tile_index(mapcache_tile *tile, int overview) {
+   mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
+   int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
+   int scale = 1 << overview;
+   /* 
+    * compute the width and height of the full tiff file. This
+    * is not simply the tile size times the number of tiles per
+    * file for lower zoom levels
+    */
+   mapcache_grid_level *level = tile->grid_link->grid->levels[tile->z + overview];
+   int ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
+   int ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
+   if(ntilesx % scale || ntilesy % scale) {
+      return -1;
+   }
+
+   /* x offset of the tile along a row */
+   tiff_offx = ((tile->x * scale) % ntilesx) / scale;
+
+   /* 
+    * y offset of the requested row. we inverse it as the rows are ordered
+    * from top to bottom, whereas the tile y is bottom to top
+    */
+   tiff_offy = (ntilesy - ((tile->y * scale) % ntilesy)) / scale - 1;
+   return tiff_offy * (ntilesx / scale) + tiff_offx;
+}
 
 /**
- * \brief get file content of given tile
- * 
- * fills the mapcache_tile::data of the given tile with content stored in the file
- * \private \memberof mapcache_cache_tiff
- * \sa mapcache_cache::tile_get()
+ * \brief find the image of the tiff file holding the tile, and the index of the tile in it
+ * \returns NULL if the tile is missing from the file
  */
-static int _mapcache_cache_tiff_get(mapcache_context *ctx, mapcache_tile *tile) {
+static _tiff_directory* _tiff_tile_locate(mapcache_context *ctx, mapcache_tile *tile, _tiff_header *hdr, int *tiff_off) {
+   int overview = _tiff_tile_overview(tile);
+   _tiff_directory *dir;
+   if(overview >= hdr->ndirs) {
+      /* the file has no overview for this level */
+      return NULL;
+   }
+   dir = &hdr->dirs[overview];
+   if(overview && (dir->tilewidth != tile->grid_link->grid->tile_sx ||
+            dir->tileheight != tile->grid_link->grid->tile_sy ||
+            dir->width != (hdr->dirs[0].width + (1 << overview) - 1) >> overview)) {
+      ctx->set_error(ctx,500,"TIFF file \"%s\" overview %d does not match level %d of grid %s",
+            hdr->filename, overview, tile->z, tile->grid_link->grid->name);
+      return NULL;
+   }
+   /* 
+    * the tile data exists for the given tiff_off if both offsets and size
+    * are not zero for that index.
+    * if not, the tiff file is sparse and is missing the requested tile
+    */
+   *tiff_off = _tiff_tile_index(tile, overview);
+   if(*tiff_off < 0 || *tiff_off >= dir->ntiles || dir->offsets[*tiff_off] == 0 || dir->sizes[*tiff_off] == 0) {
+      return NULL;
+   }
+   return dir;
+}
+
+static int _mapcache_cache_tiff_has_tile(mapcache_context *ctx, mapcache_tile *tile) {
    char *filename;
-   TIFF *hTIFF = NULL;
-   int rv;
-   mapcache_cache_tiff *dcache;
+   _tiff_header *hdr;
+   int tiff_off, ret;
    _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-   dcache = (mapcache_cache_tiff*)tile->tileset->cache;
    if(GC_HAS_ERROR(ctx)) {
       return MAPCACHE_FALSE;
    }
-#ifdef DEBUG
-   ctx->log(ctx,MAPCACHE_DEBUG,"tile (%d,%d,%d) => filename %s)",
-         tile->x,tile->y,tile->z,filename);
+   hdr = _tiff_header_acquire(ctx, tile, filename);
+   if(!hdr) {
+      return MAPCACHE_FALSE;
+   }
+   ret = _tiff_tile_locate(ctx, tile, hdr, &tiff_off)?MAPCACHE_TRUE:MAPCACHE_FALSE;
+   _tiff_header_release(tile, hdr);
+   return ret;
+}
+
+static void _mapcache_cache_tiff_delete(mapcache_context *ctx, mapcache_tile *tile) {
+   ctx->set_error(ctx,500,"TIFF cache tile deleting not implemented");
+}
+
+/*
+ * read len bytes at offset off of the tiff file
+ */
+static apr_size_t _tiff_read(mapcache_context *ctx, _tiff_header *hdr, void *buf, apr_size_t len, apr_off_t off) {
+#ifndef _WIN32
+   apr_size_t total = 0;
+   while(total < len) {
+      ssize_t bytes = pread(hdr->fd, (char*)buf + total, len - total, off + total);
+      if(bytes < 0 && errno == EINTR) continue;
+      if(bytes <= 0) break;
+      total += bytes;
+   }
+   return total;
+#else
+   apr_file_t *f;
+   apr_size_t bytes = len;
+   if(apr_file_open(&f, hdr->filename, APR_FOPEN_READ|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool) != APR_SUCCESS) {
+      return 0;
+   }
+   apr_file_seek(f,APR_SET,&off);
+   apr_file_read_full(f,buf,len,&bytes);
+   apr_file_close(f);
+   return bytes;
 #endif
-   
-   hTIFF = MyTIFFOpen(filename,"r");
+}
+
+
+/**
+ * \brief read a jpeg tile, prepending the jpeg tables shared by the tiles of the image
+ */
+static int _tiff_get_jpeg(mapcache_context *ctx, mapcache_tile *tile, _tiff_header *hdr, _tiff_directory *dir, int tiff_off) {
+   apr_size_t bytes;
+   char *bufptr;
+   if(!dir->jpegtables) {
+      /* there is no common jpeg header in the tiff tags */
+      ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" jpeg table", hdr->filename);
+      return MAPCACHE_FAILURE;
+   }
+
+   /* create a memory buffer to contain the jpeg data */
+   tile->encoded_data = mapcache_buffer_create((dir->jpegtables_size+dir->sizes[tiff_off]-4),ctx->pool);
 
    /* 
-    * we currrently have no way of knowing if the opening failed because the tif
-    * file does not exist (which is not an error condition, as it only signals
-    * that the requested tile does not exist in the cache), or if an other error
-    * that should be signaled occured (access denied, not a tiff file, etc...)
-    *
-    * we ignore this case here and hope that further parts of the code will be
-    * able to detect what's happening more precisely
+    * copy the jpeg header to the beginning of the memory buffer,
+    * omitting the last 2 bytes
     */
+   memcpy(tile->encoded_data->buf,dir->jpegtables,(dir->jpegtables_size-2));
 
-   if(hTIFF) {
-      do { 
-         uint32 nSubType = 0;
-         int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-         int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
-         
-         mapcache_grid_level *level;
-         int ntilesx;
-         int ntilesy;
-         toff_t  *offsets=NULL, *sizes=NULL;
-         
-         if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
-            nSubType = 0;
-
-         /* skip overviews */
-         if( nSubType & FILETYPE_REDUCEDIMAGE )
-            continue;
+   /* advance the data pointer to after the header data */
+   bufptr = tile->encoded_data->buf + (dir->jpegtables_size-2);
 
+   /*
+    * copy the jpeg body at the end of the memory buffer, skipping its first
+    * two bytes to account for the two bytes we omitted in the previous step
+    */
+   bytes = _tiff_read(ctx, hdr, bufptr, dir->sizes[tiff_off]-2, dir->offsets[tiff_off]+2);
 
-#ifdef DEBUG
-         check_tiff_format(ctx,tile,hTIFF,filename);
-         if(GC_HAS_ERROR(ctx)) {
-            MyTIFFClose(hTIFF);
-            return MAPCACHE_FAILURE;
-         }
-#endif
-         /* 
-          * compute the width and height of the full tiff file. This
-          * is not simply the tile size times the number of tiles per
-          * file for lower zoom levels
-          */
-	 level = tile->grid_link->grid->levels[tile->z];
-         ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
-         ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
-         
-         /* x offset of the tile along a row */
-         tiff_offx = tile->x % ntilesx;
-
-         /* 
-          * y offset of the requested row. we inverse it as the rows are ordered
-          * from top to bottom, whereas the tile y is bottom to top
-          */
-         tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-         tiff_off = tiff_offy * ntilesx + tiff_offx;
-         
-         /* get the offset of the jpeg data from the start of the file for each tile */
-         rv = TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets );
-         if( rv != 1 ) {
-            ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile offsets",
-                  filename);
-            MyTIFFClose(hTIFF);
-            return MAPCACHE_FAILURE;
-         }
+   /* check we have correctly read the requested number of bytes */
+   if(bytes != dir->sizes[tiff_off]-2) {
+      ctx->set_error(ctx,500,"failed to read jpeg body in \"%s\".\
+            (read %d of %d bytes)", hdr->filename,(int)bytes,(int)(dir->sizes[tiff_off]-2));
+      return MAPCACHE_FAILURE;
+   }
 
-         /* get the size of the jpeg data for each tile */
-         rv = TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes );
-         if( rv != 1 ) {
-            ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile sizes",
-                  filename);
-            MyTIFFClose(hTIFF);
-            return MAPCACHE_FAILURE;
-         }
+   tile->encoded_data->size = (dir->jpegtables_size+dir->sizes[tiff_off]-4);
+   return MAPCACHE_SUCCESS;
+}
 
-         /* 
-          * the tile data exists for the given tiff_off if both offsets and size
-          * are not zero for that index.
-          * if not, the tiff file is sparse and is missing the requested tile
-          */
-         if( offsets[tiff_off] > 0 && sizes[tiff_off] > 0 ) {
-            apr_file_t *f;
-            apr_finfo_t finfo;
-            apr_status_t ret;
-            
-            /* read the jpeg header (common to all tiles) */
-            uint32 jpegtable_size = 0;
-            unsigned char* jpegtable_ptr;
-            rv = TIFFGetField( hTIFF, TIFFTAG_JPEGTABLES, &jpegtable_size, &jpegtable_ptr );
-            if( rv != 1 || !jpegtable_ptr || !jpegtable_size) {
-               /* there is no common jpeg header in the tiff tags */
-               ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" jpeg table",
-                     filename);
-               MyTIFFClose(hTIFF);
-               return MAPCACHE_FAILURE;
-            }
+static void _png_put_uint32(unsigned char *p, uint32 v) {
+   p[0] = (v >> 24) & 0xff;
+   p[1] = (v >> 16) & 0xff;
+   p[2] = (v >> 8) & 0xff;
+   p[3] = v & 0xff;
+}
 
-            /* 
-             * open the tiff file directly to access the jpeg image data with the given
-             * offset
-             */
-            if((ret=apr_file_open(&f, filename, 
-                        APR_FOPEN_READ|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,APR_OS_DEFAULT,
-                        ctx->pool)) == APR_SUCCESS) {
-               char *bufptr;
-	       apr_off_t off;
-	       apr_size_t bytes;
-               ret = apr_file_info_get(&finfo, APR_FINFO_MTIME, f);
-               if(ret == APR_SUCCESS) {
-                  /* 
-                   * extract the file modification time. this isn't guaranteed to be the
-                   * modification time of the actual tile, but it's the best we can do
-                   */
-                  tile->mtime = finfo.mtime;
-               }           
-
-               /* create a memory buffer to contain the jpeg data */
-               tile->encoded_data = mapcache_buffer_create((jpegtable_size+sizes[tiff_off]-4),ctx->pool);
-
-               /* 
-                * copy the jpeg header to the beginning of the memory buffer,
-                * omitting the last 2 bytes
-                */
-               memcpy(tile->encoded_data->buf,jpegtable_ptr,(jpegtable_size-2));
-
-               /* advance the data pointer to after the header data */
-               bufptr = tile->encoded_data->buf + (jpegtable_size-2);
-
-               
-               /* go to the specified offset in the tiff file, plus 2 bytes */
-               off = offsets[tiff_off]+2;
-               apr_file_seek(f,APR_SET,&off);
-
-               /*
-                * copy the jpeg body at the end of the memory buffer, accounting
-                * for the two bytes we omitted in the previous step
-                */
-               bytes = sizes[tiff_off]-2;
-               apr_file_read(f,bufptr,&bytes);
-
-               /* check we have correctly read the requested number of bytes */
-               if(bytes !=  sizes[tiff_off]-2) {
-                  ctx->set_error(ctx,500,"failed to read jpeg body in \"%s\".\
-                        (read %d of %d bytes)", filename,bytes,sizes[tiff_off]-2);
-                  MyTIFFClose(hTIFF);
-                  return MAPCACHE_FAILURE;
-               }
-
-               tile->encoded_data->size = (jpegtable_size+sizes[tiff_off]-4);
-
-               /* finalize and cleanup */
-               apr_file_close(f);
-               MyTIFFClose(hTIFF);
-               return MAPCACHE_SUCCESS;
-            } else {
-               /* shouldn't usually happen. we managed to open the file with TIFFOpen,
-                * but apr_file_open failed to do so.
-                * nothing much to do except bail out.
-                */
-               ctx->set_error(ctx,500,"apr_file_open failed on already open tiff file \"%s\", giving up .... ",
-                     filename);
-               MyTIFFClose(hTIFF);
-               return MAPCACHE_FAILURE;
-            }
-         } else {
-            /* sparse tiff file without the requested tile */
-            MyTIFFClose(hTIFF);
-            return MAPCACHE_CACHE_MISS;
+/*
+ * append a png chunk, with its length and crc, to the buffer
+ */
+static void _png_chunk(mapcache_buffer *png, const char *type, unsigned char *data, uint32 len) {
+   unsigned char word[4];
+   uLong crc = crc32(0L, Z_NULL, 0);
+   crc = crc32(crc, (const Bytef*)type, 4);
+   if(len)
+      crc = crc32(crc, data, len);
+   _png_put_uint32(word, len);
+   mapcache_buffer_append(png, 4, word);
+   mapcache_buffer_append(png, 4, (void*)type);
+   if(len)
+      mapcache_buffer_append(png, len, data);
+   _png_put_uint32(word, (uint32)crc);
+   mapcache_buffer_append(png, 4, word);
+}
+
+/**
+ * \brief wrap a deflate compressed tiff tile into a png image
+ *
+ * the samples are inflated straight into png scanlines and compressed again, without going
+ * through a mapcache_image: they are stored as they are, and horizontal differencing is
+ * exactly the png "sub" filter. only premultiplied alpha requires the pixels to be modified.
+ */
+static mapcache_buffer* _tiff_deflate_to_png(mapcache_context *ctx, _tiff_header *hdr, _tiff_directory *dir,
+      unsigned char *data, apr_size_t size) {
+   static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+   static const unsigned char color_types[5] = {0, 0, 4, 2, 6}; /* indexed by the number of samples */
+   apr_size_t rowbytes = dir->tilewidth * dir->samples;
+   apr_size_t rowsize = rowbytes + 1;
+   unsigned char *rows, *zdata, ihdr[13];
+   uLongf zsize;
+   z_stream zs;
+   unsigned char filter = (dir->predictor == PREDICTOR_HORIZONTAL)?1:0;
+   uint32 r;
+   int rv;
+   mapcache_buffer *png;
+
+   if(dir->bits != 8 || dir->samples < 1 || dir->samples > 4 ||
+         dir->photometric != ((dir->samples >= 3)?PHOTOMETRIC_RGB:PHOTOMETRIC_MINISBLACK) ||
+         (dir->predictor != PREDICTOR_NONE && dir->predictor != PREDICTOR_HORIZONTAL)) {
+      ctx->set_error(ctx,500,"TIFF file \"%s\" has unsupported deflate tiles (%d samples of %d bits, photometric %d, predictor %d)",
+            hdr->filename, dir->samples, dir->bits, dir->photometric, dir->predictor);
+      return NULL;
+   }
+
+   rows = apr_palloc(ctx->pool, rowsize * dir->tileheight);
+   memset(&zs, 0, sizeof(z_stream));
+   zs.next_in = data;
+   zs.avail_in = size;
+   if(inflateInit(&zs) != Z_OK) {
+      ctx->set_error(ctx,500,"failed to initialize zlib stream");
+      return NULL;
+   }
+   for(r=0;r<dir->tileheight;r++) {
+      zs.next_out = rows + r*rowsize + 1;
+      zs.avail_out = rowbytes;
+      rv = inflate(&zs, Z_NO_FLUSH);
+      if(zs.avail_out || (rv != Z_OK && rv != Z_STREAM_END)) {
+         break;
+      }
+   }
+   inflateEnd(&zs);
+   if(r != dir->tileheight) {
+      ctx->set_error(ctx,500,"failed to inflate tile data of TIFF file \"%s\"", hdr->filename);
+      return NULL;
+   }
+
+   if(dir->alpha == EXTRASAMPLE_ASSOCALPHA && (dir->samples == 2 || dir->samples == 4)) {
+      /* png alpha is not premultiplied */
+      int n = dir->samples;
+      for(r=0;r<dir->tileheight;r++) {
+         unsigned char *row = rows + r*rowsize + 1;
+         apr_size_t c;
+         if(filter) {
+            for(c=n;c<rowbytes;c++)
+               row[c] += row[c-n];
+         }
+         for(c=0;c<rowbytes;c+=n) {
+            unsigned int a = row[c+n-1];
+            int s;
+            if(a == 0 || a == 255) continue;
+            for(s=0;s<n-1;s++)
+               row[c+s] = MAPCACHE_MIN(255, (row[c+s] * 255 + a/2) / a);
          }
-      } /* loop through the tiff directories if there are multiple ones */
-      while( TIFFReadDirectory( hTIFF ) );
+      }
+      filter = 0;
+   }
+   for(r=0;r<dir->tileheight;r++) {
+      rows[r*rowsize] = filter;
+   }
 
-      /* 
-       * should not happen?
-       * finished looping through directories and didn't find anything suitable.
-       * does the file only contain overviews?
-       */
-      MyTIFFClose(hTIFF);
-      return MAPCACHE_CACHE_MISS;
+   zsize = compressBound(rowsize * dir->tileheight);
+   zdata = apr_palloc(ctx->pool, zsize);
+   if(compress2(zdata, &zsize, rows, rowsize * dir->tileheight, Z_BEST_SPEED) != Z_OK) {
+      ctx->set_error(ctx,500,"failed to compress png tile data");
+      return NULL;
    }
-   /* failed to open tiff file */
-   return MAPCACHE_CACHE_MISS;
+
+   _png_put_uint32(ihdr, dir->tilewidth);
+   _png_put_uint32(ihdr + 4, dir->tileheight);
+   ihdr[8] = 8; /* bit depth */
+   ihdr[9] = color_types[dir->samples];
+   ihdr[10] = 0; /* deflate */
+   ihdr[11] = 0; /* adaptive filtering */
+   ihdr[12] = 0; /* no interlace */
+   png = mapcache_buffer_create(zsize + 64, ctx->pool);
+   mapcache_buffer_append(png, 8, (void*)signature);
+   _png_chunk(png, "IHDR", ihdr, 13);
+   _png_chunk(png, "IDAT", zdata, zsize);
+   _png_chunk(png, "IEND", NULL, 0);
+   return png;
 }
 
 /**
- * \brief write tile data to tiff
+ * \brief get file content of given tile
  * 
- * writes the content of mapcache_tile::data to tiff.
- * \returns MAPCACHE_FAILURE if there is no data to write, or if the tile isn't locked
- * \returns MAPCACHE_SUCCESS if the tile has been successfully written to tiff
+ * fills the mapcache_tile::data of the given tile with content stored in the file
  * \private \memberof mapcache_cache_tiff
- * \sa mapcache_cache::tile_set()
+ * \sa mapcache_cache::tile_get()
  */
-static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile) {
-#ifdef USE_TIFF_WRITE
+static int _mapcache_cache_tiff_get(mapcache_context *ctx, mapcache_tile *tile) {
    char *filename;
-   TIFF *hTIFF = NULL;
-   int rv;
-   int create;
-   char errmsg[120];
-   mapcache_cache_tiff *dcache;
-   mapcache_image_format_jpeg *format;
-   char *hackptr1,*hackptr2;
-   int tilew;
-   int tileh;
-   unsigned char *rgb;
-   int r,c;
-   apr_finfo_t finfo;
-   mapcache_grid_level *level;
-   int ntilesx;
-   int ntilesy;
-   int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-   int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
-
+   _tiff_header *hdr;
+   _tiff_directory *dir;
+   int tiff_off;
+   int ret;
    _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-   dcache = (mapcache_cache_tiff*)tile->tileset->cache;
-   format = (mapcache_image_format_jpeg*) dcache->format;
    if(GC_HAS_ERROR(ctx)) {
-      return;
+      return MAPCACHE_FAILURE;
    }
 #ifdef DEBUG
-   ctx->log(ctx,MAPCACHE_DEBUG,"tile write (%d,%d,%d) => filename %s)",
+   ctx->log(ctx,MAPCACHE_DEBUG,"tile (%d,%d,%d) => filename %s)",
          tile->x,tile->y,tile->z,filename);
 #endif
+   
+   hdr = _tiff_header_acquire(ctx, tile, filename);
+   if(!hdr) {
+      return GC_HAS_ERROR(ctx)?MAPCACHE_FAILURE:MAPCACHE_CACHE_MISS;
+   }
+   dir = _tiff_tile_locate(ctx, tile, hdr, &tiff_off);
+   if(!dir) {
+      _tiff_header_release(tile, hdr);
+      return GC_HAS_ERROR(ctx)?MAPCACHE_FAILURE:MAPCACHE_CACHE_MISS;
+   }
 
-   /*
-    * create the directory where the tiff file will be stored
+   /* 
+    * extract the file modification time. this isn't guaranteed to be the
+    * modification time of the actual tile, but it's the best we can do
     */
+   tile->mtime = hdr->mtime;
+
+   switch(dir->compression) {
+      case COMPRESSION_JPEG:
+         ret = _tiff_get_jpeg(ctx, tile, hdr, dir, tiff_off);
+         break;
+      case COMPRESSION_ADOBE_DEFLATE:
+      case COMPRESSION_DEFLATE:
+         {
+            apr_size_t size = dir->sizes[tiff_off];
+            unsigned char *data = apr_palloc(ctx->pool, size);
+            if(_tiff_read(ctx, hdr, data, size, dir->offsets[tiff_off]) != size) {
+               ctx->set_error(ctx,500,"failed to read tile data in \"%s\"", filename);
+               ret = MAPCACHE_FAILURE;
+               break;
+            }
+            tile->encoded_data = _tiff_deflate_to_png(ctx, hdr, dir, data, size);
+            ret = GC_HAS_ERROR(ctx)?MAPCACHE_FAILURE:MAPCACHE_SUCCESS;
+         }
+         break;
+      default:
+         ctx->set_error(ctx,500,"TIFF file \"%s\" uses unsupported compression %d", filename, dir->compression);
+         ret = MAPCACHE_FAILURE;
+   }
+   _tiff_header_release(tile, hdr);
+   return ret;
+}
+
+#ifdef USE_TIFF_WRITE
+/*
+ * a tile to be written, as the two parts of its jpeg stream:
+ * - tables: SOI, the quantization and huffman tables, EOI. this is what the TIFFTAG_JPEGTABLES
+ *   tag holds, shared by all the tiles of the file
+ * - body: SOI, the frame header and the scan(s). application and comment segments are dropped
+ */
+struct tiff_tile_jpeg {
+   mapcache_tile *tile;
+   mapcache_buffer *tables;
+   mapcache_buffer *body;
+};
+
+/**
+ * \brief split the jpeg stream of a tile into its tables and the rest of its segments
+ */
+static void _tiff_jpeg_split(mapcache_context *ctx, mapcache_buffer *jpeg, struct tiff_tile_jpeg *tj) {
+   unsigned char *buf = (unsigned char*)jpeg->buf;
+   size_t pos = 2;
+   unsigned char marker[2] = {0xFF, 0xD8};
+   tj->tables = mapcache_buffer_create(1000, ctx->pool);
+   tj->body = mapcache_buffer_create(jpeg->size, ctx->pool);
+   if(jpeg->size < 4 || buf[0] != 0xFF || buf[1] != 0xD8) {
+      ctx->set_error(ctx,500,"tiff cache: tile data is not a jpeg image");
+      return;
+   }
+   mapcache_buffer_append(tj->tables, 2, marker);
+   mapcache_buffer_append(tj->body, 2, marker);
+   while(pos + 4 <= jpeg->size) {
+      size_t seglen;
+      unsigned char m;
+      if(buf[pos] != 0xFF) break;
+      m = buf[pos+1];
+      if(m == 0xFF) {
+         /* fill byte */
+         pos++;
+         continue;
+      }
+      if(m == 0xDA) {
+         /* start of scan: the rest of the stream is entropy coded data */
+         mapcache_buffer_append(tj->body, jpeg->size - pos, buf + pos);
+         marker[1] = 0xD9;
+         mapcache_buffer_append(tj->tables, 2, marker);
+         return;
+      }
+      seglen = 2 + ((buf[pos+2] << 8) | buf[pos+3]);
+      if(pos + seglen > jpeg->size) break;
+      if(m == 0xDB || m == 0xC4) {
+         /* quantization and huffman tables */
+         mapcache_buffer_append(tj->tables, seglen, buf + pos);
+      } else if(!((m >= 0xE0 && m <= 0xEF) || m == 0xFE)) {
+         mapcache_buffer_append(tj->body, seglen, buf + pos);
+      }
+      pos += seglen;
+   }
+   ctx->set_error(ctx,500,"tiff cache: failed to parse jpeg tile data");
+}
+
+/**
+ * \brief encode the tile with the jpeg format of the cache, and split the result
+ */
+static void _tiff_tile_jpeg(mapcache_context *ctx, mapcache_tile *tile, struct tiff_tile_jpeg *tj) {
+   mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
+   mapcache_image_format *format = (mapcache_image_format*)dcache->format;
+   mapcache_buffer *jpeg;
+   tj->tile = tile;
+   if(tile->encoded_data && tile->tileset->format == format) {
+      /* the tile is already encoded the way the tiff stores it */
+      jpeg = tile->encoded_data;
+   } else {
+      if(!tile->raw_image) {
+         tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
+         GC_CHECK_ERROR(ctx);
+      }
+      jpeg = format->write(ctx, tile->raw_image, format);
+      GC_CHECK_ERROR(ctx);
+   }
+   _tiff_jpeg_split(ctx, jpeg, tj);
+}
 
+/*
+ * create the directory where the tiff file will be stored
+ */
+static void _tiff_make_dirs(mapcache_context *ctx, char *filename) {
+   char *hackptr1,*hackptr2;
+   char errmsg[120];
+   apr_status_t rv;
    /* find the location of the last '/' in the string */
    hackptr2 = hackptr1 = filename;
    while(*hackptr1) {
@@ -549,38 +1019,138 @@ static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
         */
        if(!APR_STATUS_IS_EEXIST(rv)) {
           ctx->set_error(ctx, 500, "failed to create directory %s: %s",filename, apr_strerror(rv,errmsg,120));
-          return;
        }
    }
    *hackptr2 = '/';
-   
-   tilew = tile->grid_link->grid->tile_sx;
-   tileh = tile->grid_link->grid->tile_sy;
-   
-   if(!tile->raw_image) {
-      tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
-      GC_CHECK_ERROR(ctx);
+}
+
+/**
+ * \brief populate the tags of a newly created tiff file, sized to hold the tiles of the given one
+ */
+static void _tiff_setup_new_file(mapcache_context *ctx, TIFF *hTIFF, mapcache_tile *tile, mapcache_buffer *tables) {
+   mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
+   int tilew = tile->grid_link->grid->tile_sx;
+   int tileh = tile->grid_link->grid->tile_sy;
+   /* 
+    * compute the width and height of the full tiff file. This
+    * is not simply the tile size times the number of tiles per
+    * file for lower zoom levels
+    */
+   mapcache_grid_level *level = tile->grid_link->grid->levels[tile->z];
+   int ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
+   int ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
+#ifdef USE_GEOTIFF
+   double	adfPixelScale[3], adfTiePoints[6], bbox[4];
+   GTIF *gtif;
+   int x,y;
+#endif
+
+   TIFFSetField( hTIFF, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT );
+   TIFFSetField( hTIFF, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG );
+   TIFFSetField( hTIFF, TIFFTAG_BITSPERSAMPLE, 8 );
+   TIFFSetField( hTIFF, TIFFTAG_COMPRESSION, COMPRESSION_JPEG );
+   TIFFSetField( hTIFF, TIFFTAG_TILEWIDTH, tilew );
+   TIFFSetField( hTIFF, TIFFTAG_TILELENGTH, tileh );
+   TIFFSetField( hTIFF, TIFFTAG_IMAGEWIDTH, ntilesx * tilew );
+   TIFFSetField( hTIFF, TIFFTAG_IMAGELENGTH, ntilesy * tileh );
+   TIFFSetField( hTIFF, TIFFTAG_SAMPLESPERPIXEL,3 );
+   /* the colorspace and subsampling libjpeg uses by default for each photometric */
+   if(dcache->format->photometric == MAPCACHE_PHOTOMETRIC_RGB) {
+      TIFFSetField( hTIFF, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+   } else {
+      TIFFSetField( hTIFF, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_YCBCR);
+      TIFFSetField( hTIFF, TIFFTAG_YCBCRSUBSAMPLING, 2, 2);
    }
+   /* the tiles are written as abbreviated jpeg streams sharing these tables */
+   TIFFSetField( hTIFF, TIFFTAG_JPEGTABLES, (uint32)tables->size, tables->buf);
 
-   /* remap xrgb to rgb */
-   rgb = (unsigned char*)malloc(tilew*tileh*3);
-   for(r=0;r<tile->raw_image->h;r++) {
-      unsigned char *imptr = tile->raw_image->data + r * tile->raw_image->stride;
-      unsigned char *rgbptr = rgb + r * tilew * 3;
-      for(c=0;c<tile->raw_image->w;c++) {
-         rgbptr[0] = imptr[2];
-         rgbptr[1] = imptr[1];
-         rgbptr[2] = imptr[0];
-         rgbptr += 3;
-         imptr += 4;
+#ifdef USE_GEOTIFF
+   gtif = GTIFNew(hTIFF);
+   if(gtif) {
+
+      GTIFKeySet(gtif, GTRasterTypeGeoKey, TYPE_SHORT, 1,
+            RasterPixelIsArea);
+
+      GTIFKeySet( gtif, GeographicTypeGeoKey, TYPE_SHORT, 1, 
+            0 );
+      GTIFKeySet( gtif, GeogGeodeticDatumGeoKey, TYPE_SHORT,
+            1, 0 );
+      GTIFKeySet( gtif, GeogEllipsoidGeoKey, TYPE_SHORT, 1, 
+            0 );
+      GTIFKeySet( gtif, GeogSemiMajorAxisGeoKey, TYPE_DOUBLE, 1,
+            0.0 );
+      GTIFKeySet( gtif, GeogSemiMinorAxisGeoKey, TYPE_DOUBLE, 1,
+            0.0 );
+      switch(tile->grid_link->grid->unit) {
+         case MAPCACHE_UNIT_FEET:
+            GTIFKeySet( gtif, ProjLinearUnitsGeoKey, TYPE_SHORT, 1, 
+                  Linear_Foot );
+            break;
+         case MAPCACHE_UNIT_METERS:
+            GTIFKeySet( gtif, ProjLinearUnitsGeoKey, TYPE_SHORT, 1, 
+                  Linear_Meter );
+            break;
+         case MAPCACHE_UNIT_DEGREES:
+            GTIFKeySet(gtif, GeogAngularUnitsGeoKey, TYPE_SHORT, 0, 
+                  Angular_Degree );
+            break;
+         default:
+            break;
       }
+
+      GTIFWriteKeys(gtif);
+      GTIFFree(gtif);
+
+      adfPixelScale[0] = adfPixelScale[1] = level->resolution;
+      adfPixelScale[2] = 0.0;
+      TIFFSetField( hTIFF, TIFFTAG_GEOPIXELSCALE, 3, adfPixelScale );
+
+
+      /* top left tile x,y */
+      x = (tile->x / dcache->count_x)*(dcache->count_x); 
+      y = (tile->y / dcache->count_y)*(dcache->count_y) + ntilesy - 1; 
+
+      mapcache_grid_get_extent(ctx, tile->grid_link->grid,
+            x,y,tile->z,bbox); 
+      adfTiePoints[0] = 0.0;
+      adfTiePoints[1] = 0.0;
+      adfTiePoints[2] = 0.0;
+      adfTiePoints[3] = bbox[0];
+      adfTiePoints[4] = bbox[3];
+      adfTiePoints[5] = 0.0;
+      TIFFSetField( hTIFF, TIFFTAG_GEOTIEPOINTS, 6, adfTiePoints );
    }
+#endif
+}
+
+/**
+ * \brief write tiles into a single tiff file, creating it if needed
+ *
+ * the jpeg data is written as-is, without going through libtiff's codec. a tile
+ * whose tables differ from the ones of the file is stored with its own tables,
+ * which override the shared ones when the tile is decoded.
+ */
+static void _tiff_write_tiles(mapcache_context *ctx, char *filename, struct tiff_tile_jpeg *tjs, int ntiles) {
+   TIFF *hTIFF = NULL;
+   int rv, i;
+   int create;
+   apr_finfo_t finfo;
+   void *lock;
+   uint32 jpegtable_size = 0;
+   unsigned char* jpegtable_ptr = NULL;
+
+#ifdef DEBUG
+   ctx->log(ctx,MAPCACHE_DEBUG,"writing %d tiles to tiff file %s", ntiles, filename);
+#endif
+   _tiff_make_dirs(ctx, filename);
+   GC_CHECK_ERROR(ctx);
 
    /*
     * aquire a lock on the tiff file. 
     */
-
-   while(mapcache_lock_or_wait_for_resource(ctx,filename) == MAPCACHE_FALSE);
+   while(mapcache_lock_or_wait_for_resource(ctx,filename,&lock) == MAPCACHE_FALSE) {
+      GC_CHECK_ERROR(ctx);
+   }
    
    /* check if the tiff file exists already */
    rv = apr_stat(&finfo,filename,0,ctx->pool);
@@ -596,122 +1166,36 @@ static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
       goto close_tiff;
    }
 
-
-   /* 
-    * compute the width and height of the full tiff file. This
-    * is not simply the tile size times the number of tiles per
-    * file for lower zoom levels
-    */
-   level = tile->grid_link->grid->levels[tile->z];
-   ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
-   ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
-   if(create) {
-#ifdef USE_GEOTIFF
-      double	adfPixelScale[3], adfTiePoints[6], bbox[4];
-      GTIF *gtif;
-      int x,y;
-#endif
-      /* populate the TIFF tags if we are creating the file */
-
-      TIFFSetField( hTIFF, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT );
-      TIFFSetField( hTIFF, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG );
-      TIFFSetField( hTIFF, TIFFTAG_BITSPERSAMPLE, 8 );
-      TIFFSetField( hTIFF, TIFFTAG_COMPRESSION, COMPRESSION_JPEG );
-      TIFFSetField( hTIFF, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
-      TIFFSetField( hTIFF, TIFFTAG_TILEWIDTH, tilew );
-      TIFFSetField( hTIFF, TIFFTAG_TILELENGTH, tileh );
-      TIFFSetField( hTIFF, TIFFTAG_IMAGEWIDTH, ntilesx * tilew );
-      TIFFSetField( hTIFF, TIFFTAG_IMAGELENGTH, ntilesy * tileh );
-      TIFFSetField( hTIFF, TIFFTAG_SAMPLESPERPIXEL,3 );
-
-#ifdef USE_GEOTIFF
-      gtif = GTIFNew(hTIFF);
-      if(gtif) {
-
-         GTIFKeySet(gtif, GTRasterTypeGeoKey, TYPE_SHORT, 1,
-               RasterPixelIsArea);
-
-         GTIFKeySet( gtif, GeographicTypeGeoKey, TYPE_SHORT, 1, 
-               0 );
-         GTIFKeySet( gtif, GeogGeodeticDatumGeoKey, TYPE_SHORT,
-               1, 0 );
-         GTIFKeySet( gtif, GeogEllipsoidGeoKey, TYPE_SHORT, 1, 
-               0 );
-         GTIFKeySet( gtif, GeogSemiMajorAxisGeoKey, TYPE_DOUBLE, 1,
-               0.0 );
-         GTIFKeySet( gtif, GeogSemiMinorAxisGeoKey, TYPE_DOUBLE, 1,
-               0.0 );
-         switch(tile->grid_link->grid->unit) {
-            case MAPCACHE_UNIT_FEET:
-               GTIFKeySet( gtif, ProjLinearUnitsGeoKey, TYPE_SHORT, 1, 
-                     Linear_Foot );
-               break;
-            case MAPCACHE_UNIT_METERS:
-               GTIFKeySet( gtif, ProjLinearUnitsGeoKey, TYPE_SHORT, 1, 
-                     Linear_Meter );
-               break;
-            case MAPCACHE_UNIT_DEGREES:
-               GTIFKeySet(gtif, GeogAngularUnitsGeoKey, TYPE_SHORT, 0, 
-                     Angular_Degree );
-               break;
-            default:
-               break;
-         }
-
-         GTIFWriteKeys(gtif);
-         GTIFFree(gtif);
-
-         adfPixelScale[0] = adfPixelScale[1] = level->resolution;
-         adfPixelScale[2] = 0.0;
-         TIFFSetField( hTIFF, TIFFTAG_GEOPIXELSCALE, 3, adfPixelScale );
-
-
-         /* top left tile x,y */
-         x = (tile->x / dcache->count_x)*(dcache->count_x); 
-         y = (tile->y / dcache->count_y)*(dcache->count_y) + ntilesy - 1; 
-
-         mapcache_grid_get_extent(ctx, tile->grid_link->grid,
-               x,y,tile->z,bbox); 
-         adfTiePoints[0] = 0.0;
-         adfTiePoints[1] = 0.0;
-         adfTiePoints[2] = 0.0;
-         adfTiePoints[3] = bbox[0];
-         adfTiePoints[4] = bbox[3];
-         adfTiePoints[5] = 0.0;
-         TIFFSetField( hTIFF, TIFFTAG_GEOTIEPOINTS, 6, adfTiePoints );
+   if(!create) {
+      uint16 compression;
+      if(TIFFGetField( hTIFF, TIFFTAG_COMPRESSION, &compression ) == 1 && compression != COMPRESSION_JPEG) {
+         ctx->set_error(ctx,500,"cannot write jpeg tiles to tiff file %s, it uses compression %d",filename,compression);
+         goto close_tiff;
       }
-
-#endif
    }
-   TIFFSetField(hTIFF, TIFFTAG_JPEGQUALITY, format->quality); 
-   if(format->photometric == MAPCACHE_PHOTOMETRIC_RGB) {
-      TIFFSetField( hTIFF, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-   } else {
-      TIFFSetField( hTIFF, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_YCBCR);
-   }
-   TIFFSetField( hTIFF, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
-
-   /* x offset of the tile along a row */
-   tiff_offx = tile->x % ntilesx;
-
-   /* 
-    * y offset of the requested row. we inverse it as the rows are ordered
-    * from top to bottom, whereas the tile y is bottom to top
-    */
-   tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-   tiff_off = tiff_offy * ntilesx + tiff_offx;
-
 
-   rv = TIFFWriteEncodedTile(hTIFF, tiff_off, rgb, tilew*tileh*3);
-   free(rgb);
-   if(!rv) {
-      ctx->set_error(ctx,500,"failed TIFFWriteEncodedTile to %s",filename);
-      goto close_tiff;
+   if(create) {
+      _tiff_setup_new_file(ctx, hTIFF, tjs[0].tile, tjs[0].tables);
+      jpegtable_size = tjs[0].tables->size;
+      jpegtable_ptr = (unsigned char*)tjs[0].tables->buf;
+   } else if(TIFFGetField( hTIFF, TIFFTAG_JPEGTABLES, &jpegtable_size, &jpegtable_ptr ) != 1) {
+      jpegtable_size = 0;
    }
-   rv = TIFFWriteCheck( hTIFF, 1, "cache_set()");
-   if(!rv) {
-      ctx->set_error(ctx,500,"failed TIFFWriteCheck %s",filename);
-      goto close_tiff;
+
+   for(i=0;i<ntiles;i++) {
+      struct tiff_tile_jpeg *tj = &tjs[i];
+      mapcache_buffer *data = tj->body;
+      if(tj->tables->size != jpegtable_size || memcmp(tj->tables->buf, jpegtable_ptr, jpegtable_size)) {
+         /* keep the tables of this tile inside its own stream: tables minus EOI, body minus SOI */
+         data = mapcache_buffer_create(tj->tables->size + tj->body->size, ctx->pool);
+         mapcache_buffer_append(data, tj->tables->size - 2, tj->tables->buf);
+         mapcache_buffer_append(data, tj->body->size - 2, ((char*)tj->body->buf) + 2);
+      }
+      rv = TIFFWriteRawTile(hTIFF, _tiff_tile_index(tj->tile, 0), data->buf, data->size);
+      if(rv != data->size) {
+         ctx->set_error(ctx,500,"failed TIFFWriteRawTile to %s",filename);
+         goto close_tiff;
+      }
    }
 
    if(create) {
@@ -723,13 +1207,66 @@ static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
    }
 
 close_tiff:
+   /* for an existing file, the updated tile offsets are written out when closing */
    if(hTIFF)
       MyTIFFClose(hTIFF);
-   mapcache_unlock_resource(ctx,filename);
+   mapcache_unlock_resource(ctx,filename,lock);
+}
+#endif
+
+/**
+ * \brief write the tiles of a metatile to their tiff file(s)
+ *
+ * the tiles are encoded before any lock is taken, then each tiff file is opened
+ * and locked once for all the tiles it contains
+ * \private \memberof mapcache_cache_tiff
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_tiff_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles) {
+#ifdef USE_TIFF_WRITE
+   struct tiff_tile_jpeg *tjs = apr_pcalloc(ctx->pool, ntiles*sizeof(struct tiff_tile_jpeg));
+   struct tiff_tile_jpeg *group = apr_palloc(ctx->pool, ntiles*sizeof(struct tiff_tile_jpeg));
+   char **filenames = apr_palloc(ctx->pool, ntiles*sizeof(char*));
+   char *written = apr_pcalloc(ctx->pool, ntiles*sizeof(char));
+   int i,j;
+   for(i=0;i<ntiles;i++) {
+      if(_tiff_tile_overview(&tiles[i])) {
+         ctx->set_error(ctx,500,"tiff cache %s: writing tiles to overviews is not supported",
+               tiles[i].tileset->cache->name);
+         return;
+      }
+      _mapcache_cache_tiff_tile_key(ctx, &tiles[i], &filenames[i]);
+      GC_CHECK_ERROR(ctx);
+      _tiff_tile_jpeg(ctx, &tiles[i], &tjs[i]);
+      GC_CHECK_ERROR(ctx);
+   }
+   /* a metatile may straddle several tiff files */
+   for(i=0;i<ntiles;i++) {
+      int ngroup = 0;
+      if(written[i]) continue;
+      for(j=i;j<ntiles;j++) {
+         if(!written[j] && !strcmp(filenames[i],filenames[j])) {
+            group[ngroup++] = tjs[j];
+            written[j] = 1;
+         }
+      }
+      _tiff_write_tiles(ctx, filenames[i], group, ngroup);
+      GC_CHECK_ERROR(ctx);
+   }
 #else
    ctx->set_error(ctx,500,"tiff write support disabled by default");
 #endif
+}
 
+/**
+ * \brief write tile data to tiff
+ * 
+ * writes the content of mapcache_tile::data to tiff.
+ * \private \memberof mapcache_cache_tiff
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile) {
+   _mapcache_cache_tiff_multi_set(ctx, tile, 1);
 }
 
 /**
@@ -745,6 +1282,7 @@ static void _mapcache_cache_tiff_configuration_parse_xml(mapcache_context *ctx,
    mapcache_image_format *pformat;
    if ((cur_node = ezxml_child(node,"template")) != NULL) {
       dcache->filename_template = apr_pstrdup(ctx->pool,cur_node->txt);
+      dcache->filename_tpl = mapcache_template_compile(ctx,dcache->filename_template);
    }
    xcount = ezxml_child(node,"xcount");
    if(xcount && xcount->txt && *xcount->txt) {
@@ -764,6 +1302,22 @@ static void _mapcache_cache_tiff_configuration_parse_xml(mapcache_context *ctx,
          return;
       }
    }
+   if ((cur_node = ezxml_child(node,"header_cache")) != NULL) {
+      char *endptr;
+      dcache->header_cache_size = (int)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || dcache->header_cache_size < 0) {
+         ctx->set_error(ctx,400,"failed to parse header_cache value %s for tiff cache %s", cur_node->txt,cache->name);
+         return;
+      }
+   }
+   if ((cur_node = ezxml_child(node,"overviews")) != NULL) {
+      char *endptr;
+      dcache->overviews = (int)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || dcache->overviews < 0 || dcache->overviews > 16) {
+         ctx->set_error(ctx,400,"failed to parse overviews value %s for tiff cache %s", cur_node->txt,cache->name);
+         return;
+      }
+   }
    xformat = ezxml_child(node,"format");
    if(xformat && xformat->txt && *xformat->txt) {
       format_name = xformat->txt;
@@ -800,6 +1354,11 @@ static void _mapcache_cache_tiff_configuration_post_config(mapcache_context *ctx
       ctx->set_error(ctx, 400, "tiff cache %s has invalid count (%d,%d)",dcache->count_x,dcache->count_y);
       return;
    }
+   if(dcache->count_x % (1 << dcache->overviews) || dcache->count_y % (1 << dcache->overviews)) {
+      ctx->set_error(ctx, 400, "tiff cache %s: xcount and ycount must be multiples of %d to hold %d overviews",
+            dcache->cache.name, 1 << dcache->overviews, dcache->overviews);
+      return;
+   }
 }
 
 /**
@@ -817,10 +1376,18 @@ mapcache_cache* mapcache_cache_tiff_create(mapcache_context *ctx) {
    cache->cache.tile_get = _mapcache_cache_tiff_get;
    cache->cache.tile_exists = _mapcache_cache_tiff_has_tile;
    cache->cache.tile_set = _mapcache_cache_tiff_set;
+#ifdef USE_TIFF_WRITE
+   cache->cache.tile_multi_set = _mapcache_cache_tiff_multi_set;
+#endif
    cache->cache.configuration_post_config = _mapcache_cache_tiff_configuration_post_config;
    cache->cache.configuration_parse_xml = _mapcache_cache_tiff_configuration_parse_xml;
    cache->count_x = 10;
    cache->count_y = 10;
+   cache->header_cache_size = 32;
+   _tiff_header_cache_create(ctx,cache);
+   if(GC_HAS_ERROR(ctx)) {
+      return NULL;
+   }
 #ifndef DEBUG
    TIFFSetWarningHandler(NULL);
    TIFFSetErrorHandler(NULL);
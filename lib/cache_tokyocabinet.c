@@ -31,8 +31,11 @@
 
 #include "mapcache.h"
 #include <apr_strings.h>
-#include <apr_reslist.h>
 #include <apr_file_info.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#endif
 #include <string.h>
 #include <errno.h>
 #include <time.h>
@@ -47,34 +50,219 @@
 struct tc_conn {
    TCBDB *bdb;
    int readonly;
+   int shared; /* the process-wide handle, which is not closed after use */
 };
+
+/**
+ * process-wide handle on the database, used when <keep_open> is set.
+ *
+ * tokyo cabinet refuses to open the same file twice within a process, so all the
+ * threads share a single handle. it is created with tcbdbsetmutex(), which lets
+ * readers proceed concurrently and serializes the writers.
+ *
+ * the handle holds the database file lock for as long as it is open. it is opened
+ * without waiting for the lock, and closed once it has been open for sync_interval so
+ * that its writes are synced and other processes get their turn. while another process holds the lock, the
+ * threads open the database for each operation, as when keep_open is not set.
+ */
+typedef struct {
+   TCBDB *bdb;
+   int readonly;
+   int users; /* threads currently using bdb */
+   int nlocal; /* threads currently using a database opened for a single operation */
+   int closing; /* bdb is closed once its last user releases it */
+   apr_time_t opened;
+   apr_time_t retry; /* the lock was held by another process, don't reopen before this time */
+#if APR_HAS_THREADS
+   apr_thread_mutex_t *mutex; /* protects all the above */
+   apr_thread_cond_t *closed; /* signaled when a closing handle has been closed */
+#endif
+} _tc_handle;
+
+static apr_status_t _tc_handle_close(void *data) {
+   _tc_handle *handle = (_tc_handle*)data;
+   if(handle->bdb) {
+      /* closing the database also syncs the pending writes */
+      tcbdbclose(handle->bdb);
+      tcbdbdel(handle->bdb);
+      handle->bdb = NULL;
+   }
+   return APR_SUCCESS;
+}
+
+static void _tc_handle_create(mapcache_context *ctx, mapcache_cache_tc *cache) {
+   _tc_handle *handle = apr_pcalloc(ctx->pool, sizeof(_tc_handle));
+#if APR_HAS_THREADS
+   if(apr_thread_mutex_create(&handle->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS ||
+         apr_thread_cond_create(&handle->closed, ctx->pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create tokyocabinet handle mutex");
+      return;
+   }
+#endif
+   apr_pool_cleanup_register(ctx->pool, handle, _tc_handle_close, apr_pool_cleanup_null);
+   cache->handle = handle;
+}
+
+/*
+ * open the process-wide handle without waiting for the file lock. called with the
+ * handle mutex held
+ */
+static void _tc_handle_open(mapcache_context *ctx, mapcache_cache_tc *cache, _tc_handle *handle, const char *dbfile) {
+   int ecode;
+   TCBDB *bdb = tcbdbnew();
+   tcbdbsetmutex(bdb);
+   if(tcbdbopen(bdb, dbfile, BDBOWRITER | BDBOCREAT | BDBOLCKNB)) {
+      handle->readonly = 0;
+   } else if(tcbdbecode(bdb) != TCELOCK && tcbdbopen(bdb, dbfile, BDBOREADER | BDBOLCKNB)) {
+      /* e.g. a prebuilt database on a read-only filesystem */
+      handle->readonly = 1;
+   } else {
+      ecode = tcbdbecode(bdb);
+      tcbdbdel(bdb);
+      if(ecode == TCELOCK) {
+         /* another process has the database open, use single operation opens for a while */
+         handle->retry = apr_time_now() + cache->sync_interval;
+      } else {
+         ctx->set_error(ctx,500, "tokyocabinet open error on %s: %s\n",dbfile,tcbdberrmsg(ecode));
+      }
+      return;
+   }
+   handle->bdb = bdb;
+   handle->opened = apr_time_now();
+}
+
+/*
+ * returns MAPCACHE_TRUE and fills conn if the process-wide handle can be used. the
+ * caller opens the database for this operation only otherwise
+ */
+static int _tc_get_shared_conn(mapcache_context *ctx, mapcache_cache_tc *cache, const char *dbfile,
+      struct tc_conn *conn) {
+   _tc_handle *handle = (_tc_handle*)cache->handle;
+   int shared;
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(handle->mutex);
+   while(handle->closing) {
+      apr_thread_cond_wait(handle->closed, handle->mutex);
+   }
+#endif
+   /*
+    * file locks belong to the process: the shared handle is not opened while another
+    * thread has the database open for a single operation, whose close would release it
+    */
+   if(!handle->bdb && !handle->nlocal && apr_time_now() >= handle->retry) {
+      _tc_handle_open(ctx,cache,handle,dbfile);
+   }
+   if(handle->bdb) {
+      handle->users++;
+      conn->bdb = handle->bdb;
+      conn->readonly = handle->readonly;
+      conn->shared = 1;
+      shared = MAPCACHE_TRUE;
+   } else {
+      if(!GC_HAS_ERROR(ctx)) handle->nlocal++;
+      shared = MAPCACHE_FALSE;
+   }
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(handle->mutex);
+#endif
+   return shared;
+}
+
+/*
+ * stop using the process-wide handle, and close it if it was due to be and this
+ * was its last user
+ */
+static void _tc_put_shared_conn(mapcache_context *ctx, mapcache_cache_tc *cache) {
+   _tc_handle *handle = (_tc_handle*)cache->handle;
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(handle->mutex);
+#endif
+   handle->users--;
+   if(apr_time_now() - handle->opened >= cache->sync_interval) {
+      /* the last user closes it, and thereby syncs it and releases the file lock */
+      handle->closing = 1;
+   }
+   if(handle->closing && !handle->users) {
+      if(!tcbdbclose(handle->bdb)) {
+         int ecode = tcbdbecode(handle->bdb);
+         ctx->set_error(ctx,500, "tokyocabinet close error: %s\n",tcbdberrmsg(ecode));
+      }
+      tcbdbdel(handle->bdb);
+      handle->bdb = NULL;
+      handle->closing = 0;
+#if APR_HAS_THREADS
+      apr_thread_cond_broadcast(handle->closed);
+#endif
+   }
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(handle->mutex);
+#endif
+}
+
+/* a database opened for a single operation while keep_open is set has been closed */
+static void _tc_put_local_conn(mapcache_cache_tc *cache) {
+   _tc_handle *handle = (_tc_handle*)cache->handle;
+#if APR_HAS_THREADS
+   apr_thread_mutex_lock(handle->mutex);
+#endif
+   handle->nlocal--;
+#if APR_HAS_THREADS
+   apr_thread_mutex_unlock(handle->mutex);
+#endif
+}
+
 static struct tc_conn _tc_get_conn(mapcache_context *ctx, mapcache_tile* tile, int readonly) {
    struct tc_conn conn;
+   mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+   char *dbfile = apr_pstrcat(ctx->pool, cache->basedir,"/tc.tcb",NULL);
+
+   if(cache->keep_open) {
+      if(_tc_get_shared_conn(ctx,cache,dbfile,&conn)) {
+         if(!readonly && conn.readonly) {
+            _tc_put_shared_conn(ctx,cache);
+            ctx->set_error(ctx,500, "tokyocabinet database %s is not writable",dbfile);
+         }
+         return conn;
+      }
+      if(GC_HAS_ERROR(ctx)) return conn;
+   }
+
    /* create the object */
    conn.bdb = tcbdbnew();
-   mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+   conn.shared = 0;
    
    /* open the database */
    if(!readonly) {
-      if(!tcbdbopen(conn.bdb, apr_pstrcat(ctx->pool, cache->basedir,"/tc.tcb",NULL), BDBOWRITER | BDBOCREAT)){
+      if(!tcbdbopen(conn.bdb, dbfile, BDBOWRITER | BDBOCREAT)){
          int ecode = tcbdbecode(conn.bdb);
-         ctx->set_error(ctx,500, "tokyocabinet open error on %s: %s\n",apr_pstrcat(ctx->pool, cache->basedir,"/tc.tcf",NULL),tcbdberrmsg(ecode));
+         ctx->set_error(ctx,500, "tokyocabinet open error on %s: %s\n",dbfile,tcbdberrmsg(ecode));
       }
       conn.readonly = 0;
    } else {
-      if(!tcbdbopen(conn.bdb, apr_pstrcat(ctx->pool, cache->basedir,"/tc.tcb",NULL), BDBOREADER)){
-         if(!tcbdbopen(conn.bdb, apr_pstrcat(ctx->pool, cache->basedir,"/tc.tcb",NULL), BDBOWRITER | BDBOCREAT)){
+      conn.readonly = 1;
+      if(!tcbdbopen(conn.bdb, dbfile, BDBOREADER)){
+         if(!tcbdbopen(conn.bdb, dbfile, BDBOWRITER | BDBOCREAT)){
             int ecode = tcbdbecode(conn.bdb);
-            ctx->set_error(ctx,500, "tokyocabinet open error on %s: %s\n",apr_pstrcat(ctx->pool, cache->basedir,"/tc.tcf",NULL),tcbdberrmsg(ecode));
+            ctx->set_error(ctx,500, "tokyocabinet open error on %s: %s\n",dbfile,tcbdberrmsg(ecode));
          }
          conn.readonly = 0;
       }
-      conn.readonly = 1;
+   }
+   if(GC_HAS_ERROR(ctx)) {
+      /* the callers don't release a connection that failed to open */
+      tcbdbdel(conn.bdb);
+      if(cache->keep_open) _tc_put_local_conn(cache);
    }
    return conn;
 }
 
 static void _tc_release_conn(mapcache_context *ctx, mapcache_tile *tile, struct tc_conn conn) {
+   mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+   if(conn.shared) {
+      _tc_put_shared_conn(ctx,cache);
+      return;
+   }
+
    if(!conn.readonly)
       tcbdbsync(conn.bdb);
 
@@ -83,6 +271,7 @@ static void _tc_release_conn(mapcache_context *ctx, mapcache_tile *tile, struct
       ctx->set_error(ctx,500, "tokyocabinet close error: %s\n",tcbdberrmsg(ecode));
    }
    tcbdbdel(conn.bdb);
+   if(cache->keep_open) _tc_put_local_conn(cache);
 }
 
 static int _mapcache_cache_tc_has_tile(mapcache_context *ctx, mapcache_tile *tile) {
@@ -124,11 +313,16 @@ static int _mapcache_cache_tc_get(mapcache_context *ctx, mapcache_tile *tile) {
    tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
    tile->encoded_data->buf = tcbdbget(conn.bdb, skey, strlen(skey), &size);
    if(tile->encoded_data->buf) {
-      tile->encoded_data->avail = size;
-      tile->encoded_data->size = size - sizeof(apr_time_t);
       apr_pool_cleanup_register(ctx->pool, tile->encoded_data->buf,(void*)free, apr_pool_cleanup_null);
-      tile->mtime = *((apr_time_t*)(&tile->encoded_data->buf[tile->encoded_data->size]));
-      ret = MAPCACHE_SUCCESS;
+      if(size < sizeof(apr_time_t)) {
+         ctx->set_error(ctx,500,"tokyocabinet cache returned invalid data for tile %d %d %d",tile->x,tile->y,tile->z);
+         ret = MAPCACHE_FAILURE;
+      } else {
+         tile->encoded_data->avail = size;
+         tile->encoded_data->size = size - sizeof(apr_time_t);
+         tile->mtime = *((apr_time_t*)(&tile->encoded_data->buf[tile->encoded_data->size]));
+         ret = MAPCACHE_SUCCESS;
+      }
    } else {
       ret = MAPCACHE_CACHE_MISS;
    }
@@ -136,26 +330,60 @@ static int _mapcache_cache_tc_get(mapcache_context *ctx, mapcache_tile *tile) {
    return ret;
 }
 
-static void _mapcache_cache_tc_set(mapcache_context *ctx, mapcache_tile *tile) {
-   struct tc_conn conn;
+/*
+ * store the tile data followed by its modification time. the spare room at the end of
+ * the encoded buffer is used for the timestamp when there is enough of it, the tile
+ * data itself is left untouched
+ */
+static void _tc_put(mapcache_context *ctx, struct tc_conn conn, mapcache_tile *tile, apr_time_t now) {
    mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
    char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
-   apr_time_t now = apr_time_now();
-   conn = _tc_get_conn(ctx,tile,0);
+   char *data;
+   size_t size;
    GC_CHECK_ERROR(ctx);
-   
    if(!tile->encoded_data) {
       tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
       GC_CHECK_ERROR(ctx);
    }
-   mapcache_buffer_append(tile->encoded_data,sizeof(apr_time_t),&now);
-   if(!tcbdbput(conn.bdb, skey, strlen(skey), tile->encoded_data->buf, tile->encoded_data->size)) {
+   size = tile->encoded_data->size;
+   if(!tile->nodata && tile->encoded_data->avail >= size + sizeof(apr_time_t)) {
+      data = tile->encoded_data->buf;
+   } else {
+      /* empty tiles share the tileset's buffer, it isn't written to */
+      data = apr_palloc(ctx->pool, size + sizeof(apr_time_t));
+      memcpy(data, tile->encoded_data->buf, size);
+   }
+   memcpy(&data[size], &now, sizeof(apr_time_t));
+   if(!tcbdbput(conn.bdb, skey, strlen(skey), data, size + sizeof(apr_time_t))) {
       int ecode = tcbdbecode(conn.bdb);
       ctx->set_error(ctx,500, "tokyocabinet put error: %s\n",tcbdberrmsg(ecode));
    }
+}
+
+static void _mapcache_cache_tc_set(mapcache_context *ctx, mapcache_tile *tile) {
+   struct tc_conn conn;
+   conn = _tc_get_conn(ctx,tile,0);
+   GC_CHECK_ERROR(ctx);
+   _tc_put(ctx,conn,tile,apr_time_now());
    _tc_release_conn(ctx,tile,conn);
 }
 
+/**
+ * \brief store all the tiles of a metatile with a single open of the database
+ */
+static void _mapcache_cache_tc_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles) {
+   struct tc_conn conn;
+   int i;
+   apr_time_t now = apr_time_now();
+   conn = _tc_get_conn(ctx,&tiles[0],0);
+   GC_CHECK_ERROR(ctx);
+   for(i=0;i<ntiles;i++) {
+      _tc_put(ctx,conn,&tiles[i],now);
+      if(GC_HAS_ERROR(ctx)) break;
+   }
+   _tc_release_conn(ctx,&tiles[0],conn);
+}
+
 
 static void _mapcache_cache_tc_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config) {
    ezxml_t cur_node;
@@ -164,14 +392,33 @@ static void _mapcache_cache_tc_configuration_parse_xml(mapcache_context *ctx, ez
       dcache->basedir = apr_pstrdup(ctx->pool,cur_node->txt);
    }
    if ((cur_node = ezxml_child(node,"key_template")) != NULL) {
-      dcache->key_template = apr_pstrdup(ctx->pool,cur_node->txt);
+      dcache->key_template = mapcache_template_compile(ctx,cur_node->txt);
    } else {
-      dcache->key_template = apr_pstrdup(ctx->pool,"{tileset}-{grid}-{dim}-{z}-{y}-{x}.{ext}");
+      dcache->key_template = mapcache_template_compile(ctx,"{tileset}-{grid}-{dim}-{z}-{y}-{x}.{ext}");
    }
    if(!dcache->basedir) {
       ctx->set_error(ctx,500,"tokyocabinet cache \"%s\" is missing <base> entry",cache->name);
       return;
    }
+   if ((cur_node = ezxml_child(node,"keep_open")) != NULL) {
+      if(!strcasecmp(cur_node->txt,"true")) {
+         dcache->keep_open = 1;
+      } else if(strcasecmp(cur_node->txt,"false")) {
+         ctx->set_error(ctx,400,"failed to parse keep_open \"%s\" for tokyocabinet cache \"%s\". Expecting true or false",
+               cur_node->txt,cache->name);
+         return;
+      }
+   }
+   if ((cur_node = ezxml_child(node,"sync_interval")) != NULL) {
+      char *endptr;
+      int interval = (int)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || interval < 0) {
+         ctx->set_error(ctx,400,"failed to parse sync_interval \"%s\" for tokyocabinet cache \"%s\". Expecting a positive integer",
+               cur_node->txt,cache->name);
+         return;
+      }
+      dcache->sync_interval = apr_time_from_sec(interval);
+   }
 }
    
 static void _mapcache_cache_tc_configuration_post_config(mapcache_context *ctx,
@@ -201,10 +448,16 @@ mapcache_cache* mapcache_cache_tc_create(mapcache_context *ctx) {
    cache->cache.tile_get = _mapcache_cache_tc_get;
    cache->cache.tile_exists = _mapcache_cache_tc_has_tile;
    cache->cache.tile_set = _mapcache_cache_tc_set;
+   cache->cache.tile_multi_set = _mapcache_cache_tc_multi_set;
    cache->cache.configuration_post_config = _mapcache_cache_tc_configuration_post_config;
    cache->cache.configuration_parse_xml = _mapcache_cache_tc_configuration_parse_xml;
    cache->basedir = NULL;
    cache->key_template = NULL;
+   cache->sync_interval = apr_time_from_sec(10);
+   _tc_handle_create(ctx,cache);
+   if(GC_HAS_ERROR(ctx)) {
+      return NULL;
+   }
    return (mapcache_cache*)cache;
 }
 
@@ -75,6 +75,12 @@ void mapcache_configuration_parse(mapcache_context *ctx, const char *filename, m
    }
    apr_dir_close(lockdir);
 
+   if(!config->locker) {
+      /* default to lockfiles in lockdir, polled every lock_retry_interval */
+      config->locker = mapcache_locker_disk_create(ctx);
+      GC_CHECK_ERROR(ctx);
+   }
+
    /* if we were suppplied with an onlineresource, make sure it ends with a / */
    if(NULL != (url = (char*)apr_table_get(config->metadata,"url"))) {
       char *urlend = url + strlen(url)-1;
@@ -87,6 +93,8 @@ void mapcache_configuration_parse(mapcache_context *ctx, const char *filename, m
 
 void mapcache_configuration_post_config(mapcache_context *ctx, mapcache_cfg *config) {
    apr_hash_index_t *cachei = apr_hash_first(ctx->pool,config->caches);
+   config->locker->post_config(ctx, config->locker, config);
+   GC_CHECK_ERROR(ctx);
    while(cachei) {
       mapcache_cache *cache;
       const void *key; apr_ssize_t keylen;
@@ -95,6 +103,14 @@ void mapcache_configuration_post_config(mapcache_context *ctx, mapcache_cfg *con
       GC_CHECK_ERROR(ctx);
       cachei = apr_hash_next(cachei);
    }
+#if APR_HAS_THREADS
+   config->flights = mapcache_singleflight_create(ctx);
+   GC_CHECK_ERROR(ctx);
+   if(config->threaded_fetching) {
+      config->fetch_pool = mapcache_worker_pool_create(ctx, config->fetch_threads);
+      GC_CHECK_ERROR(ctx);
+   }
+#endif
 } 
 
 
@@ -255,6 +271,13 @@ mapcache_cfg* mapcache_configuration_create(apr_pool_t *pool) {
 
    /* default retry interval is 1/100th of a second, i.e. 10000 microseconds */
    cfg->lock_retry_interval = 10000;
+   cfg->locker = NULL;
+   cfg->lock_timeout = apr_time_from_sec(120);
+
+   cfg->threaded_fetching = 0;
+   cfg->fetch_threads = 8;
+   cfg->fetch_pool = NULL;
+   cfg->flights = NULL;
 
    cfg->loglevel = MAPCACHE_WARN;
    cfg->autoreload = 0;
@@ -742,6 +742,18 @@ void parseTileset(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config) {
          tileset->format = format;
    }
 
+   if ((cur_node = ezxml_child(node,"empty_markers")) != NULL) {
+      if(!strcasecmp(cur_node->txt,"true")) {
+         tileset->empty_markers = 1;
+      } else if(strcasecmp(cur_node->txt,"false")) {
+         ctx->set_error(ctx, 400, "failed to parse empty_markers %s."
+               "(expecting true or false, "
+               "eg <empty_markers>true</empty_markers>",
+               cur_node->txt);
+         return;
+      }
+   }
+
    mapcache_tileset_configuration_check(ctx,tileset);
    GC_CHECK_ERROR(ctx);
    mapcache_configuration_add_tileset(config,tileset,name);
@@ -987,13 +999,53 @@ void mapcache_configuration_parse_xml(mapcache_context *ctx, const char *filenam
       }
    }
    
+   if((node = ezxml_child(doc,"lock_timeout")) != NULL) {
+      char *endptr;
+      int timeout = (int)strtol(node->txt,&endptr,10);
+      if(*endptr != 0 || timeout <= 0) {
+         ctx->set_error(ctx, 400, "failed to parse lock_timeout seconds \"%s\". Expecting a positive integer",
+               node->txt);
+         goto cleanup;
+      }
+      config->lock_timeout = apr_time_from_sec(timeout);
+   }
+
+   if((node = ezxml_child(doc,"locker")) != NULL) {
+      const char *type = ezxml_attr(node,"type");
+      mapcache_locker *locker = NULL;
+      if(!type || !strcmp(type,"disk")) {
+         locker = mapcache_locker_disk_create(ctx);
+      } else if(!strcmp(type,"flock")) {
+         locker = mapcache_locker_flock_create(ctx);
+      } else if(!strcmp(type,"shm")) {
+         locker = mapcache_locker_shm_create(ctx);
+      } else if(!strcmp(type,"memcache")) {
+         locker = mapcache_locker_memcache_create(ctx);
+      } else {
+         ctx->set_error(ctx, 400, "unknown locker type \"%s\" (allowed are disk, flock, shm and memcache)", type);
+      }
+      if(GC_HAS_ERROR(ctx)) goto cleanup;
+      locker->parse_xml(ctx, locker, node);
+      if(GC_HAS_ERROR(ctx)) goto cleanup;
+      config->locker = locker;
+   }
+
    if((node = ezxml_child(doc,"threaded_fetching")) != NULL) {
+      const char *max_threads;
       if(!strcasecmp(node->txt,"true")) {
          config->threaded_fetching = 1;
       } else if(strcasecmp(node->txt,"false")) {
          ctx->set_error(ctx, 400, "failed to parse threaded_fetching \"%s\". Expecting true or false",node->txt);
          return;
       }
+      if((max_threads = ezxml_attr(node,"max_threads")) != NULL) {
+         char *endptr;
+         config->fetch_threads = (int)strtol(max_threads,&endptr,10);
+         if(*endptr != 0 || config->fetch_threads < 1) {
+            ctx->set_error(ctx, 400, "failed to parse threaded_fetching max_threads \"%s\". Expecting a positive integer",max_threads);
+            return;
+         }
+      }
    }
 
    if((node = ezxml_child(doc,"log_level")) != NULL) {
@@ -30,37 +30,11 @@
 
 #include <apr_strings.h>
 #include "mapcache.h"
-#if APR_HAS_THREADS
-#include "apu_version.h"
-
-#if (APU_MAJOR_VERSION <= 1 && APU_MINOR_VERSION <= 3)
- #define USE_THREADPOOL 0
-#else
- #define USE_THREADPOOL 1
-#endif
 
-/* use a thread pool if using 1.3.12 or higher apu */
-#if !USE_THREADPOOL
-#include <apr_thread_proc.h>
-#else
-#include <apr_thread_pool.h>
-#endif
- 
-typedef struct {
-   mapcache_tile *tile;
-   mapcache_context *ctx;
-   int launch;
-} _thread_tile;
-
-static void* APR_THREAD_FUNC _thread_get_tile(apr_thread_t *thread, void *data) {
-   _thread_tile* t = (_thread_tile*)data;
-   mapcache_tileset_tile_get(t->ctx, t->tile);
-#if !USE_THREADPOOL
-   apr_thread_exit(thread, APR_SUCCESS);
-#endif
-   return NULL;
+#if APR_HAS_THREADS
+static void _mapcache_prefetch_tile(mapcache_context *ctx, void *data) {
+   mapcache_tileset_tile_get(ctx, (mapcache_tile*)data);
 }
-
 #endif
 
 
@@ -73,11 +47,48 @@ mapcache_http_response *mapcache_http_response_create(apr_pool_t *pool) {
    return response;
 }
 
-void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles) {
+/*
+ * fetch the tiles whose cache can return them in a single call. the tiles that are
+ * not handled this way (misses, or caches without multi-get support) are copied
+ * to remaining, and their number is returned
+ */
+static int _mapcache_multi_get_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles,
+      mapcache_tile **remaining) {
+   int i,j,nremaining = 0;
+   int *results = apr_palloc(ctx->pool, ntiles*sizeof(int));
+   mapcache_tile **group = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+   char *queued = apr_pcalloc(ctx->pool, ntiles*sizeof(char));
+   for(i=0;i<ntiles;i++) {
+      mapcache_cache *cache = tiles[i]->tileset->cache;
+      int ngroup = 0;
+      if(queued[i]) continue;
+      if(!cache->tile_multi_get) {
+         remaining[nremaining++] = tiles[i];
+         continue;
+      }
+      /* query all the tiles stored in this cache at once */
+      for(j=i;j<ntiles;j++) {
+         if(!queued[j] && tiles[j]->tileset->cache == cache) {
+            group[ngroup++] = tiles[j];
+            queued[j] = 1;
+         }
+      }
+      cache->tile_multi_get(ctx, group, ngroup, results);
+      if(GC_HAS_ERROR(ctx)) return 0;
+      for(j=0;j<ngroup;j++) {
+         if(results[j] == MAPCACHE_CACHE_MISS) {
+            /* will be queried again, and rendered, by the per-tile path */
+            remaining[nremaining++] = group[j];
+         } else {
+            mapcache_tileset_tile_resolve(ctx, group[j], results[j]);
+            if(GC_HAS_ERROR(ctx)) return 0;
+         }
+      }
+   }
+   return nremaining;
+}
 
-   apr_thread_t **threads;
-   apr_threadattr_t *thread_attrs;
-   int nthreads;
+static void _mapcache_fetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles) {
 #if !APR_HAS_THREADS
    int i;
    for(i=0;i<ntiles;i++) {
@@ -85,9 +96,10 @@ void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int n
       GC_CHECK_ERROR(ctx);
    }
 #else
-   int i,rv;
-   _thread_tile* thread_tiles;
-   if(ntiles==1 || ctx->config->threaded_fetching == 0) {
+   int i;
+   char *launch;
+   mapcache_worker_batch *batch;
+   if(ntiles==1 || ctx->config->threaded_fetching == 0 || !ctx->config->fetch_pool) {
    /* if threads disabled, or only fetching a single tile, don't launch a thread for the operation */
       for(i=0;i<ntiles;i++) {
          mapcache_tileset_tile_get(ctx, tiles[i]);
@@ -96,96 +108,56 @@ void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int n
       return;
    }
 
-
-   /* allocate a thread struct for each tile. Not all will be used */
-   thread_tiles = (_thread_tile*)apr_pcalloc(ctx->pool,ntiles*sizeof(_thread_tile));
-#if 1 || !USE_THREADPOOL
-   /* use multiple threads, to fetch from multiple metatiles and/or multiple tilesets */
-   apr_threadattr_create(&thread_attrs, ctx->pool);
-   threads = (apr_thread_t**)apr_pcalloc(ctx->pool, ntiles*sizeof(apr_thread_t*));
-   nthreads = 0;
+   batch = mapcache_worker_batch_create(ctx, ctx->config->fetch_pool);
+   GC_CHECK_ERROR(ctx);
+   launch = (char*)apr_pcalloc(ctx->pool,ntiles*sizeof(char));
    for(i=0;i<ntiles;i++) {
-     int j;
-      thread_tiles[i].tile = tiles[i];
-      thread_tiles[i].launch = 1;
-      j=i-1;
+      int j=i-1;
+      launch[i] = 1;
       /* 
-       * we only launch one thread per metatile as in the unseeded case the threads
-       * for a same metatile will lock while only a single thread launches the actual
+       * we only submit one job per metatile as in the unseeded case the jobs
+       * for a same metatile will lock while only a single one launches the actual
        * rendering request
        */
       while(j>=0) {
          /* check that the given metatile hasn't been rendered yet */
-         if(thread_tiles[j].launch &&
-               (thread_tiles[i].tile->tileset == thread_tiles[j].tile->tileset) &&
-               (thread_tiles[i].tile->x / thread_tiles[i].tile->tileset->metasize_x  == 
-                  thread_tiles[j].tile->x / thread_tiles[j].tile->tileset->metasize_x)&&
-               (thread_tiles[i].tile->y / thread_tiles[i].tile->tileset->metasize_y  == 
-                  thread_tiles[j].tile->y / thread_tiles[j].tile->tileset->metasize_y)) {
-            thread_tiles[i].launch = 0; /* this tile will not have a thread spawned for it */
+         if(launch[j] &&
+               (tiles[i]->tileset == tiles[j]->tileset) &&
+               (tiles[i]->x / tiles[i]->tileset->metasize_x  == 
+                  tiles[j]->x / tiles[j]->tileset->metasize_x)&&
+               (tiles[i]->y / tiles[i]->tileset->metasize_y  == 
+                  tiles[j]->y / tiles[j]->tileset->metasize_y)) {
+            launch[i] = 0; /* this tile will not have a job submitted for it */
             break;
          }
          j--;
       }
-      if(thread_tiles[i].launch)
-         thread_tiles[i].ctx = ctx->clone(ctx);
-   }
-   for(i=0;i<ntiles;i++) {
-      if(!thread_tiles[i].launch) continue; /* skip tiles that have been marked */
-      rv = apr_thread_create(&threads[i], thread_attrs, _thread_get_tile, (void*)&(thread_tiles[i]), thread_tiles[i].ctx->pool);
-      if(rv != APR_SUCCESS) {
-         ctx->set_error(ctx,500, "failed to create thread %d of %d\n",i,ntiles);
-         break;
-      }
-      nthreads++;
+      if(launch[i])
+         mapcache_worker_batch_push(ctx, batch, _mapcache_prefetch_tile, tiles[i]);
    }
 
-   /* wait for launched threads to finish */
-   for(i=0;i<ntiles;i++) {
-      if(!thread_tiles[i].launch) continue;
-      apr_thread_join(&rv, threads[i]);
-      if(rv != APR_SUCCESS) {
-         ctx->set_error(ctx,500, "thread %d of %d failed on exit\n",i,ntiles);
-      }
-      if(GC_HAS_ERROR(thread_tiles[i].ctx)) {
-         /* transfer error message from child thread to main context */
-         ctx->set_error(ctx,thread_tiles[i].ctx->get_error(thread_tiles[i].ctx),
-               thread_tiles[i].ctx->get_error_message(thread_tiles[i].ctx));
-      }
-   }
-   for(i=0;i<ntiles;i++) {
-      /* fetch the tiles that did not get a thread launched for them */
-      if(thread_tiles[i].launch) continue;
-      mapcache_tileset_tile_get(ctx, tiles[i]);
-   }
-#else
-    /* experimental version using a threadpool, disabled for stability reasons */
-   apr_thread_pool_t *thread_pool;
-   apr_thread_pool_create(&thread_pool,2,ctx->config->download_threads,ctx->pool);
-   for(i=0;i<ntiles;i++) {
-      ctx->log(ctx,MAPCACHE_DEBUG,"starting thread for tile %s",tiles[i]->tileset->name);
-      thread_tiles[i].tile = tiles[i];
-      thread_tiles[i].ctx = ctx->clone(ctx);
-      rv = apr_thread_pool_push(thread_pool,_thread_get_tile,(void*)&(thread_tiles[i]), 0,NULL);
-      if(rv != APR_SUCCESS) {
-         ctx->set_error(ctx,500, "failed to push thread %d of %d in thread pool\n",i,ntiles);
-         break;
-      }
-   }
+   /* wait for the submitted jobs to finish */
+   mapcache_worker_batch_wait(ctx, batch);
    GC_CHECK_ERROR(ctx);
-   while(apr_thread_pool_tasks_run_count(thread_pool) != ntiles || apr_thread_pool_busy_count(thread_pool)>0)
-      apr_sleep(10000);
-   apr_thread_pool_destroy(thread_pool);
+
    for(i=0;i<ntiles;i++) {
-      if(GC_HAS_ERROR(thread_tiles[i].ctx)) {
-         ctx->set_error(ctx,thread_tiles[i].ctx->get_error(thread_tiles[i].ctx),
-               thread_tiles[i].ctx->get_error_message(thread_tiles[i].ctx));
-      }
+      /* fetch the tiles that did not get a job submitted for them */
+      if(launch[i]) continue;
+      mapcache_tileset_tile_get(ctx, tiles[i]);
+      GC_CHECK_ERROR(ctx);
    }
 #endif
-   
-#endif
+}
 
+void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles) {
+   if(ntiles > 1) {
+      mapcache_tile **remaining = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+      ntiles = _mapcache_multi_get_tiles(ctx, tiles, ntiles, remaining);
+      GC_CHECK_ERROR(ctx);
+      tiles = remaining;
+   }
+   if(ntiles)
+      _mapcache_fetch_tiles(ctx, tiles, ntiles);
 }
 
 mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_request_get_tile *req_tile) {
@@ -204,7 +176,15 @@ mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_r
 #endif
    expires = 0;
    response = mapcache_http_response_create(ctx->pool);
-  
+
+   /*
+    * a single tile can be sent as-is, straight from the cache file if the
+    * front-end supports it. we need to know its mime type without looking at the data
+    */
+   if(req_tile->ntiles == 1 && req_tile->accept_file &&
+         req_tile->tiles[0]->tileset->format && req_tile->tiles[0]->tileset->format->mime_type) {
+      req_tile->tiles[0]->accept_file = 1;
+   }
 
    mapcache_prefetch_tiles(ctx,req_tile->tiles,req_tile->ntiles);
    if(GC_HAS_ERROR(ctx))
@@ -263,6 +243,9 @@ mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_r
       }
    } else {
       response->data = req_tile->tiles[0]->encoded_data;
+      if(!response->data) {
+         response->file = req_tile->tiles[0]->file;
+      }
       format = req_tile->tiles[0]->tileset->format;
    }
 
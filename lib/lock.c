@@ -27,12 +27,23 @@
  * DEALINGS IN THE SOFTWARE.
  *****************************************************************************/
 
+
 #include "mapcache.h"
 #include <apr_file_io.h>
 #include <apr_strings.h>
 #include <apr_time.h>
+#include <apr_network_io.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
 
-char* lock_filename_for_resource(mapcache_context *ctx, const char *resource) {
+char* lock_filename_for_resource(mapcache_context *ctx, const char *dir, const char *resource) {
    char *saferes = apr_pstrdup(ctx->pool,resource);
    char *safeptr = saferes;
    while(*safeptr) {
@@ -42,42 +53,359 @@ char* lock_filename_for_resource(mapcache_context *ctx, const char *resource) {
       safeptr++;
    }
    return apr_psprintf(ctx->pool,"%s/"MAPCACHE_LOCKFILE_PREFIX"%s.lck",
-         ctx->config->lockdir,saferes);
+         dir,saferes);
+}
+
+int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource, void **lock) {
+   mapcache_locker *locker = ctx->config->locker;
+   while(1) {
+      int ret = locker->lock(ctx, locker, resource, lock);
+      if(GC_HAS_ERROR(ctx) || ret == MAPCACHE_TRUE) {
+         return ret;
+      }
+#ifdef DEBUG
+      ctx->log(ctx, MAPCACHE_DEBUG, "waiting on resource lock %s", resource);
+#endif
+      if(locker->wait(ctx, locker, resource) != MAPCACHE_TRUE || GC_HAS_ERROR(ctx)) {
+         /* the owner released the lock */
+         return MAPCACHE_FALSE;
+      }
+      /* we broke a stale lock, compete again for the resource */
+   }
+}
+
+void mapcache_unlock_resource(mapcache_context *ctx, char *resource, void *lock) {
+   mapcache_locker *locker = ctx->config->locker;
+   locker->unlock(ctx, locker, resource, lock);
 }
 
-int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource) {
-   char *lockname = lock_filename_for_resource(ctx,resource);
+/*
+ * a lock acquired by the disk locker. the owner string written to the lockfile tells
+ * our lock apart from one created by somebody else after ours was broken as stale
+ */
+typedef struct {
+   char *lockname;
+   char *owner;
+} mapcache_disk_lock_handle;
+
+/*
+ * lockfiles contain "pid hostname timestamp". the timestamp, in microseconds, helps
+ * diagnosing leftover lockfiles and makes the content unique to each lock
+ */
+static char* _mapcache_locker_disk_write_owner(mapcache_context *ctx, apr_file_t *lockfile) {
+   char hostname[APRMAXHOSTLEN+1];
+   char *owner;
+   apr_size_t len;
+   if(apr_gethostname(hostname,APRMAXHOSTLEN,ctx->pool) != APR_SUCCESS) {
+      hostname[0] = '\0';
+   }
+   owner = apr_psprintf(ctx->pool,"%d %s %"APR_TIME_T_FMT"\n",(int)getpid(),hostname,apr_time_now());
+   len = strlen(owner);
+   apr_file_write(lockfile,owner,&len);
+   return owner;
+}
+
+/*
+ * check that the file contains exactly the given owner string
+ */
+static int _mapcache_locker_disk_is_owner(mapcache_context *ctx, const char *lockname, const char *owner) {
+   apr_file_t *lockfile;
+   apr_size_t ownerlen = strlen(owner);
+   apr_size_t len = ownerlen + 1;
+   char *buf = apr_palloc(ctx->pool, len);
+   if(apr_file_open(&lockfile,lockname,APR_FOPEN_READ,APR_OS_DEFAULT,ctx->pool) != APR_SUCCESS) {
+      return MAPCACHE_FALSE;
+   }
+   if(apr_file_read_full(lockfile,buf,len,&len) != APR_EOF) {
+      /* read error, or the file is longer than our owner string */
+      len = 0;
+   }
+   apr_file_close(lockfile);
+   return (len == ownerlen && !memcmp(buf,owner,ownerlen))?MAPCACHE_TRUE:MAPCACHE_FALSE;
+}
+
+/*
+ * move a lockfile back into place, unless a new lock has been created there since it
+ * was moved aside. a rename() would silently replace that new lock
+ */
+static void _mapcache_locker_disk_put_back(mapcache_context *ctx, const char *aside, const char *lockname) {
+#ifndef _WIN32
+   if(link(aside,lockname) != 0) {
+      ctx->log(ctx,MAPCACHE_WARN,"lockfile %s was recreated while %s was moved aside, dropping the latter",
+            lockname,aside);
+   }
+   unlink(aside);
+#else
+   /* contrary to posix, rename() doesn't replace an existing file on windows */
+   if(rename(aside,lockname) != 0) {
+      ctx->log(ctx,MAPCACHE_WARN,"lockfile %s was recreated while %s was moved aside, dropping the latter",
+            lockname,aside);
+      apr_file_remove(aside,ctx->pool);
+   }
+#endif
+}
+
+/*
+ * a lock is orphaned if it was created by a process of this host that does not
+ * exist anymore. we can't tell for locks created on other hosts, those will only be
+ * broken once they have expired
+ */
+static int _mapcache_locker_disk_owner_dead(mapcache_context *ctx, const char *lockname) {
+#ifndef _WIN32
+   apr_file_t *lockfile;
+   char buf[APRMAXHOSTLEN+64];
+   char hostname[APRMAXHOSTLEN+1];
+   char *pidstr,*owner_host,*last;
+   apr_size_t len = sizeof(buf)-1;
+   if(apr_file_open(&lockfile,lockname,APR_FOPEN_READ,APR_OS_DEFAULT,ctx->pool) != APR_SUCCESS) {
+      return MAPCACHE_FALSE;
+   }
+   if(apr_file_read(lockfile,buf,&len) != APR_SUCCESS) {
+      /* the owner hasn't written its details yet */
+      apr_file_close(lockfile);
+      return MAPCACHE_FALSE;
+   }
+   apr_file_close(lockfile);
+   buf[len] = '\0';
+   pidstr = apr_strtok(buf," ",&last);
+   owner_host = apr_strtok(NULL," ",&last);
+   if(!pidstr || !owner_host) {
+      return MAPCACHE_FALSE;
+   }
+   if(apr_gethostname(hostname,APRMAXHOSTLEN,ctx->pool) != APR_SUCCESS || strcmp(hostname,owner_host)) {
+      return MAPCACHE_FALSE;
+   }
+   if(kill((pid_t)atoi(pidstr),0) != 0 && errno == ESRCH) {
+      return MAPCACHE_TRUE;
+   }
+#endif
+   return MAPCACHE_FALSE;
+}
+
+/*
+ * remove a stale lockfile. another waiter may have broken the same lock and created
+ * a fresh one in the meantime, so the lockfile is first moved aside and checked to
+ * still be the one we found stale
+ */
+static int _mapcache_locker_disk_break(mapcache_context *ctx, const char *lockname, apr_finfo_t *stale) {
+   apr_finfo_t info;
+   char *aside = apr_psprintf(ctx->pool,"%s.%d.%"APR_TIME_T_FMT".stale",lockname,(int)getpid(),apr_time_now());
+   if(apr_file_rename(lockname,aside,ctx->pool) != APR_SUCCESS) {
+      /* somebody else got there first */
+      return MAPCACHE_FALSE;
+   }
+   if(apr_stat(&info,aside,APR_FINFO_MTIME|APR_FINFO_INODE,ctx->pool) == APR_SUCCESS &&
+         (info.mtime != stale->mtime || info.inode != stale->inode)) {
+      /* this is a fresh lock, put it back */
+      _mapcache_locker_disk_put_back(ctx,aside,lockname);
+      return MAPCACHE_FALSE;
+   }
+   apr_file_remove(aside,ctx->pool);
+   ctx->log(ctx,MAPCACHE_WARN,"removed stale lockfile %s",lockname);
+   return MAPCACHE_TRUE;
+}
+
+static int _mapcache_locker_disk_lock(mapcache_context *ctx, mapcache_locker *self, char *resource, void **lock) {
+   mapcache_locker_disk *locker = (mapcache_locker_disk*)self;
+   char *lockname = lock_filename_for_resource(ctx,locker->dir,resource);
    apr_file_t *lockfile;
    apr_status_t rv;
+   mapcache_disk_lock_handle *handle;
    /* create the lockfile */
    rv = apr_file_open(&lockfile,lockname,APR_WRITE|APR_CREATE|APR_EXCL|APR_XTHREAD,APR_OS_DEFAULT,ctx->pool);
 
-   /* if the file already exists, wait for it to disappear */
-   /* TODO: check the lock isn't stale (i.e. too old) */
    if( rv != APR_SUCCESS ) {
-      apr_finfo_t info;
-      rv = apr_stat(&info,lockname,0,ctx->pool);
-#ifdef DEBUG
-      if(!APR_STATUS_IS_ENOENT(rv)) {
-         ctx->log(ctx, MAPCACHE_DEBUG, "waiting on resource lock %s", resource);
+      return MAPCACHE_FALSE;
+   }
+   /* we acquired the lock. record who owns it, so that waiters can detect if we die */
+   handle = apr_palloc(ctx->pool, sizeof(mapcache_disk_lock_handle));
+   handle->lockname = lockname;
+   handle->owner = _mapcache_locker_disk_write_owner(ctx,lockfile);
+   apr_file_close(lockfile);
+   *lock = handle;
+   return MAPCACHE_TRUE;
+}
+
+static int _mapcache_locker_disk_wait(mapcache_context *ctx, mapcache_locker *self, char *resource) {
+   mapcache_locker_disk *locker = (mapcache_locker_disk*)self;
+   char *lockname = lock_filename_for_resource(ctx,locker->dir,resource);
+   apr_finfo_t info;
+   apr_time_t last_check = 0;
+   apr_status_t rv = apr_stat(&info,lockname,APR_FINFO_MTIME|APR_FINFO_INODE,ctx->pool);
+   /* wait for the lockfile to disappear */
+   while(!APR_STATUS_IS_ENOENT(rv)) {
+      apr_time_t now = apr_time_now();
+      /* check once per second that the lock isn't stale (i.e. too old, or its owner died) */
+      if(rv == APR_SUCCESS && now - last_check >= apr_time_from_sec(1)) {
+         last_check = now;
+         if(now - info.mtime > ctx->config->lock_timeout ||
+               _mapcache_locker_disk_owner_dead(ctx,lockname)) {
+            if(_mapcache_locker_disk_break(ctx,lockname,&info) == MAPCACHE_TRUE) {
+               return MAPCACHE_TRUE;
+            }
+         }
       }
-#endif
-      while(!APR_STATUS_IS_ENOENT(rv)) {
-         /* sleep for the configured number of micro-seconds (default is 1/100th of a second) */
-         apr_sleep(ctx->config->lock_retry_interval);
-         rv = apr_stat(&info,lockname,0,ctx->pool);
+      /* sleep for the configured number of micro-seconds (default is 1/100th of a second) */
+      apr_sleep(locker->retry_interval);
+      rv = apr_stat(&info,lockname,APR_FINFO_MTIME|APR_FINFO_INODE,ctx->pool);
+   }
+   return MAPCACHE_FALSE;
+}
+
+/*
+ * remove our lockfile. if we held the lock for longer than lock_timeout, a waiter may
+ * have broken it and somebody else may own the resource now: their lockfile must be
+ * left alone. the lockfile is moved aside before being removed, so that a lock
+ * created between our check and the removal isn't deleted instead of ours
+ */
+static void _mapcache_locker_disk_unlock(mapcache_context *ctx, mapcache_locker *self, char *resource, void *lock) {
+   mapcache_disk_lock_handle *handle = (mapcache_disk_lock_handle*)lock;
+   char *aside;
+   if(!_mapcache_locker_disk_is_owner(ctx,handle->lockname,handle->owner)) {
+      ctx->log(ctx,MAPCACHE_WARN,"lockfile %s was broken while we held it",handle->lockname);
+      return;
+   }
+   aside = apr_psprintf(ctx->pool,"%s.%d.%"APR_TIME_T_FMT".unlock",handle->lockname,(int)getpid(),apr_time_now());
+   if(apr_file_rename(handle->lockname,aside,ctx->pool) != APR_SUCCESS) {
+      /* broken in the meantime */
+      return;
+   }
+   if(!_mapcache_locker_disk_is_owner(ctx,aside,handle->owner)) {
+      /* the lock was broken and recreated between our check and the rename */
+      _mapcache_locker_disk_put_back(ctx,aside,handle->lockname);
+      return;
+   }
+   apr_file_remove(aside,ctx->pool);
+}
+
+static void _mapcache_locker_disk_parse_xml(mapcache_context *ctx, mapcache_locker *self, ezxml_t node) {
+   mapcache_locker_disk *locker = (mapcache_locker_disk*)self;
+   ezxml_t cur_node;
+   if((cur_node = ezxml_child(node,"directory")) != NULL) {
+      locker->dir = apr_pstrdup(ctx->pool, cur_node->txt);
+   }
+   if((cur_node = ezxml_child(node,"retry")) != NULL) {
+      char *endptr;
+      locker->retry_interval = (apr_interval_time_t)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || locker->retry_interval <= 0) {
+         ctx->set_error(ctx, 400, "failed to parse locker retry microseconds \"%s\". Expecting a positive integer",
+               cur_node->txt);
+         return;
+      }
+   }
+}
+
+static void _mapcache_locker_disk_post_config(mapcache_context *ctx, mapcache_locker *self, mapcache_cfg *cfg) {
+   mapcache_locker_disk *locker = (mapcache_locker_disk*)self;
+   if(!locker->dir) {
+      locker->dir = cfg->lockdir;
+   }
+   if(!locker->retry_interval) {
+      locker->retry_interval = cfg->lock_retry_interval;
+   }
+}
+
+mapcache_locker* mapcache_locker_disk_create(mapcache_context *ctx) {
+   mapcache_locker_disk *locker = apr_pcalloc(ctx->pool, sizeof(mapcache_locker_disk));
+   if(!locker) {
+      ctx->set_error(ctx, 500, "failed to allocate disk locker");
+      return NULL;
+   }
+   locker->locker.type = MAPCACHE_LOCKER_DISK;
+   locker->locker.lock = _mapcache_locker_disk_lock;
+   locker->locker.wait = _mapcache_locker_disk_wait;
+   locker->locker.unlock = _mapcache_locker_disk_unlock;
+   locker->locker.parse_xml = _mapcache_locker_disk_parse_xml;
+   locker->locker.post_config = _mapcache_locker_disk_post_config;
+   return (mapcache_locker*)locker;
+}
+
+#ifndef _WIN32
+/*
+ * flock() locks are attached to the open file description, so they also exclude
+ * threads of a same process (contrary to fcntl() locks), and they are released by
+ * the kernel if the owning process dies
+ */
+typedef struct {
+   int fd;
+   char *lockname;
+} mapcache_flock_handle;
+
+static int _mapcache_locker_flock_lock(mapcache_context *ctx, mapcache_locker *self, char *resource, void **lock) {
+   mapcache_locker_disk *locker = (mapcache_locker_disk*)self;
+   char *lockname = lock_filename_for_resource(ctx,locker->dir,resource);
+   while(1) {
+      struct stat fst,pst;
+      int err;
+      int fd = open(lockname, O_RDWR|O_CREAT, 0666);
+      if(fd < 0) {
+         ctx->set_error(ctx, 500, "failed to open lockfile %s: %s", lockname, strerror(errno));
+         return MAPCACHE_FALSE;
+      }
+      if(flock(fd, LOCK_EX|LOCK_NB) != 0) {
+         err = errno;
+         close(fd);
+         if(err == EWOULDBLOCK || err == EINTR) {
+            return MAPCACHE_FALSE;
+         }
+         ctx->set_error(ctx, 500, "failed to lock %s: %s", lockname, strerror(err));
+         return MAPCACHE_FALSE;
       }
+      /*
+       * the previous owner unlinks the file before releasing it: make sure the file we
+       * locked is still the one that other processes will find, otherwise retry
+       */
+      if(fstat(fd,&fst) == 0 && stat(lockname,&pst) == 0 &&
+            fst.st_ino == pst.st_ino && fst.st_dev == pst.st_dev) {
+         mapcache_flock_handle *handle = apr_palloc(ctx->pool, sizeof(mapcache_flock_handle));
+         handle->fd = fd;
+         handle->lockname = lockname;
+         *lock = handle;
+         return MAPCACHE_TRUE;
+      }
+      close(fd);
+   }
+}
+
+static int _mapcache_locker_flock_wait(mapcache_context *ctx, mapcache_locker *self, char *resource) {
+   mapcache_locker_disk *locker = (mapcache_locker_disk*)self;
+   char *lockname = lock_filename_for_resource(ctx,locker->dir,resource);
+   int fd = open(lockname, O_RDONLY);
+   if(fd < 0) {
+      /* the lock has already been released */
       return MAPCACHE_FALSE;
-   } else {
-      /* we acquired the lock */
-      apr_file_close(lockfile);
-      return MAPCACHE_TRUE;
    }
+   /*
+    * sleep in the kernel until the owner releases its exclusive lock. no need to check
+    * for stale locks, the kernel releases them if the owner dies
+    */
+   while(flock(fd, LOCK_SH) != 0 && errno == EINTR);
+   flock(fd, LOCK_UN);
+   close(fd);
+   return MAPCACHE_FALSE;
 }
 
-void mapcache_unlock_resource(mapcache_context *ctx, char *resource) {
-   char *lockname = lock_filename_for_resource(ctx,resource);
-   apr_file_remove(lockname,ctx->pool);
+static void _mapcache_locker_flock_unlock(mapcache_context *ctx, mapcache_locker *self, char *resource, void *lock) {
+   mapcache_flock_handle *handle = (mapcache_flock_handle*)lock;
+   unlink(handle->lockname);
+   flock(handle->fd, LOCK_UN);
+   close(handle->fd);
+}
+#endif
+
+mapcache_locker* mapcache_locker_flock_create(mapcache_context *ctx) {
+#ifdef _WIN32
+   ctx->set_error(ctx, 400, "flock locker is not supported on this platform");
+   return NULL;
+#else
+   mapcache_locker *locker = mapcache_locker_disk_create(ctx);
+   if(!locker) return NULL;
+   locker->type = MAPCACHE_LOCKER_FLOCK;
+   locker->lock = _mapcache_locker_flock_lock;
+   locker->wait = _mapcache_locker_flock_wait;
+   locker->unlock = _mapcache_locker_flock_unlock;
+   return locker;
+#endif
 }
 
 /* vim: ai ts=3 sts=3 et sw=3
@@ -0,0 +1,240 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: memcache based locking support
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+
+#include "mapcache.h"
+
+#ifdef USE_MEMCACHE
+#include <apr_strings.h>
+#include <apr_md5.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
+
+/* waiters poll the lock with an exponential backoff, capped to this interval */
+#define MAPCACHE_LOCKER_MEMCACHE_MAX_RETRY 500000
+
+/*
+ * a lock acquired on the memcache servers. the owner string stored as the key's value
+ * tells our lock apart from one taken by another node once ours has expired
+ */
+typedef struct {
+   char *key;
+   char *owner;
+} mapcache_memcache_lock_handle;
+
+/*
+ * memcache keys can't contain whitespace and are limited to 250 characters, long
+ * resource names are replaced by their md5 sum
+ */
+static char* _mapcache_locker_memcache_key(mapcache_context *ctx, const char *resource) {
+   char *key = apr_pstrcat(ctx->pool, MAPCACHE_LOCKFILE_PREFIX, resource, NULL);
+   if(strlen(key) > 200) {
+      unsigned char digest[APR_MD5_DIGESTSIZE];
+      char *hex = apr_palloc(ctx->pool, 2*APR_MD5_DIGESTSIZE+1);
+      int i;
+      apr_md5(digest, resource, strlen(resource));
+      for(i=0;i<APR_MD5_DIGESTSIZE;i++) {
+         sprintf(&hex[2*i],"%02x",digest[i]);
+      }
+      key = apr_pstrcat(ctx->pool, MAPCACHE_LOCKFILE_PREFIX, hex, NULL);
+   }
+   return mapcache_util_str_sanitize(ctx->pool, key, " \r\n\t\f\e\a\b", '#');
+}
+
+static int _mapcache_locker_memcache_lock(mapcache_context *ctx, mapcache_locker *self, char *resource, void **lock) {
+   mapcache_locker_memcache *locker = (mapcache_locker_memcache*)self;
+   char *key = _mapcache_locker_memcache_key(ctx, resource);
+   char *owner;
+   apr_status_t rv;
+   char hostname[APRMAXHOSTLEN+1];
+   if(apr_gethostname(hostname,APRMAXHOSTLEN,ctx->pool) != APR_SUCCESS) {
+      hostname[0] = '\0';
+   }
+   owner = apr_psprintf(ctx->pool,"%d %s %"APR_TIME_T_FMT,(int)getpid(),hostname,apr_time_now());
+   /*
+    * add only succeeds if the key does not exist yet, which makes it atomic across the
+    * cluster. the expiration time acts as a lease: if we die, the lock disappears after
+    * lock_timeout
+    */
+   rv = apr_memcache_add(locker->memcache, key, owner, strlen(owner),
+         (apr_uint32_t)apr_time_sec(ctx->config->lock_timeout), 0);
+   if(rv == APR_SUCCESS) {
+      mapcache_memcache_lock_handle *handle = apr_palloc(ctx->pool, sizeof(mapcache_memcache_lock_handle));
+      handle->key = key;
+      handle->owner = owner;
+      *lock = handle;
+      return MAPCACHE_TRUE;
+   }
+   if(rv == APR_EEXIST) {
+      return MAPCACHE_FALSE;
+   }
+   /* memcache is unreachable: don't block the rendering, at worst it will be done by several nodes */
+   ctx->log(ctx, MAPCACHE_WARN, "memcache locker: failed to add lock %s, rendering without lock", key);
+   *lock = NULL;
+   return MAPCACHE_TRUE;
+}
+
+static int _mapcache_locker_memcache_wait(mapcache_context *ctx, mapcache_locker *self, char *resource) {
+   mapcache_locker_memcache *locker = (mapcache_locker_memcache*)self;
+   char *key = _mapcache_locker_memcache_key(ctx, resource);
+   apr_interval_time_t retry = locker->retry_interval;
+   while(1) {
+      char *owner;
+      apr_size_t len;
+      apr_status_t rv = apr_memcache_getp(locker->memcache, ctx->pool, key, &owner, &len, NULL);
+      if(rv != APR_SUCCESS) {
+         /* released, expired, or memcache unreachable: stop waiting in all cases */
+         return MAPCACHE_FALSE;
+      }
+      apr_sleep(retry);
+      retry *= 2;
+      if(retry > MAPCACHE_LOCKER_MEMCACHE_MAX_RETRY) {
+         retry = MAPCACHE_LOCKER_MEMCACHE_MAX_RETRY;
+      }
+   }
+}
+
+/*
+ * release the lock, unless it expired while we held it and another node took it over.
+ *
+ * apr_memcache has no compare-and-swap, so the key may still expire and be taken by
+ * another node between our check and the delete. that window is a single round trip,
+ * compared to the whole time we held an expired lock before
+ */
+static void _mapcache_locker_memcache_unlock(mapcache_context *ctx, mapcache_locker *self, char *resource, void *lock) {
+   mapcache_locker_memcache *locker = (mapcache_locker_memcache*)self;
+   mapcache_memcache_lock_handle *handle = (mapcache_memcache_lock_handle*)lock;
+   char *owner;
+   apr_size_t len;
+   if(!handle) return;
+   if(apr_memcache_getp(locker->memcache, ctx->pool, handle->key, &owner, &len, NULL) != APR_SUCCESS) {
+      /* expired, or memcache unreachable */
+      return;
+   }
+   if(len != strlen(handle->owner) || memcmp(owner, handle->owner, len)) {
+      ctx->log(ctx, MAPCACHE_WARN, "memcache locker: lock %s expired while we held it, consider raising lock_timeout",
+            handle->key);
+      return;
+   }
+   apr_memcache_delete(locker->memcache, handle->key, 0);
+}
+
+static void _mapcache_locker_memcache_parse_xml(mapcache_context *ctx, mapcache_locker *self, ezxml_t node) {
+   mapcache_locker_memcache *locker = (mapcache_locker_memcache*)self;
+   ezxml_t cur_node;
+   int servercount = 0;
+   for(cur_node = ezxml_child(node,"server"); cur_node; cur_node = cur_node->next) {
+      servercount++;
+   }
+   if(!servercount) {
+      ctx->set_error(ctx,400,"memcache locker has no <server>s configured");
+      return;
+   }
+   if(APR_SUCCESS != apr_memcache_create(ctx->pool, servercount, 0, &locker->memcache)) {
+      ctx->set_error(ctx,400,"memcache locker: failed to create memcache backend");
+      return;
+   }
+   for(cur_node = ezxml_child(node,"server"); cur_node; cur_node = cur_node->next) {
+      ezxml_t xhost = ezxml_child(cur_node,"host");
+      ezxml_t xport = ezxml_child(cur_node,"port");
+      const char *host;
+      apr_memcache_server_t *server;
+      apr_port_t port;
+      char *endptr;
+      if(!xhost || !xhost->txt || ! *xhost->txt) {
+         ctx->set_error(ctx,400,"memcache locker: <server> with no <host>");
+         return;
+      }
+      host = apr_pstrdup(ctx->pool,xhost->txt);
+      if(!xport || !xport->txt || ! *xport->txt) {
+         ctx->set_error(ctx,400,"memcache locker: <server> with no <port>");
+         return;
+      }
+      port = (apr_port_t)strtol(xport->txt,&endptr,10);
+      if(*endptr != 0) {
+         ctx->set_error(ctx,400,"failed to parse port %s for memcache locker", xport->txt);
+         return;
+      }
+      if(APR_SUCCESS != apr_memcache_server_create(ctx->pool,host,port,4,5,50,10000,&server)) {
+         ctx->set_error(ctx,400,"memcache locker: failed to create server %s:%d",host,port);
+         return;
+      }
+      if(APR_SUCCESS != apr_memcache_add_server(locker->memcache,server)) {
+         ctx->set_error(ctx,400,"memcache locker: failed to add server %s:%d",host,port);
+         return;
+      }
+   }
+   if((cur_node = ezxml_child(node,"retry")) != NULL) {
+      char *endptr;
+      locker->retry_interval = (apr_interval_time_t)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || locker->retry_interval <= 0) {
+         ctx->set_error(ctx, 400, "failed to parse locker retry microseconds \"%s\". Expecting a positive integer",
+               cur_node->txt);
+         return;
+      }
+   }
+}
+
+static void _mapcache_locker_memcache_post_config(mapcache_context *ctx, mapcache_locker *self, mapcache_cfg *cfg) {
+   mapcache_locker_memcache *locker = (mapcache_locker_memcache*)self;
+   if(!locker->retry_interval) {
+      locker->retry_interval = cfg->lock_retry_interval;
+   }
+   if(apr_time_sec(cfg->lock_timeout) < 1) {
+      /* an expiration time of 0 would mean the lock never expires */
+      ctx->set_error(ctx, 400, "memcache locker requires a lock_timeout of at least one second");
+   }
+}
+#endif
+
+mapcache_locker* mapcache_locker_memcache_create(mapcache_context *ctx) {
+#ifndef USE_MEMCACHE
+   ctx->set_error(ctx, 400, "memcache locker requires mapcache to be built with memcache support");
+   return NULL;
+#else
+   mapcache_locker_memcache *locker = apr_pcalloc(ctx->pool, sizeof(mapcache_locker_memcache));
+   if(!locker) {
+      ctx->set_error(ctx, 500, "failed to allocate memcache locker");
+      return NULL;
+   }
+   locker->locker.type = MAPCACHE_LOCKER_MEMCACHE;
+   locker->locker.lock = _mapcache_locker_memcache_lock;
+   locker->locker.wait = _mapcache_locker_memcache_wait;
+   locker->locker.unlock = _mapcache_locker_memcache_unlock;
+   locker->locker.parse_xml = _mapcache_locker_memcache_parse_xml;
+   locker->locker.post_config = _mapcache_locker_memcache_post_config;
+   return (mapcache_locker*)locker;
+#endif
+}
+
+/* vim: ai ts=3 sts=3 et sw=3
+*/
@@ -0,0 +1,272 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: shared memory locking support
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#endif
+
+#if APR_HAS_SHARED_MEMORY && defined(_POSIX_THREAD_PROCESS_SHARED) && defined(EOWNERDEAD)
+#define USE_SHM_LOCKER
+#endif
+
+#ifdef USE_SHM_LOCKER
+#include <apr_shm.h>
+
+/*
+ * the table lives in an anonymous shared memory segment created before the server
+ * forks its children. a slot is identified by the 64 bit hash of the resource,
+ * collisions are resolved by linear probing. a single process-shared condition
+ * variable is broadcast every time a slot is released
+ */
+typedef struct {
+   apr_uint64_t hash; /**< 0 if the slot is free */
+   pid_t owner;
+   apr_time_t acquired;
+   apr_uint32_t generation;
+} mapcache_shm_lock_slot;
+
+typedef struct {
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   int nslots;
+   mapcache_shm_lock_slot slots[1];
+} mapcache_shm_lock_table;
+
+typedef struct {
+   int slot;
+   apr_uint32_t generation;
+} mapcache_shm_lock_handle;
+
+static apr_uint64_t _mapcache_shm_lock_hash(const char *resource) {
+   apr_uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+   while(*resource) {
+      hash ^= (unsigned char)*resource++;
+      hash *= 1099511628211ULL;
+   }
+   return hash?hash:1;
+}
+
+static void _mapcache_shm_lock_table_lock(mapcache_shm_lock_table *table) {
+   /* the mutex is robust: recover it if a process died while holding it */
+   if(pthread_mutex_lock(&table->mutex) == EOWNERDEAD) {
+      pthread_mutex_consistent(&table->mutex);
+   }
+}
+
+/* a slot is stale if its owner died, or if it has been held for longer than the lock timeout */
+static int _mapcache_shm_lock_stale(mapcache_context *ctx, mapcache_shm_lock_slot *slot) {
+   if(apr_time_now() - slot->acquired > ctx->config->lock_timeout) {
+      return MAPCACHE_TRUE;
+   }
+   return (kill(slot->owner,0) != 0 && errno == ESRCH);
+}
+
+/* returns the slot holding the given hash, or -1. must be called with the table mutex held */
+static int _mapcache_shm_lock_find(mapcache_shm_lock_table *table, apr_uint64_t hash, int *free_slot) {
+   int i,start = hash % table->nslots;
+   if(free_slot) *free_slot = -1;
+   for(i=0;i<table->nslots;i++) {
+      int idx = (start+i) % table->nslots;
+      if(table->slots[idx].hash == hash) {
+         return idx;
+      }
+      if(free_slot && *free_slot < 0 && !table->slots[idx].hash) {
+         *free_slot = idx;
+      }
+   }
+   return -1;
+}
+
+static int _mapcache_locker_shm_lock(mapcache_context *ctx, mapcache_locker *self, char *resource, void **lock) {
+   mapcache_shm_lock_table *table = ((mapcache_locker_shm*)self)->table;
+   apr_uint64_t hash = _mapcache_shm_lock_hash(resource);
+   mapcache_shm_lock_handle *handle;
+   int idx, free_slot;
+   _mapcache_shm_lock_table_lock(table);
+   idx = _mapcache_shm_lock_find(table,hash,&free_slot);
+   if(idx >= 0 && !_mapcache_shm_lock_stale(ctx,&table->slots[idx])) {
+      pthread_mutex_unlock(&table->mutex);
+      return MAPCACHE_FALSE;
+   }
+   if(idx < 0) {
+      idx = free_slot;
+   }
+   if(idx < 0) {
+      pthread_mutex_unlock(&table->mutex);
+      ctx->log(ctx, MAPCACHE_WARN, "shm lock table full (%d slots), rendering %s without lock", table->nslots, resource);
+      *lock = NULL;
+      return MAPCACHE_TRUE;
+   }
+   /* either a free slot, or a stale one */
+   table->slots[idx].hash = hash;
+   table->slots[idx].owner = getpid();
+   table->slots[idx].acquired = apr_time_now();
+   table->slots[idx].generation++;
+   handle = apr_palloc(ctx->pool, sizeof(mapcache_shm_lock_handle));
+   handle->slot = idx;
+   handle->generation = table->slots[idx].generation;
+   pthread_mutex_unlock(&table->mutex);
+   *lock = handle;
+   return MAPCACHE_TRUE;
+}
+
+static int _mapcache_locker_shm_wait(mapcache_context *ctx, mapcache_locker *self, char *resource) {
+   mapcache_shm_lock_table *table = ((mapcache_locker_shm*)self)->table;
+   apr_uint64_t hash = _mapcache_shm_lock_hash(resource);
+   apr_uint32_t generation;
+   int idx, broken = MAPCACHE_FALSE;
+   _mapcache_shm_lock_table_lock(table);
+   idx = _mapcache_shm_lock_find(table,hash,NULL);
+   if(idx >= 0) {
+      mapcache_shm_lock_slot *slot = &table->slots[idx];
+      generation = slot->generation;
+      while(slot->hash == hash && slot->generation == generation) {
+         struct timespec deadline;
+         int rc;
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_sec += 1;
+         rc = pthread_cond_timedwait(&table->cond, &table->mutex, &deadline);
+         if(rc == EOWNERDEAD) {
+            pthread_mutex_consistent(&table->mutex);
+         } else if(rc == ETIMEDOUT && slot->hash == hash && slot->generation == generation &&
+               _mapcache_shm_lock_stale(ctx,slot)) {
+            /* the owner died or is stuck: release the slot and compete for it again */
+            ctx->log(ctx,MAPCACHE_WARN,"breaking stale shm lock on %s",resource);
+            slot->hash = 0;
+            slot->owner = 0;
+            pthread_cond_broadcast(&table->cond);
+            broken = MAPCACHE_TRUE;
+         }
+      }
+   }
+   pthread_mutex_unlock(&table->mutex);
+   return broken;
+}
+
+static void _mapcache_locker_shm_unlock(mapcache_context *ctx, mapcache_locker *self, char *resource, void *lock) {
+   mapcache_shm_lock_table *table = ((mapcache_locker_shm*)self)->table;
+   mapcache_shm_lock_handle *handle = (mapcache_shm_lock_handle*)lock;
+   if(!handle) return;
+   _mapcache_shm_lock_table_lock(table);
+   if(table->slots[handle->slot].generation == handle->generation) {
+      table->slots[handle->slot].hash = 0;
+      table->slots[handle->slot].owner = 0;
+      pthread_cond_broadcast(&table->cond);
+   }
+   pthread_mutex_unlock(&table->mutex);
+}
+
+static apr_status_t _mapcache_locker_shm_cleanup(void *data) {
+   mapcache_shm_lock_table *table = (mapcache_shm_lock_table*)data;
+   pthread_cond_destroy(&table->cond);
+   pthread_mutex_destroy(&table->mutex);
+   return APR_SUCCESS;
+}
+
+static void _mapcache_locker_shm_post_config(mapcache_context *ctx, mapcache_locker *self, mapcache_cfg *cfg) {
+   mapcache_locker_shm *locker = (mapcache_locker_shm*)self;
+   mapcache_shm_lock_table *table;
+   pthread_mutexattr_t mattr;
+   pthread_condattr_t cattr;
+   apr_shm_t *shm;
+   apr_status_t rv;
+   char errmsg[120];
+   apr_size_t size = sizeof(mapcache_shm_lock_table) + (locker->nslots-1)*sizeof(mapcache_shm_lock_slot);
+
+   /* anonymous segment, inherited by the children forked after the configuration has been loaded */
+   rv = apr_shm_create(&shm, size, NULL, ctx->pool);
+   if(rv != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create shared memory segment for shm locker: %s",
+            apr_strerror(rv,errmsg,120));
+      return;
+   }
+   table = apr_shm_baseaddr_get(shm);
+   memset(table, 0, size);
+   table->nslots = locker->nslots;
+
+   pthread_mutexattr_init(&mattr);
+   pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+   pthread_condattr_init(&cattr);
+   pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+   if(pthread_mutex_init(&table->mutex, &mattr) || pthread_cond_init(&table->cond, &cattr)) {
+      ctx->set_error(ctx, 500, "failed to initialize process shared mutex for shm locker");
+   }
+   pthread_mutexattr_destroy(&mattr);
+   pthread_condattr_destroy(&cattr);
+   GC_CHECK_ERROR(ctx);
+   apr_pool_cleanup_register(ctx->pool, table, _mapcache_locker_shm_cleanup, apr_pool_cleanup_null);
+   locker->table = table;
+}
+
+static void _mapcache_locker_shm_parse_xml(mapcache_context *ctx, mapcache_locker *self, ezxml_t node) {
+   mapcache_locker_shm *locker = (mapcache_locker_shm*)self;
+   ezxml_t cur_node;
+   if((cur_node = ezxml_child(node,"slots")) != NULL) {
+      char *endptr;
+      locker->nslots = (int)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || locker->nslots <= 0) {
+         ctx->set_error(ctx, 400, "failed to parse locker slots \"%s\". Expecting a positive integer",
+               cur_node->txt);
+         return;
+      }
+   }
+}
+#endif
+
+mapcache_locker* mapcache_locker_shm_create(mapcache_context *ctx) {
+#ifndef USE_SHM_LOCKER
+   ctx->set_error(ctx, 400, "shm locker is not supported on this platform");
+   return NULL;
+#else
+   mapcache_locker_shm *locker = apr_pcalloc(ctx->pool, sizeof(mapcache_locker_shm));
+   if(!locker) {
+      ctx->set_error(ctx, 500, "failed to allocate shm locker");
+      return NULL;
+   }
+   locker->nslots = 1024;
+   locker->locker.type = MAPCACHE_LOCKER_SHM;
+   locker->locker.lock = _mapcache_locker_shm_lock;
+   locker->locker.wait = _mapcache_locker_shm_wait;
+   locker->locker.unlock = _mapcache_locker_shm_unlock;
+   locker->locker.parse_xml = _mapcache_locker_shm_parse_xml;
+   locker->locker.post_config = _mapcache_locker_shm_post_config;
+   return (mapcache_locker*)locker;
+#endif
+}
+
+/* vim: ai ts=3 sts=3 et sw=3
+*/
@@ -0,0 +1,197 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: in-process coalescing of concurrent metatile renderings
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+
+#include "mapcache.h"
+
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+
+typedef struct {
+   int x;
+   int y;
+   apr_time_t mtime;
+   size_t size;
+   unsigned char *data;
+} mapcache_flight_tile;
+
+struct mapcache_flight {
+   char *key;
+   int done; /**< set by the leader once the metatile has been handled */
+   int refcount; /**< the leader plus the number of waiters still referencing the flight */
+   int ntiles; /**< 0 if the leader did not render the tiles itself, or if rendering failed */
+   mapcache_flight_tile *tiles;
+};
+
+struct mapcache_singleflight {
+   apr_pool_t *pool;
+   apr_thread_mutex_t *mutex;
+   apr_thread_cond_t *cond; /**< broadcast each time a flight lands */
+   apr_hash_t *flights;
+};
+
+/*
+ * flights and their payloads are shared between requests whose pools have unrelated
+ * lifetimes, so they are allocated on the heap and freed by the last thread to release them
+ */
+static void _mapcache_flight_free(mapcache_flight *flight) {
+   int i;
+   for(i=0;i<flight->ntiles;i++) {
+      free(flight->tiles[i].data);
+   }
+   free(flight->tiles);
+   free(flight->key);
+   free(flight);
+}
+
+static apr_status_t _mapcache_singleflight_cleanup(void *data) {
+   mapcache_singleflight *sf = (mapcache_singleflight*)data;
+   apr_pool_destroy(sf->pool);
+   return APR_SUCCESS;
+}
+
+mapcache_singleflight* mapcache_singleflight_create(mapcache_context *ctx) {
+   mapcache_singleflight *sf;
+   apr_pool_t *pool;
+   apr_status_t rv;
+   char errmsg[120];
+   /* the hash is modified by request threads, so it can't be allocated from the shared configuration pool */
+   if((rv = apr_pool_create(&pool,NULL)) != APR_SUCCESS) {
+      ctx->set_error(ctx,500,"failed to create request coalescing table: %s",apr_strerror(rv,errmsg,120));
+      return NULL;
+   }
+   sf = (mapcache_singleflight*)apr_pcalloc(pool,sizeof(mapcache_singleflight));
+   sf->pool = pool;
+   sf->flights = apr_hash_make(pool);
+   if((rv = apr_thread_mutex_create(&sf->mutex,APR_THREAD_MUTEX_DEFAULT,pool)) != APR_SUCCESS ||
+         (rv = apr_thread_cond_create(&sf->cond,pool)) != APR_SUCCESS) {
+      ctx->set_error(ctx,500,"failed to create request coalescing table: %s",apr_strerror(rv,errmsg,120));
+      apr_pool_destroy(pool);
+      return NULL;
+   }
+   apr_pool_cleanup_register(ctx->pool, sf, _mapcache_singleflight_cleanup, apr_pool_cleanup_null);
+   return sf;
+}
+
+mapcache_flight* mapcache_singleflight_join(mapcache_context *ctx, mapcache_singleflight *sf,
+      const char *key, int *leader) {
+   mapcache_flight *flight;
+   apr_thread_mutex_lock(sf->mutex);
+   flight = apr_hash_get(sf->flights,key,APR_HASH_KEY_STRING);
+   if(flight) {
+      *leader = MAPCACHE_FALSE;
+   } else {
+      flight = (mapcache_flight*)calloc(1,sizeof(mapcache_flight));
+      flight->key = strdup(key);
+      apr_hash_set(sf->flights,flight->key,APR_HASH_KEY_STRING,flight);
+      *leader = MAPCACHE_TRUE;
+   }
+   flight->refcount++;
+   apr_thread_mutex_unlock(sf->mutex);
+   return flight;
+}
+
+void mapcache_singleflight_land(mapcache_context *ctx, mapcache_singleflight *sf,
+      mapcache_flight *flight, mapcache_metatile *mt) {
+   int i;
+   /*
+    * copy the encoded tiles out of our request pool before handing them over. nothing is
+    * handed over if the rendering failed, waiters will then fall back to querying the cache
+    */
+   if(mt && !GC_HAS_ERROR(ctx)) {
+      apr_time_t now = apr_time_now();
+      flight->tiles = (mapcache_flight_tile*)calloc(mt->ntiles,sizeof(mapcache_flight_tile));
+      for(i=0;i<mt->ntiles;i++) {
+         mapcache_tile *tile = &(mt->tiles[i]);
+         mapcache_flight_tile *ftile = &(flight->tiles[flight->ntiles]);
+         if(!tile->encoded_data) {
+            /* some caches don't keep an encoded version of what they stored (e.g. blank symlinks) */
+            if(!tile->raw_image || !tile->tileset->format) continue;
+            tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+            if(GC_HAS_ERROR(ctx)) {
+               ctx->clear_errors(ctx);
+               continue;
+            }
+         }
+         ftile->x = tile->x;
+         ftile->y = tile->y;
+         ftile->mtime = now;
+         ftile->size = tile->encoded_data->size;
+         ftile->data = malloc(ftile->size);
+         memcpy(ftile->data,tile->encoded_data->buf,ftile->size);
+         flight->ntiles++;
+      }
+   }
+
+   apr_thread_mutex_lock(sf->mutex);
+   /* requests arriving from now on will find the tiles in the cache */
+   apr_hash_set(sf->flights,flight->key,APR_HASH_KEY_STRING,NULL);
+   flight->done = 1;
+   apr_thread_cond_broadcast(sf->cond);
+   if(--flight->refcount == 0) {
+      _mapcache_flight_free(flight);
+   }
+   apr_thread_mutex_unlock(sf->mutex);
+}
+
+int mapcache_singleflight_wait(mapcache_context *ctx, mapcache_singleflight *sf,
+      mapcache_flight *flight, mapcache_tile *tile) {
+   int i, ret = MAPCACHE_CACHE_MISS;
+   apr_thread_mutex_lock(sf->mutex);
+   while(!flight->done) {
+      apr_thread_cond_wait(sf->cond,sf->mutex);
+   }
+   apr_thread_mutex_unlock(sf->mutex);
+
+   /* the payload is immutable once the flight has landed, and our reference keeps it alive */
+   for(i=0;i<flight->ntiles;i++) {
+      mapcache_flight_tile *ftile = &(flight->tiles[i]);
+      if(ftile->x == tile->x && ftile->y == tile->y) {
+         tile->encoded_data = mapcache_buffer_create(ftile->size,ctx->pool);
+         memcpy(tile->encoded_data->buf,ftile->data,ftile->size);
+         tile->encoded_data->size = ftile->size;
+         tile->mtime = ftile->mtime;
+         ret = MAPCACHE_SUCCESS;
+         break;
+      }
+   }
+
+   apr_thread_mutex_lock(sf->mutex);
+   if(--flight->refcount == 0) {
+      _mapcache_flight_free(flight);
+   }
+   apr_thread_mutex_unlock(sf->mutex);
+   return ret;
+}
+
+#endif /* APR_HAS_THREADS */
+
+/* vim: ai ts=3 sts=3 et sw=3
+*/
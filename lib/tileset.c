@@ -116,6 +116,51 @@ void mapcache_tileset_configuration_check(mapcache_context *ctx, mapcache_tilese
           return;
        }
    }
+
+   if(tileset->empty_markers) {
+      int i;
+      if(!tileset->format) {
+         ctx->set_error(ctx,400,"tileset \"%s\" has no <format> configured, but it is needed for <empty_markers>",
+               tileset->name);
+         return;
+      }
+      /* encode the empty tiles once, they are returned as-is for every empty marker found in the cache */
+      tileset->empty_tiles = apr_hash_make(ctx->pool);
+      for(i=0;i<tileset->grid_links->nelts;i++) {
+         mapcache_grid *grid = APR_ARRAY_IDX(tileset->grid_links,i,mapcache_grid_link*)->grid;
+         mapcache_buffer *empty = tileset->format->create_empty_image(ctx, tileset->format,
+               grid->tile_sx, grid->tile_sy, 0);
+         GC_CHECK_ERROR(ctx);
+         apr_hash_set(tileset->empty_tiles, grid->name, APR_HASH_KEY_STRING, empty);
+      }
+   }
+}
+
+mapcache_buffer* mapcache_tileset_empty_tile(mapcache_context *ctx, mapcache_tileset *tileset, mapcache_grid_link *grid_link) {
+   mapcache_buffer *empty = NULL;
+   if(tileset->empty_tiles) {
+      empty = apr_hash_get(tileset->empty_tiles, grid_link->grid->name, APR_HASH_KEY_STRING);
+   }
+   if(empty) {
+      /*
+       * the pre-encoded empty tile is shared by all requests. hand out a copy, as the tile
+       * may be passed on to a cache that temporarily appends its metadata to the data it
+       * stores (e.g. the seeder's transfer mode)
+       */
+      mapcache_buffer *copy = mapcache_buffer_create(empty->size, ctx->pool);
+      mapcache_buffer_append(copy, empty->size, empty->buf);
+      empty = copy;
+   } else {
+      /* the cache contains markers written with a previous configuration */
+      if(!tileset->format) {
+         ctx->set_error(ctx,500,"tileset \"%s\" found an empty tile marker in its cache, but has no <format> to encode it",
+               tileset->name);
+         return NULL;
+      }
+      empty = tileset->format->create_empty_image(ctx, tileset->format,
+            grid_link->grid->tile_sx, grid_link->grid->tile_sy, 0);
+   }
+   return empty;
 }
 
 void mapcache_tileset_add_watermark(mapcache_context *ctx, mapcache_tileset *tileset, const char *filename) {
@@ -261,6 +306,11 @@ mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapca
       ox = (tile->x - mx) * tile->grid_link->grid->tile_sx;
       oy = (My - tile->y) * tile->grid_link->grid->tile_sy;
 
+      if(tile->nodata) {
+         /* the source image is zero-filled already, no need to decode an empty tile */
+         continue;
+      }
+
       fakeimg.stride = srcimage->stride;
       fakeimg.data = &(srcimage->data[oy*srcimage->stride+ox*4]);
       if(!tile->raw_image) {
@@ -391,6 +441,19 @@ void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *
    GC_CHECK_ERROR(ctx);
    mapcache_image_metatile_split(ctx, mt);
    GC_CHECK_ERROR(ctx);
+   if(mt->map.tileset->empty_markers) {
+      /* flag the fully transparent tiles, they will be stored as empty markers */
+      for(i=0;i<mt->ntiles;i++) {
+         mapcache_tile *tile = &(mt->tiles[i]);
+         if(tile->raw_image && *((unsigned int*)tile->raw_image->data) == 0 &&
+               mapcache_image_blank_color(tile->raw_image) == MAPCACHE_TRUE) {
+            mapcache_buffer *empty = mapcache_tileset_empty_tile(ctx, mt->map.tileset, mt->map.grid_link);
+            GC_CHECK_ERROR(ctx);
+            tile->nodata = 1;
+            tile->encoded_data = empty;
+         }
+      }
+   }
    if(mt->map.tileset->cache->tile_multi_set) {
       mt->map.tileset->cache->tile_multi_set(ctx, mt->tiles, mt->ntiles);
    } else {
@@ -436,6 +499,8 @@ mapcache_tileset* mapcache_tileset_clone(mapcache_context *ctx, mapcache_tileset
    dst->cache = src->cache;
    dst->source = src->source;
    dst->watermark = src->watermark;
+   dst->empty_markers = src->empty_markers;
+   dst->empty_tiles = src->empty_tiles;
    dst->wgs84bbox[0] = src->wgs84bbox[0];
    dst->wgs84bbox[1] = src->wgs84bbox[1];
    dst->wgs84bbox[2] = src->wgs84bbox[2];
@@ -522,11 +587,37 @@ mapcache_feature_info* mapcache_tileset_feature_info_create(apr_pool_t *pool, ma
  *    - release mutex
  *  
  */
+/*
+ * take the encoded data of a tile we have just rendered directly from its metatile,
+ * instead of reading it back from the cache
+ */
+static int _mapcache_tileset_tile_from_metatile(mapcache_context *ctx, mapcache_metatile *mt, mapcache_tile *tile) {
+   int i;
+   for(i=0;i<mt->ntiles;i++) {
+      mapcache_tile *rendered = &(mt->tiles[i]);
+      if(rendered->x == tile->x && rendered->y == tile->y) {
+         if(!rendered->encoded_data) {
+            /* the cache did not keep the encoded data around */
+            return MAPCACHE_CACHE_MISS;
+         }
+         tile->encoded_data = rendered->encoded_data;
+         tile->nodata = rendered->nodata;
+         tile->mtime = apr_time_now();
+         return MAPCACHE_SUCCESS;
+      }
+   }
+   return MAPCACHE_CACHE_MISS;
+}
+
 void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile) {
-   int isLocked,ret;
-   mapcache_metatile *mt=NULL;
-   ret = tile->tileset->cache->tile_get(ctx, tile);
+   int ret = tile->tileset->cache->tile_get(ctx, tile);
    GC_CHECK_ERROR(ctx);
+   mapcache_tileset_tile_resolve(ctx, tile, ret);
+}
+
+void mapcache_tileset_tile_resolve(mapcache_context *ctx, mapcache_tile *tile, int ret) {
+   int isLocked;
+   mapcache_metatile *mt=NULL;
 
    if(ret == MAPCACHE_SUCCESS && tile->tileset->auto_expire && tile->mtime && tile->tileset->source) {
       /* the cache is in auto-expire mode, and can return the tile modification date,
@@ -537,11 +628,16 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile) {
       if(stale<now) {
          mapcache_tileset_tile_delete(ctx,tile,MAPCACHE_TRUE);
          GC_CHECK_ERROR(ctx);
+         tile->nodata = 0;
          ret = MAPCACHE_CACHE_MISS;
       }
    }
 
    if(ret == MAPCACHE_CACHE_MISS) {
+      char *resource;
+      void *lock;
+      int leader = MAPCACHE_TRUE;
+      mapcache_flight *flight = NULL;
       /* bail out straight away if the tileset has no source */
       if(!tile->tileset->source) {
          ctx->set_error(ctx,404,"tile not in cache, and no source configured for tileset %s",
@@ -559,26 +655,55 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile) {
        * - if the lock exists, we should wait for the other thread to finish
        */
 
-      /* aquire a lock on the metatile */
       mt = mapcache_tileset_metatile_get(ctx, tile);
-      isLocked = mapcache_lock_or_wait_for_resource(ctx, mapcache_tileset_metatile_resource_key(ctx,mt));
+      resource = mapcache_tileset_metatile_resource_key(ctx,mt);
+      isLocked = MAPCACHE_FALSE;
+      ret = MAPCACHE_CACHE_MISS;
 
+#if APR_HAS_THREADS
+      /*
+       * threads of this process requesting the same metatile don't compete for the lock,
+       * they wait for the first one to hand them their tile once it has been rendered
+       */
+      if(ctx->config->flights) {
+         flight = mapcache_singleflight_join(ctx, ctx->config->flights, resource, &leader);
+      }
+      if(!leader) {
+         ret = mapcache_singleflight_wait(ctx, ctx->config->flights, flight, tile);
+      } else
+#endif
+      {
+         /* aquire a lock on the metatile */
+         isLocked = mapcache_lock_or_wait_for_resource(ctx, resource, &lock);
 
-      if(isLocked == MAPCACHE_TRUE) {
-         /* no other thread is doing the rendering, do it ourselves */
+         if(isLocked == MAPCACHE_TRUE) {
+            /* no other thread is doing the rendering, do it ourselves */
 #ifdef DEBUG
-         ctx->log(ctx, MAPCACHE_DEBUG, "cache miss: tileset %s - tile %d %d %d",
-               tile->tileset->name,tile->x, tile->y,tile->z);
+            ctx->log(ctx, MAPCACHE_DEBUG, "cache miss: tileset %s - tile %d %d %d",
+                  tile->tileset->name,tile->x, tile->y,tile->z);
 #endif
-         /* this will query the source to create the tiles, and save them to the cache */
-         mapcache_tileset_render_metatile(ctx, mt);
+            /* this will query the source to create the tiles, and save them to the cache */
+            mapcache_tileset_render_metatile(ctx, mt);
 
-         mapcache_unlock_resource(ctx, mapcache_tileset_metatile_resource_key(ctx,mt));
+            mapcache_unlock_resource(ctx, resource, lock);
+         }
+#if APR_HAS_THREADS
+         if(flight) {
+            mapcache_singleflight_land(ctx, ctx->config->flights, flight,
+                  (isLocked == MAPCACHE_TRUE)?mt:NULL);
+         }
+#endif
+         GC_CHECK_ERROR(ctx);
+         if(isLocked == MAPCACHE_TRUE) {
+            ret = _mapcache_tileset_tile_from_metatile(ctx, mt, tile);
+         }
       }
       
-      /* the previous step has successfully finished, we can now query the cache to return the tile content */
-      ret = tile->tileset->cache->tile_get(ctx, tile);
-      GC_CHECK_ERROR(ctx);
+      if(ret != MAPCACHE_SUCCESS) {
+         /* the previous step has successfully finished, we can now query the cache to return the tile content */
+         ret = tile->tileset->cache->tile_get(ctx, tile);
+         GC_CHECK_ERROR(ctx);
+      }
 
       if(ret != MAPCACHE_SUCCESS) {
          if(isLocked == MAPCACHE_FALSE) {
@@ -590,6 +715,11 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile) {
          }
       }
    }
+   if(tile->nodata && !tile->encoded_data && !tile->file) {
+      /* the cache returned an empty marker, answer with the pre-encoded empty tile */
+      tile->encoded_data = mapcache_tileset_empty_tile(ctx, tile->tileset, tile->grid_link);
+      GC_CHECK_ERROR(ctx);
+   }
    /* update the tile expiration time */
    if(tile->tileset->auto_expire && tile->mtime) {
       apr_time_t now = apr_time_now();
@@ -240,48 +240,219 @@ char* mapcache_util_get_tile_dimkey(mapcache_context *ctx, mapcache_tile *tile,
    return key;
 }
 
-char* mapcache_util_get_tile_key(mapcache_context *ctx, mapcache_tile *tile, char *template,
+char* mapcache_util_get_tile_key(mapcache_context *ctx, mapcache_tile *tile, mapcache_template *template,
         char* sanitized_chars, char *sanitize_to) {
    char *path;
    if(template) {
-      path = mapcache_util_str_replace(ctx->pool, template, "{x}",
-              apr_psprintf(ctx->pool, "%d", tile->x));
-      path = mapcache_util_str_replace(ctx->pool, path, "{y}",
-              apr_psprintf(ctx->pool, "%d", tile->y));
-      path = mapcache_util_str_replace(ctx->pool, path, "{z}",
-              apr_psprintf(ctx->pool, "%d", tile->z));
-      if(strstr(path,"{dim}")) {
-         path = mapcache_util_str_replace(ctx->pool, path, "{dim}", mapcache_util_get_tile_dimkey(ctx,tile,sanitized_chars,sanitize_to));
+      const char *dimkey = NULL;
+      if(template->has_dim) {
+         dimkey = mapcache_util_get_tile_dimkey(ctx,tile,sanitized_chars,sanitize_to);
       }
-      if(strstr(path,"{tileset}"))
-         path = mapcache_util_str_replace(ctx->pool, path, "{tileset}", tile->tileset->name);
-      if(strstr(path,"{grid}"))
-         path = mapcache_util_str_replace(ctx->pool, path, "{grid}", tile->grid_link->grid->name);
-      if(strstr(path,"{ext}"))
-         path = mapcache_util_str_replace(ctx->pool, path, "{ext}",
-              tile->tileset->format ? tile->tileset->format->extension : "png");
+      path = mapcache_template_render(ctx, template, tile, dimkey, 1, 1);
    } else {
-      char *separator = "/";
+      const char *ext = tile->tileset->format?tile->tileset->format->extension:"png";
       /* we'll concatenate the entries ourself */
-      path = apr_pstrcat(ctx->pool,
-              tile->tileset->name,separator,
-              tile->grid_link->grid->name,separator,
-              NULL);
       if(tile->dimensions) {
-         path = apr_pstrcat(ctx->pool,path,
+         path = apr_psprintf(ctx->pool, "%s/%s/%s/%d/%d/%d/%s",
+                 tile->tileset->name, tile->grid_link->grid->name,
                  mapcache_util_get_tile_dimkey(ctx,tile,sanitized_chars,sanitize_to),
-                 separator,NULL);
+                 tile->z, tile->y, tile->x, ext);
+      } else {
+         path = apr_psprintf(ctx->pool, "%s/%s/%d/%d/%d/%s",
+                 tile->tileset->name, tile->grid_link->grid->name,
+                 tile->z, tile->y, tile->x, ext);
       }
-      path = apr_pstrcat(ctx->pool,path,
-              apr_psprintf(ctx->pool, "%d", tile->z),separator,
-              apr_psprintf(ctx->pool, "%d", tile->y),separator,
-              apr_psprintf(ctx->pool, "%d", tile->x),separator,
-              tile->tileset->format?tile->tileset->format->extension:"png",
-              NULL);
    }
    return path;
 }
 
+static const struct {
+   const char *name;
+   mapcache_template_token_type type;
+} _mapcache_template_placeholders[] = {
+   {"{tileset}", MAPCACHE_TEMPLATE_TILESET},
+   {"{grid}", MAPCACHE_TEMPLATE_GRID},
+   {"{ext}", MAPCACHE_TEMPLATE_EXT},
+   {"{dim}", MAPCACHE_TEMPLATE_DIM},
+   {"{x}", MAPCACHE_TEMPLATE_X},
+   {"{y}", MAPCACHE_TEMPLATE_Y},
+   {"{z}", MAPCACHE_TEMPLATE_Z},
+   {"{inv_x}", MAPCACHE_TEMPLATE_INV_X},
+   {"{inv_y}", MAPCACHE_TEMPLATE_INV_Y},
+   {"{inv_z}", MAPCACHE_TEMPLATE_INV_Z},
+   {"{div_x}", MAPCACHE_TEMPLATE_DIV_X},
+   {"{div_y}", MAPCACHE_TEMPLATE_DIV_Y},
+   {"{inv_div_x}", MAPCACHE_TEMPLATE_INV_DIV_X},
+   {"{inv_div_y}", MAPCACHE_TEMPLATE_INV_DIV_Y},
+   {NULL, MAPCACHE_TEMPLATE_LITERAL}
+};
+
+mapcache_template* mapcache_template_compile(mapcache_context *ctx, const char *template) {
+   mapcache_template *tpl = apr_pcalloc(ctx->pool, sizeof(mapcache_template));
+   const char *iter = template, *literal = template;
+   int ntokens = 0;
+   /* upper bound on the number of tokens: each placeholder may be followed by a literal */
+   const char *c;
+   for(c=template; *c; c++) {
+      if(*c == '{') ntokens++;
+   }
+   tpl->template = apr_pstrdup(ctx->pool, template);
+   tpl->tokens = apr_pcalloc(ctx->pool, (2*ntokens+1) * sizeof(mapcache_template_token));
+
+   while(*iter) {
+      int i;
+      if(*iter == '{') {
+         for(i=0; _mapcache_template_placeholders[i].name; i++) {
+            const char *name = _mapcache_template_placeholders[i].name;
+            int len = strlen(name);
+            if(!strncmp(iter, name, len)) {
+               if(iter > literal) {
+                  mapcache_template_token *tok = &tpl->tokens[tpl->ntokens++];
+                  tok->type = MAPCACHE_TEMPLATE_LITERAL;
+                  tok->literal = apr_pstrndup(ctx->pool, literal, iter - literal);
+                  tok->len = iter - literal;
+                  tpl->literal_len += tok->len;
+               }
+               tpl->tokens[tpl->ntokens++].type = _mapcache_template_placeholders[i].type;
+               if(_mapcache_template_placeholders[i].type == MAPCACHE_TEMPLATE_DIM) {
+                  tpl->has_dim = 1;
+               }
+               iter += len;
+               literal = iter;
+               break;
+            }
+         }
+         if(_mapcache_template_placeholders[i].name) {
+            continue;
+         }
+      }
+      iter++;
+   }
+   if(iter > literal) {
+      mapcache_template_token *tok = &tpl->tokens[tpl->ntokens++];
+      tok->type = MAPCACHE_TEMPLATE_LITERAL;
+      tok->literal = apr_pstrndup(ctx->pool, literal, iter - literal);
+      tok->len = iter - literal;
+      tpl->literal_len += tok->len;
+   }
+   return tpl;
+}
+
+/* writes the decimal representation of val at dst, returns the number of chars written */
+static int _mapcache_template_itoa(char *dst, int val) {
+   char tmp[12];
+   int n = 0, len;
+   unsigned int u = (val < 0) ? -(unsigned int)val : (unsigned int)val;
+   do {
+      tmp[n++] = '0' + (u % 10);
+      u /= 10;
+   } while(u);
+   if(val < 0) {
+      tmp[n++] = '-';
+   }
+   len = n;
+   while(n--) {
+      *dst++ = tmp[n];
+   }
+   return len;
+}
+
+char* mapcache_template_render(mapcache_context *ctx, mapcache_template *template, mapcache_tile *tile,
+      const char *dimkey, int count_x, int count_y) {
+   const char *ext = tile->tileset->format?tile->tileset->format->extension:"png";
+   mapcache_grid *grid = tile->grid_link->grid;
+   int i, size = template->literal_len + 1;
+   char *key, *dst;
+   /* tiles without dimensions keep the literal {dim}, as the caches always did */
+   if(!dimkey) dimkey = "{dim}";
+
+   /* compute an upper bound of the rendered size, so we allocate only once */
+   for(i=0; i<template->ntokens; i++) {
+      switch(template->tokens[i].type) {
+         case MAPCACHE_TEMPLATE_LITERAL:
+            break;
+         case MAPCACHE_TEMPLATE_TILESET:
+            size += strlen(tile->tileset->name);
+            break;
+         case MAPCACHE_TEMPLATE_GRID:
+            size += strlen(grid->name);
+            break;
+         case MAPCACHE_TEMPLATE_EXT:
+            size += strlen(ext);
+            break;
+         case MAPCACHE_TEMPLATE_DIM:
+            size += strlen(dimkey);
+            break;
+         default:
+            size += 11; /* any int */
+      }
+   }
+   key = dst = apr_palloc(ctx->pool, size);
+   if(!key) {
+      ctx->set_error(ctx,500, "failed to allocate tile key");
+      return NULL;
+   }
+
+   for(i=0; i<template->ntokens; i++) {
+      mapcache_template_token *tok = &template->tokens[i];
+      const char *str = NULL;
+      int len;
+      switch(tok->type) {
+         case MAPCACHE_TEMPLATE_LITERAL:
+            memcpy(dst, tok->literal, tok->len);
+            dst += tok->len;
+            continue;
+         case MAPCACHE_TEMPLATE_TILESET:
+            str = tile->tileset->name;
+            break;
+         case MAPCACHE_TEMPLATE_GRID:
+            str = grid->name;
+            break;
+         case MAPCACHE_TEMPLATE_EXT:
+            str = ext;
+            break;
+         case MAPCACHE_TEMPLATE_DIM:
+            str = dimkey;
+            break;
+         case MAPCACHE_TEMPLATE_X:
+            dst += _mapcache_template_itoa(dst, tile->x / count_x * count_x);
+            continue;
+         case MAPCACHE_TEMPLATE_Y:
+            dst += _mapcache_template_itoa(dst, tile->y / count_y * count_y);
+            continue;
+         case MAPCACHE_TEMPLATE_Z:
+            dst += _mapcache_template_itoa(dst, tile->z);
+            continue;
+         case MAPCACHE_TEMPLATE_INV_X:
+            dst += _mapcache_template_itoa(dst, (grid->levels[tile->z]->maxx - tile->x - 1) / count_x * count_x);
+            continue;
+         case MAPCACHE_TEMPLATE_INV_Y:
+            dst += _mapcache_template_itoa(dst, (grid->levels[tile->z]->maxy - tile->y - 1) / count_y * count_y);
+            continue;
+         case MAPCACHE_TEMPLATE_INV_Z:
+            dst += _mapcache_template_itoa(dst, grid->nlevels - tile->z - 1);
+            continue;
+         case MAPCACHE_TEMPLATE_DIV_X:
+            dst += _mapcache_template_itoa(dst, tile->x / count_x);
+            continue;
+         case MAPCACHE_TEMPLATE_DIV_Y:
+            dst += _mapcache_template_itoa(dst, tile->y / count_y);
+            continue;
+         case MAPCACHE_TEMPLATE_INV_DIV_X:
+            dst += _mapcache_template_itoa(dst, (grid->levels[tile->z]->maxx - tile->x - 1) / count_x);
+            continue;
+         case MAPCACHE_TEMPLATE_INV_DIV_Y:
+            dst += _mapcache_template_itoa(dst, (grid->levels[tile->z]->maxy - tile->y - 1) / count_y);
+            continue;
+      }
+      len = strlen(str);
+      memcpy(dst, str, len);
+      dst += len;
+   }
+   *dst = '\0';
+   return key;
+}
+
 
 /* vim: ai ts=3 sts=3 et sw=3
 */
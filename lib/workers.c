@@ -0,0 +1,253 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: persistent worker thread pool
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+
+#include "mapcache.h"
+
+#if APR_HAS_THREADS
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+
+typedef struct mapcache_worker_job mapcache_worker_job;
+
+struct mapcache_worker_job {
+   mapcache_worker_func func;
+   void *data;
+   mapcache_context *ctx; /* cloned context the job runs with */
+   mapcache_worker_batch *batch;
+   mapcache_worker_job *next;
+};
+
+struct mapcache_worker_pool {
+   apr_pool_t *pool; /* private pool, threads and jobs are never allocated from the config pool */
+   apr_thread_mutex_t *mutex; /* protects everything below, as well as the batch counters */
+   apr_thread_cond_t *work;
+   apr_threadattr_t *thread_attrs;
+   mapcache_worker_job *head, *tail;
+   int queued;
+   int idle;
+   int nthreads;
+   int max_threads;
+   int shutdown;
+   apr_thread_t **threads;
+};
+
+struct mapcache_worker_batch {
+   mapcache_worker_pool *wp;
+   mapcache_context *ctx;
+   apr_thread_cond_t *done;
+   int pending;
+   apr_array_header_t *jobs;
+};
+
+/*
+ * remove a job from the queue. if batch is not NULL, only a job belonging
+ * to that batch is returned. must be called with the pool mutex held
+ */
+static mapcache_worker_job* _mapcache_worker_pop(mapcache_worker_pool *wp, mapcache_worker_batch *batch) {
+   mapcache_worker_job *job = wp->head, *prev = NULL;
+   while(job && batch && job->batch != batch) {
+      prev = job;
+      job = job->next;
+   }
+   if(!job) return NULL;
+   if(prev) {
+      prev->next = job->next;
+   } else {
+      wp->head = job->next;
+   }
+   if(wp->tail == job) {
+      wp->tail = prev;
+   }
+   job->next = NULL;
+   wp->queued--;
+   return job;
+}
+
+/* must be called with the pool mutex held */
+static void _mapcache_worker_job_done(mapcache_worker_job *job) {
+   if(--job->batch->pending == 0) {
+      apr_thread_cond_signal(job->batch->done);
+   }
+}
+
+static void* APR_THREAD_FUNC _mapcache_worker_thread(apr_thread_t *thread, void *data) {
+   mapcache_worker_pool *wp = (mapcache_worker_pool*)data;
+   apr_thread_mutex_lock(wp->mutex);
+   while(1) {
+      mapcache_worker_job *job;
+      while(!wp->head && !wp->shutdown) {
+         wp->idle++;
+         apr_thread_cond_wait(wp->work, wp->mutex);
+         wp->idle--;
+      }
+      if(wp->shutdown) break;
+      job = _mapcache_worker_pop(wp,NULL);
+      apr_thread_mutex_unlock(wp->mutex);
+      job->func(job->ctx, job->data);
+      apr_thread_mutex_lock(wp->mutex);
+      _mapcache_worker_job_done(job);
+   }
+   apr_thread_mutex_unlock(wp->mutex);
+   apr_thread_exit(thread, APR_SUCCESS);
+   return NULL;
+}
+
+static apr_status_t _mapcache_worker_pool_cleanup(void *data) {
+   mapcache_worker_pool *wp = (mapcache_worker_pool*)data;
+   apr_status_t rv;
+   int i;
+   apr_thread_mutex_lock(wp->mutex);
+   wp->shutdown = 1;
+   apr_thread_cond_broadcast(wp->work);
+   apr_thread_mutex_unlock(wp->mutex);
+   for(i=0;i<wp->nthreads;i++) {
+      apr_thread_join(&rv, wp->threads[i]);
+   }
+   apr_pool_destroy(wp->pool);
+   return APR_SUCCESS;
+}
+
+mapcache_worker_pool* mapcache_worker_pool_create(mapcache_context *ctx, int max_threads) {
+   mapcache_worker_pool *wp;
+   apr_pool_t *pool;
+   apr_status_t rv;
+   char errmsg[120];
+   /*
+    * the pool lives in its own unparented apr pool: threads are spawned lazily from request
+    * threads, and we can't allocate from the shared configuration pool at that time
+    */
+   if((rv = apr_pool_create(&pool,NULL)) != APR_SUCCESS) {
+      ctx->set_error(ctx,500,"failed to create worker pool: %s",apr_strerror(rv,errmsg,120));
+      return NULL;
+   }
+   wp = (mapcache_worker_pool*)apr_pcalloc(pool,sizeof(mapcache_worker_pool));
+   wp->pool = pool;
+   wp->max_threads = max_threads;
+   wp->threads = (apr_thread_t**)apr_pcalloc(pool,max_threads*sizeof(apr_thread_t*));
+   if((rv = apr_thread_mutex_create(&wp->mutex,APR_THREAD_MUTEX_DEFAULT,pool)) != APR_SUCCESS ||
+         (rv = apr_thread_cond_create(&wp->work,pool)) != APR_SUCCESS ||
+         (rv = apr_threadattr_create(&wp->thread_attrs,pool)) != APR_SUCCESS) {
+      ctx->set_error(ctx,500,"failed to create worker pool: %s",apr_strerror(rv,errmsg,120));
+      apr_pool_destroy(pool);
+      return NULL;
+   }
+   /*
+    * threads must be stopped before anything they may be referencing in the configuration
+    * pool is destroyed, hence the pre-cleanup
+    */
+   apr_pool_pre_cleanup_register(ctx->pool, wp, _mapcache_worker_pool_cleanup);
+   return wp;
+}
+
+mapcache_worker_batch* mapcache_worker_batch_create(mapcache_context *ctx, mapcache_worker_pool *wp) {
+   mapcache_worker_batch *batch = (mapcache_worker_batch*)apr_pcalloc(ctx->pool,sizeof(mapcache_worker_batch));
+   apr_status_t rv;
+   batch->wp = wp;
+   batch->ctx = ctx;
+   batch->jobs = apr_array_make(ctx->pool,10,sizeof(mapcache_worker_job*));
+   if((rv = apr_thread_cond_create(&batch->done,ctx->pool)) != APR_SUCCESS) {
+      char errmsg[120];
+      ctx->set_error(ctx,500,"failed to create batch condition: %s",apr_strerror(rv,errmsg,120));
+      return NULL;
+   }
+   return batch;
+}
+
+void mapcache_worker_batch_push(mapcache_context *ctx, mapcache_worker_batch *batch,
+      mapcache_worker_func func, void *data) {
+   mapcache_worker_pool *wp = batch->wp;
+   mapcache_worker_job *job = (mapcache_worker_job*)apr_pcalloc(ctx->pool,sizeof(mapcache_worker_job));
+   job->func = func;
+   job->data = data;
+   job->batch = batch;
+   job->ctx = ctx->clone(ctx);
+   APR_ARRAY_PUSH(batch->jobs,mapcache_worker_job*) = job;
+
+   apr_thread_mutex_lock(wp->mutex);
+   if(wp->tail) {
+      wp->tail->next = job;
+   } else {
+      wp->head = job;
+   }
+   wp->tail = job;
+   wp->queued++;
+   batch->pending++;
+
+   /* grow the pool up to its bound if there aren't enough idle workers for the queued jobs */
+   if(wp->queued > wp->idle && wp->nthreads < wp->max_threads && !wp->shutdown) {
+      apr_status_t rv = apr_thread_create(&wp->threads[wp->nthreads], wp->thread_attrs,
+            _mapcache_worker_thread, wp, wp->pool);
+      if(rv == APR_SUCCESS) {
+         wp->nthreads++;
+      } else if(!wp->nthreads) {
+         /* not fatal: the job will be run by the thread waiting on the batch */
+         ctx->log(ctx,MAPCACHE_WARN,"failed to create fetching thread, falling back to sequential fetching");
+      }
+   }
+   apr_thread_cond_signal(wp->work);
+   apr_thread_mutex_unlock(wp->mutex);
+}
+
+void mapcache_worker_batch_wait(mapcache_context *ctx, mapcache_worker_batch *batch) {
+   mapcache_worker_pool *wp = batch->wp;
+   int i;
+   apr_thread_mutex_lock(wp->mutex);
+   while(batch->pending) {
+      /*
+       * instead of sleeping while all the workers are busy, take back our own jobs that are
+       * still queued and run them in the calling thread. this also guarantees progress if
+       * the pool is saturated by other requests
+       */
+      mapcache_worker_job *job = _mapcache_worker_pop(wp,batch);
+      if(job) {
+         apr_thread_mutex_unlock(wp->mutex);
+         job->func(job->ctx, job->data);
+         apr_thread_mutex_lock(wp->mutex);
+         _mapcache_worker_job_done(job);
+      } else {
+         apr_thread_cond_wait(batch->done, wp->mutex);
+      }
+   }
+   apr_thread_mutex_unlock(wp->mutex);
+
+   for(i=0;i<batch->jobs->nelts;i++) {
+      mapcache_worker_job *job = APR_ARRAY_IDX(batch->jobs,i,mapcache_worker_job*);
+      if(GC_HAS_ERROR(job->ctx)) {
+         /* transfer error message from the job to the calling context */
+         ctx->set_error(ctx, job->ctx->get_error(job->ctx), job->ctx->get_error_message(job->ctx));
+      }
+   }
+}
+
+#endif /* APR_HAS_THREADS */
+
+/* vim: ai ts=3 sts=3 et sw=3
+*/
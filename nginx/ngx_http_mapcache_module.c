@@ -110,8 +110,55 @@ static void ngx_http_mapcache_write_response(mapcache_context *ctx, ngx_http_req
          }
       }
    }
+   ngx_file_t *file = NULL;
    if(response->data) {
       r->headers_out.content_length_n = response->data->size;
+   } else if(response->file) {
+      /*
+       * the apr file handle is closed when the mapcache pool is destroyed at the end
+       * of the handler, so reopen the file with an nginx handle that lives as long as
+       * the request, and let nginx send it (with sendfile if enabled)
+       */
+      ngx_pool_cleanup_t *cln;
+      ngx_pool_cleanup_file_t *clnf;
+      ngx_file_info_t fi;
+      size_t pathlen = strlen(response->file->path);
+      u_char *path;
+
+      file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+      cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+      path = ngx_pnalloc(r->pool, pathlen + 1);
+      if (file == NULL || cln == NULL || path == NULL) {
+         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
+               "Failed to allocate response buffer.");
+         return;
+      }
+      ngx_memcpy(path, response->file->path, pathlen + 1);
+
+      file->fd = ngx_open_file(path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+      if (file->fd == NGX_INVALID_FILE || ngx_fd_info(file->fd, &fi) == NGX_FILE_ERROR) {
+         ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+               ngx_open_file_n " \"%s\" failed", path);
+         if (file->fd != NGX_INVALID_FILE) {
+            ngx_close_file(file->fd);
+         }
+         return;
+      }
+      file->name.data = path;
+      file->name.len = pathlen;
+      file->log = r->connection->log;
+
+      cln->handler = ngx_pool_cleanup_file;
+      clnf = cln->data;
+      clnf->fd = file->fd;
+      clnf->name = path;
+      clnf->log = r->pool->log;
+
+      /* the tile may have been rewritten since we looked it up, trust the file we just opened */
+      if(response->file->offset == 0) {
+         response->file->length = ngx_file_size(&fi);
+      }
+      r->headers_out.content_length_n = response->file->length;
    }
    int rc;
    r->headers_out.status = response->code;
@@ -139,6 +186,25 @@ static void ngx_http_mapcache_write_response(mapcache_context *ctx, ngx_http_req
       out.buf = b;
       out.next = NULL;
       ngx_http_output_filter(r, &out);
+   } else if(file) {
+      ngx_buf_t    *b;
+      ngx_chain_t   out;
+      b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+      if (b == NULL) {
+         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
+               "Failed to allocate response buffer.");
+         return;
+      }
+
+      b->file = file;
+      b->file_pos = response->file->offset;
+      b->file_last = response->file->offset + response->file->length;
+      b->in_file = 1;
+      b->last_buf = 1;
+      b->flush = 1;
+      out.buf = b;
+      out.next = NULL;
+      ngx_http_output_filter(r, &out);
    }
 
 }
@@ -218,6 +284,7 @@ ngx_http_mapcache_handler(ngx_http_request_t *r)
          http_response = mapcache_core_get_capabilities(ctx,request->service,req,url,pathInfo,ctx->config);
       } else if( request->type == MAPCACHE_REQUEST_GET_TILE) {
          mapcache_request_get_tile *req_tile = (mapcache_request_get_tile*)request;
+         req_tile->accept_file = 1;
          http_response = mapcache_core_get_tile(ctx,req_tile);
       } else if( request->type == MAPCACHE_REQUEST_PROXY ) {
          mapcache_request_proxy *req_proxy = (mapcache_request_proxy*)request;
@@ -0,0 +1,176 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache utility program for checking the configured locker
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+ * forks several processes that repeatedly take the same lock through the locker of
+ * the given configuration, and checks that no two of them ever hold it at once.
+ *
+ * while holding the lock, a process creates a marker file with O_EXCL and removes it
+ * -h milliseconds later (default 5), before unlocking: finding the marker already
+ * there means the lock was held twice.
+ * with -s, the first process holds the lock once for the given number of milliseconds
+ * without creating the marker. making this longer than lock_timeout checks that a lock
+ * that expired under its owner isn't released by it once another process took it over.
+ *
+ * exits with status 0 if the lock was never held twice
+ */
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static void locktest_log(mapcache_context *ctx, mapcache_log_level level, char *msg, ...) {
+   va_list args;
+   va_start(args,msg);
+   vfprintf(stderr,msg,args);
+   va_end(args);
+   fprintf(stderr,"\n");
+}
+
+static int usage(const char *progname) {
+   fprintf(stderr,"usage: %s -c mapcache.xml -m markerfile [-r resource] [-p processes] [-n iterations] [-h holdms] [-s slowms]\n",progname);
+   return 2;
+}
+
+/*
+ * take and release the lock iterations times. returns the number of times the lock was
+ * found to be held by someone else too, or -1 on error
+ */
+static int run(const char *configfile, const char *resource, const char *marker, int iterations, int holdms, int slowms) {
+   mapcache_context ctx;
+   mapcache_cfg *cfg;
+   int i, overlaps = 0;
+   memset(&ctx,0,sizeof(ctx));
+   /* each process connects on its own, connections can't be shared across a fork */
+   apr_pool_create(&ctx.pool,NULL);
+   mapcache_context_init(&ctx);
+   ctx.log = locktest_log;
+   cfg = mapcache_configuration_create(ctx.pool);
+   ctx.config = cfg;
+   mapcache_configuration_parse(&ctx,configfile,cfg,0);
+   if(!GC_HAS_ERROR(&ctx)) mapcache_configuration_post_config(&ctx,cfg);
+   if(GC_HAS_ERROR(&ctx)) {
+      fprintf(stderr,"%s\n",ctx.get_error_message(&ctx));
+      return -1;
+   }
+   for(i=0;i<iterations;i++) {
+      void *lock;
+      int fd;
+      if(mapcache_lock_or_wait_for_resource(&ctx,(char*)resource,&lock) != MAPCACHE_TRUE) {
+         if(GC_HAS_ERROR(&ctx)) {
+            fprintf(stderr,"%s\n",ctx.get_error_message(&ctx));
+            return -1;
+         }
+         /* somebody else held it and released it, compete again */
+         i--;
+         continue;
+      }
+      if(slowms) {
+         apr_sleep(slowms*1000);
+         slowms = 0;
+      } else {
+         fd = open(marker,O_WRONLY|O_CREAT|O_EXCL,0644);
+         if(fd < 0) {
+            if(errno != EEXIST) {
+               fprintf(stderr,"failed to create %s: %s\n",marker,strerror(errno));
+               return -1;
+            }
+            fprintf(stderr,"process %d: lock held by another process too\n",(int)getpid());
+            overlaps++;
+         } else {
+            apr_sleep(holdms*1000);
+            close(fd);
+            unlink(marker);
+         }
+      }
+      mapcache_unlock_resource(&ctx,(char*)resource,lock);
+   }
+   apr_pool_destroy(ctx.pool);
+   return overlaps;
+}
+
+int main(int argc, char **argv) {
+   const char *configfile = NULL, *marker = NULL, *resource = "mapcache-locktest";
+   int nprocesses = 4, iterations = 50, holdms = 5, slowms = 0;
+   int opt, i, overlaps = 0, failed = 0;
+   while((opt = getopt(argc,argv,"c:m:r:p:n:h:s:")) != -1) {
+      switch(opt) {
+         case 'c': configfile = optarg; break;
+         case 'm': marker = optarg; break;
+         case 'r': resource = optarg; break;
+         case 'p': nprocesses = atoi(optarg); break;
+         case 'n': iterations = atoi(optarg); break;
+         case 'h': holdms = atoi(optarg); break;
+         case 's': slowms = atoi(optarg); break;
+         default: return usage(argv[0]);
+      }
+   }
+   if(!configfile || !marker || nprocesses < 1 || iterations < 1) {
+      return usage(argv[0]);
+   }
+   apr_initialize();
+   unlink(marker);
+   for(i=0;i<nprocesses;i++) {
+      pid_t pid = fork();
+      if(pid < 0) {
+         perror("fork");
+         return 1;
+      }
+      if(pid == 0) {
+         int ret = run(configfile,resource,marker,iterations,holdms,i?0:slowms);
+         /* overlap counts above 254 are reported as 254, -1 as 255 */
+         _exit(ret < 0 ? 255 : (ret > 254 ? 254 : ret));
+      }
+   }
+   for(i=0;i<nprocesses;i++) {
+      int status;
+      if(wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 255) {
+         failed = 1;
+      } else {
+         overlaps += WEXITSTATUS(status);
+      }
+   }
+   apr_terminate();
+   if(failed) {
+      fprintf(stderr,"a test process failed\n");
+      return 1;
+   }
+   printf("%d processes, %d iterations each: the lock was held twice %d times\n",nprocesses,iterations,overlaps);
+   return overlaps ? 1 : 0;
+}
+
+/* vim: ai ts=3 sts=3 et sw=3
+*/
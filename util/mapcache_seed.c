@@ -75,6 +75,7 @@ int nthreads=1;
 int quiet = 0;
 int verbose = 0;
 int force = 0;
+int skip_empty = 0;
 int sig_int_received = 0;
 int error_detected = 0;
 
@@ -199,6 +200,7 @@ static const apr_getopt_option_t seed_options[] = {
     { "help", 'h', FALSE, "show help" },
     { "quiet", 'q', FALSE, "don't show progress info" },
     { "force", 'f', FALSE, "force tile recreation even if it already exists" },
+    { "skip-empty", 'E', FALSE, "don't descend into metatiles stored as empty markers" },
     { "verbose", 'v', FALSE, "show debug log messages" },
     { NULL, 0, 0, NULL },
 };
@@ -324,11 +326,42 @@ void progresslog(int x, int y, int z) {
    fflush(NULL);
 }
 
-cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile) 
+/* the existence of the tile has not been looked up yet */
+#define TILE_EXISTS_UNKNOWN -1
+
+/*
+ * look up the existence of several tiles with a single cache call, when the cache
+ * supports it. exists[i] is set to TILE_EXISTS_UNKNOWN otherwise, and examine_tile()
+ * queries the tile itself
+ */
+void tiles_exist(mapcache_context *ctx, mapcache_tile **tiles, int ntiles, int *exists) {
+   int i;
+   if(!force && ntiles > 1 && tileset->cache->tile_multi_exists) {
+      tileset->cache->tile_multi_exists(ctx, tiles, ntiles, exists);
+      if(!GC_HAS_ERROR(ctx)) return;
+      ctx->clear_errors(ctx);
+   }
+   for(i=0;i<ntiles;i++) {
+      exists[i] = TILE_EXISTS_UNKNOWN;
+   }
+}
+
+/*
+ * exists is the result of a previous tiles_exist() lookup for this tile, or
+ * TILE_EXISTS_UNKNOWN
+ */
+cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile, int exists) 
 {
    int action = MAPCACHE_CMD_SKIP;
    int intersects = -1;
-   int tile_exists = force?0:tileset->cache->tile_exists(ctx,tile);
+   int tile_exists;
+   if(force) {
+      tile_exists = 0;
+   } else if(exists != TILE_EXISTS_UNKNOWN) {
+      tile_exists = exists;
+   } else {
+      tile_exists = tileset->cache->tile_exists(ctx,tile);
+   }
 
    /* if the tile exists and a time limit was specified, check the tile modification date */
    if(tile_exists) {
@@ -413,12 +446,32 @@ cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile)
    return action;
 }
 
-void cmd_recurse(mapcache_context *cmd_ctx, mapcache_tile *tile) {
+/*
+ * check if all the tiles of the metatile containing the given tile are stored
+ * as empty markers, i.e. the source has no data there
+ */
+int metatile_is_empty(mapcache_context *ctx, mapcache_tile *tile) {
+   int i;
+   mapcache_metatile *mt = mapcache_tileset_metatile_get(ctx,tile);
+   for(i=0;i<mt->ntiles;i++) {
+      mapcache_tile *subtile = &mt->tiles[i];
+      if(tileset->cache->tile_get(ctx,subtile) != MAPCACHE_SUCCESS || !subtile->nodata) {
+         ctx->clear_errors(ctx);
+         return MAPCACHE_FALSE;
+      }
+   }
+   return MAPCACHE_TRUE;
+}
+
+void cmd_recurse(mapcache_context *cmd_ctx, mapcache_tile *tile, int exists) {
   cmd action;
   int curx, cury, curz;
   int minchildx,maxchildx,minchildy,maxchildy;
   double bboxbl[4],bboxtr[4];
   double epsilon;
+  int i,nchildren;
+  mapcache_tile *children, **childptrs;
+  int *childexists;
 
    apr_pool_clear(cmd_ctx->pool);
    if(sig_int_received || error_detected) { //stop if we were asked to stop by hitting ctrl-c
@@ -428,7 +481,7 @@ void cmd_recurse(mapcache_context *cmd_ctx, mapcache_tile *tile) {
       return;
    }
 
-   action = examine_tile(cmd_ctx, tile);
+   action = examine_tile(cmd_ctx, tile, exists);
 
    if(action == MAPCACHE_CMD_SEED || action == MAPCACHE_CMD_DELETE || action == MAPCACHE_CMD_TRANSFER){
       //current x,y,z needs seeding, add it to the queue
@@ -440,6 +493,9 @@ void cmd_recurse(mapcache_context *cmd_ctx, mapcache_tile *tile) {
       push_queue(cmd);
       queuedtilestot++;
       progresslog(tile->x,tile->y,tile->z);
+   } else if(skip_empty && mode == MAPCACHE_CMD_SEED && metatile_is_empty(cmd_ctx,tile)) {
+      /* the source has no data in this area, don't bother looking at the children */
+      return;
    }
 
    //recurse into our 4 child metatiles
@@ -478,15 +534,35 @@ void cmd_recurse(mapcache_context *cmd_ctx, mapcache_tile *tile) {
    maxchildx = (maxchildx / tileset->metasize_x + 1)*tileset->metasize_x;
    maxchildy = (maxchildy / tileset->metasize_y + 1)*tileset->metasize_y;
 
+   /*
+    * collect the child metatiles so their existence can be looked up in one call.
+    * these outlive the recursion, which clears cmd_ctx->pool, so they are malloc'ed
+    */
+   nchildren = ((maxchildx-minchildx)/tileset->metasize_x) * ((maxchildy-minchildy)/tileset->metasize_y);
+   children = malloc(nchildren*sizeof(mapcache_tile));
+   childptrs = malloc(nchildren*sizeof(mapcache_tile*));
+   childexists = malloc(nchildren*sizeof(int));
+   nchildren = 0;
    for(tile->x = minchildx; tile->x < maxchildx; tile->x +=  tileset->metasize_x) {
       if(tile->x >= grid_link->grid_limits[tile->z][0] && tile->x < grid_link->grid_limits[tile->z][2]) {
          for(tile->y = minchildy; tile->y < maxchildy; tile->y += tileset->metasize_y) {
             if(tile->y >= grid_link->grid_limits[tile->z][1] && tile->y < grid_link->grid_limits[tile->z][3]) {
-               cmd_recurse(cmd_ctx,tile);
+               children[nchildren] = *tile;
+               childptrs[nchildren] = &children[nchildren];
+               nchildren++;
             }
          }
       }
    }
+   tiles_exist(cmd_ctx, childptrs, nchildren, childexists);
+   for(i=0;i<nchildren;i++) {
+      tile->x = children[i].x;
+      tile->y = children[i].y;
+      cmd_recurse(cmd_ctx,tile,childexists[i]);
+   }
+   free(children);
+   free(childptrs);
+   free(childexists);
 
    tile->x = curx;
    tile->y = cury;
@@ -508,7 +584,7 @@ void cmd_thread() {
          tile->x = x;
          tile->y = y;
          tile->z = z;
-         cmd_recurse(&cmd_ctx,tile);
+         cmd_recurse(&cmd_ctx,tile,TILE_EXISTS_UNKNOWN);
          x += tileset->metasize_x;
          if( x >= grid_link->grid_limits[z][2] ) {
             y += tileset->metasize_y;
@@ -534,7 +610,7 @@ void cmd_thread() {
          tile->x = x;
          tile->y = y;
          tile->z = z;
-	 action = examine_tile(&cmd_ctx, tile);
+	 action = examine_tile(&cmd_ctx, tile, TILE_EXISTS_UNKNOWN);
 
          if(action == MAPCACHE_CMD_SEED || action == MAPCACHE_CMD_TRANSFER) {
             //current x,y,z needs seeding, add it to the queue
@@ -601,11 +677,12 @@ static void* APR_THREAD_FUNC seed_thread(apr_thread_t *thread, void *data)
       if(cmd.command == MAPCACHE_CMD_SEED) {
          /* aquire a lock on the metatile ?*/
          mapcache_metatile *mt = mapcache_tileset_metatile_get(&seed_ctx, tile);
-         int isLocked = mapcache_lock_or_wait_for_resource(&seed_ctx, mapcache_tileset_metatile_resource_key(&seed_ctx,mt));
+         void *lock;
+         int isLocked = mapcache_lock_or_wait_for_resource(&seed_ctx, mapcache_tileset_metatile_resource_key(&seed_ctx,mt), &lock);
          if(isLocked == MAPCACHE_TRUE) {
             /* this will query the source to create the tiles, and save them to the cache */
             mapcache_tileset_render_metatile(&seed_ctx, mt);
-            mapcache_unlock_resource(&seed_ctx, mapcache_tileset_metatile_resource_key(&seed_ctx,mt));
+            mapcache_unlock_resource(&seed_ctx, mapcache_tileset_metatile_resource_key(&seed_ctx,mt), lock);
          }
       } else if (cmd.command == MAPCACHE_CMD_TRANSFER) {
          int i;
@@ -730,6 +807,9 @@ int main(int argc, const char **argv) {
             case 'f':
                force = 1;
                break;
+            case 'E':
+               skip_empty = 1;
+               break;
             case 'q':
                 quiet = 1;
                 break;
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# checks the memcache locker against a local memcached:
+#    cd util && make mapcache_locktest && ./test_memcache_locker.sh [port]
+# requires mapcache to be built with memcache support, and memcached in the PATH
+#
+# the first run checks that concurrent processes never hold the same lock. the second
+# one has a process hold its lock for longer than lock_timeout: the other processes take
+# the expired lock over, and the late owner must not release it under them
+
+PORT=${1:-11311}
+DIR=`mktemp -d /tmp/mapcache-locktest.XXXXXX` || exit 1
+
+cat > $DIR/mapcache.xml <<CONFIG
+<?xml version="1.0" encoding="UTF-8"?>
+<mapcache>
+   <service type="tms" enabled="true"/>
+   <locker type="memcache">
+      <server>
+         <host>127.0.0.1</host>
+         <port>$PORT</port>
+      </server>
+      <retry>1000</retry>
+   </locker>
+   <lock_timeout>1</lock_timeout>
+</mapcache>
+CONFIG
+
+memcached -l 127.0.0.1 -p $PORT -U 0 &
+MEMCACHED=$!
+trap 'kill $MEMCACHED; rm -rf $DIR' EXIT
+sleep 1
+
+STATUS=0
+echo "concurrent lockers:"
+./mapcache_locktest -c $DIR/mapcache.xml -m $DIR/marker -p 8 -n 100 || STATUS=1
+echo "owner holding an expired lock:"
+./mapcache_locktest -c $DIR/mapcache.xml -m $DIR/marker -p 8 -n 20 -h 200 -s 2500 || STATUS=1
+exit $STATUS